@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +18,28 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include <sys/sysinfo.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <getopt.h>
+#include <poll.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <glob.h>
+#include <stdint.h>
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <sys/fanotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <ftw.h>
 
 /* Configuration Constants */
 #define OUTPUT_BUFFER_SIZE 4096
@@ -27,15 +50,171 @@
 #define TEMP_FILE "results.txt"
 #define KALI_SOURCES_FILE "/etc/apt/sources.list.d/blackutil.list"
 #define KALI_KEYRING_URL "https://http.kali.org/pool/main/k/kali-archive-keyring/kali-archive-keyring_2024.1_all.deb"
+#define KALI_KEYRING_VERSION "2024.1"
+#define KALI_KEYRING_SHA256 ""     // Pin the keyring package here; while empty only its key is used
+#define KALI_ARCHIVE_KEY_FPR "44C6513A8E4FB3D30875F758ED444FF07D8D0BF6"
+#define KALI_KEYRING_MEMBER "./usr/share/keyrings/kali-archive-keyring.gpg"
+#define KALI_TRUSTED_KEYRING "/etc/apt/trusted.gpg.d/kali-archive-keyring.gpg"
 #define KALI_REPO_LINE "deb http://http.kali.org/kali kali-rolling main contrib non-free non-free-firmware"
-#define TEMP_KEYRING_DEB "/tmp/kali-keyring.deb"
+#define STATE_DIR "/var/lib/blackutility"
+#define JOURNAL_FILE STATE_DIR "/journal"
+#define JOURNAL_VERSION 2
+#define JOURNAL_SYNC_RECORDS 64
+#define PACMAN_SYNC_DIR "/var/lib/pacman/sync"
+#define APT_LISTS_DIR "/var/lib/apt/lists"
+#define PACMAN_CONF "/etc/pacman.conf"
+#define APT_SOURCES_LIST "/etc/apt/sources.list"
+#define APT_SOURCES_DIR "/etc/apt/sources.list.d"
+#define SYNC_STATE_FILE STATE_DIR "/sync-state"
+#define FINGERPRINT_FILE STATE_DIR "/fingerprint"
+#define FINGERPRINT_MAX_AGE (7 * 24 * 3600)  // Full run at least this often to pick up upstream changes
+#define CACHE_DIR "/var/cache/blackutility"
+#define TRUST_CACHE_DIR CACHE_DIR "/trust"
+#define TRUST_MANIFEST TRUST_CACHE_DIR "/manifest"
+#define TRUST_MAX_AGE 2592000        // 30 days before cached trust material is revalidated
+#define BLACKARCH_KEY_FPR "4345771566D76038C7FEB43863EC0ADBEA87E4E3"
+#define KEYSERVER_URL "https://keyserver.ubuntu.com/pks/lookup?op=get&options=mr&search=0x"
+#define BLACKARCH_REPO "blackarch"
+#define BLACKARCH_SERVER "https://blackarch.org/blackarch/$repo/os/$arch"
+
+/* Database Freshness */
+#define DEFAULT_SYNC_MAX_AGE 3600    // Seconds a verified database is trusted without asking the mirror
+#define FRESHNESS_TIMEOUT 10
+#define MAX_REPOS 64
+#define MAX_INCLUDE_DEPTH 4
 
 /* System Requirements */
-#define MIN_DISK_SPACE 10737418240  // 10GB in bytes
 #define MIN_RAM 4096                 // 4GB in MB
 #define MAX_RETRIES 3
 #define TIMEOUT_SECONDS 300
 
+/* Install Batching and Disk Admission */
+#define DEFAULT_BATCH_SIZE 16
+#define MIN_BATCH_SIZE 4
+#define MAX_BATCH_SIZE 48
+#define DEFAULT_PACKAGE_SIZE 67108864ULL   // 64MB estimate when metadata is missing
+#define DISK_RESERVE_BYTES 536870912ULL    // 512MB kept free on every mount
+#define ADMISSION_WAIT_SECONDS 300
+#define ADMISSION_POLL_SECONDS 10
+#define PACMAN_CACHE_DIR "/var/cache/pacman/pkg"
+#define PACMAN_LOCAL_DIR "/var/lib/pacman/local"
+#define DPKG_STATUS_FILE "/var/lib/dpkg/status"
+#define APT_EXTENDED_STATES "/var/lib/apt/extended_states"
+#define DPKG_INFO_DIR "/var/lib/dpkg/info"
+#define APT_CACHE_DIR "/var/cache/apt/archives"
+
+/* Install History */
+#define HISTORY_FILE STATE_DIR "/history"
+#define HISTORY_WEIGHT 0.3           // Weight of the newest batch in the moving averages
+#define HISTORY_DEFAULT_THROUGHPUT 8388608.0  // Bytes per second before any batch was timed
+#define HISTORY_PACKAGE_SECONDS 1.0  // Fixed cost per package when estimating from its size
+
+/* Package Catalog */
+#define ARENA_BLOCK_SIZE 1048576
+#define CATALOG_INITIAL_PACKAGES 256
+#define INTERN_INITIAL_STRINGS 1024
+#define METADATA_QUERY_CHUNK 256
+#define NO_PACKAGE UINT32_MAX
+#define PKG_FLAG_PLANNED 0x01        // In the install plan rather than only a dependency
+#define PKG_FLAG_QUERIED 0x02        // Sync metadata already read
+#define PKG_FLAG_INSTALLED 0x04      // Present in the local package database
+#define PKG_FLAG_OUTDATED 0x08       // Installed, with a newer version in the sync databases
+#define PKG_FLAG_EXPLICIT 0x10       // Installed on request rather than as a dependency
+#define PKG_FLAG_ESSENTIAL 0x20      // Essential or required: never removed
+#define CATALOG_SNAPSHOT_FILE CACHE_DIR "/catalog"
+#define SELECTION_BASELINE_FILE STATE_DIR "/selection-baseline"
+#define USAGE_FILE STATE_DIR "/usage"
+#define USAGE_FLUSH_INTERVAL 300     // Seconds between usage file writes while watching
+#define SNAPSHOT_MAGIC "BUCATLG"
+#define SNAPSHOT_VERSION 4
+#define VERSION_CHECK_PAIRS 2000     // Pairs vercmp checks against the reference tool at most
+#define REMOVE_COMMAND_LIMIT 65536   // Bytes of package names one removal transaction takes
+
+/* Command Lookup */
+#define COMMAND_INDEX_FILE CACHE_DIR "/commands"
+#define COMMAND_INDEX_MAGIC "BUCMDIX"
+#define COMMAND_INDEX_VERSION 2
+#define COMMAND_BUCKET_KEYS 4        // Average names per displacement bucket
+#define COMMAND_MAX_SEED 1048576     // Displacements tried for one bucket before the table grows
+#define COMMAND_SOCKET "/run/blackutility.sock"
+#define COMMAND_REQUEST_TIMEOUT 5000 // Milliseconds a client has to send its whole request
+
+/* Tool Search */
+#define TRIGRAM_SYMBOLS 37           // Word boundary, a-z and 0-9
+#define TRIGRAM_SPACE (TRIGRAM_SYMBOLS * TRIGRAM_SYMBOLS * TRIGRAM_SYMBOLS)
+#define MAX_PACKAGE_TRIGRAMS 2048
+#define MAX_QUERY_TRIGRAMS 256
+#define MAX_QUERY_WORDS 16
+#define SEARCH_RESULT_LIMIT 25
+#define SEARCH_RANK_LIMIT 256        // Matches scored on their strings after the posting rank
+#define SEARCH_MAX_RANK 300          // Posting rank when every trigram is in the name
+#define POSTING_IN_NAME 0x1          // Low bit of a posting, above it the package id
+#define POSTING_MAX_PACKAGES (UINT32_MAX >> 1)
+
+/* Tool Profiles */
+#define PROFILE_DIR "/etc/blackutility/profiles"
+#define PROFILE_CACHE_DIR CACHE_DIR "/profiles"
+#define PROFILE_CACHE_MAGIC "BUPROFL"
+#define PROFILE_CACHE_VERSION 1
+#define MAX_PROFILES 8
+
+/* Priority Tiers */
+#define TIER_COUNT 4
+#define DEFAULT_TIER (TIER_COUNT - 1)    // Tools no tier rule or popularity rank places
+#define POPULARITY_FILE "/etc/blackutility/popularity"
+#define POPULAR_TIER0_TOOLS 25           // Most popular selected tools, installed first
+#define POPULAR_TIER1_TOOLS 150
+#define MAX_PROFILE_RULES 128
+
+/* Pinned Plans */
+#define PLAN_FILE_HEADER "# blackutility install plan"
+#define PLAN_FILE_FORMAT 1
+#define PLAN_FETCH_TIMEOUT 600
+
+/* Package Status Values */
+#define PKG_STATUS_PENDING "pending"
+#define PKG_STATUS_DEFERRED "deferred"
+#define PKG_STATUS_INSTALLED "installed"
+#define PKG_STATUS_FAILED "failed"
+#define PKG_STATUS_SKIPPED "skipped"
+
+/* Child Scheduling Defaults */
+#define DEFAULT_NICE_LEVEL 10
+#define DEFAULT_IOPRIO_CLASS IOPRIO_CLASS_BE
+#define DEFAULT_IOPRIO_LEVEL 7
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_WHO_PGRP 2
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+/* Pressure Stall Throttling */
+#define PSI_CPU_THRESHOLD 60.0       // "some" avg10 percentages
+#define PSI_IO_THRESHOLD 40.0
+#define PSI_MEMORY_THRESHOLD 20.0
+#define PSI_RESUME_RATIO 0.5         // Resume once pressure falls below half the threshold
+#define PSI_POLL_INTERVAL_MS 1000
+#define PSI_MAX_PAUSE_SECONDS 900
+#define DEFAULT_DOWNLOAD_JOBS 5
+#define MAX_DOWNLOAD_JOBS 32
+#define PACMAN_DOWNLOAD_CONFIG STATE_DIR "/pacman-download.XXXXXX"
+
+/* Setup Task Graph */
+#define MAX_SETUP_TASKS 32
+#define MAX_TASK_DEPS 12
+#define DEFAULT_SETUP_JOBS 4
+#define MAX_SETUP_JOBS 16
+#define MAX_ACTIVE_CHILDREN 32
+
+/* Host Probe */
+#define HOST_PROBE_FILE CACHE_DIR "/host-probe"
+#define BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
+#define OS_RELEASE_FILE "/etc/os-release"
+#define MAX_PROBE_MOUNTS 3
+
 /* UI Constants */
 #define LOADER_WIDTH 50
 #define LOADER_UPDATE_INTERVAL 100000  // 100ms in microseconds
@@ -81,6 +260,13 @@
 #define BG_GREEN      ESC "[48;2;80;250;123m"
 #define BG_BLUE       ESC "[48;2;98;114;164m"
 
+/* Kali metapackage categories making up the default Debian selection */
+static const char* const KALI_TOOL_CATEGORIES[] = {
+    "information-gathering", "vulnerability-analysis", "wireless-attacks", "web-applications",
+    "exploitation-tools", "forensics-tools", "stress-testing", "password-attacks",
+    "reverse-engineering", "sniffing-spoofing", NULL
+};
+
 /* Program Banner */
 const char* BANNER = 
     "\n" FG_CYAN BOLD
@@ -103,6 +289,7 @@ typedef enum {
 
 /* Global Variables */
 static struct termios orig_termios;
+static char download_config_path[sizeof(PACMAN_DOWNLOAD_CONFIG)] = "";
 static int terminal_initialized = 0;
 volatile sig_atomic_t keep_running = 1;
 volatile sig_atomic_t cleanup_needed = 0;
@@ -124,25 +311,493 @@ typedef struct {
     const char* message;
     const char* status;
     time_t start_time;
-    time_t estimated_completion;
+    time_t estimated_completion;        // 0 until the first estimate
+    unsigned long long total_bytes;     // Download plus installed bytes of the queued packages
+    unsigned long long done_bytes;
+    double throughput;                  // Bytes per second over this run's recent batches
 } ProgressBar;
 
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    int dedicated;                      // Holds a single large region
+    _Alignas(16) unsigned char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* blocks;
+    size_t reserved;                    // Bytes held by all blocks
+} Arena;
+
+typedef uint32_t StringId;
+
+typedef struct {
+    const char** strings;               // Indexed by StringId, 0 is the empty string
+    uint32_t* hashes;
+    uint32_t* package_ids;              // Package named by each string, or NO_PACKAGE
+    uint32_t count;
+    uint32_t capacity;
+    StringId* buckets;                  // Open addressing, 0 marks a free slot
+    uint32_t bucket_mask;
+} StringTable;
+
+typedef enum {
+    PKG_PENDING,
+    PKG_DEFERRED,
+    PKG_INSTALLED,
+    PKG_FAILED,
+    PKG_SKIPPED
+} PackageState;
+
+/* Packages are dense ids into column arrays. Strings are interned, and
+ * dependencies are kept in compressed sparse row form once built: the
+ * dependencies of p are dep_ids[dep_offsets[p] .. dep_offsets[p + 1]). */
+typedef struct {
+    Arena arena;
+    StringTable strings;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t planned;
+    
+    StringId* names;
+    StringId* versions;
+    StringId* groups;                   // Space separated when a package has several
+    StringId* descriptions;
+    StringId* replaces;                 // First name this package replaces (a rename), 0 when none
+    uint64_t* size_bytes;
+    uint64_t* download_bytes;
+    int64_t* install_times;
+    uint8_t* states;
+    uint8_t* flags;
+    uint8_t* retries;
+    StringId* local_versions;           // Version in the local database, 0 when not installed
+    uint32_t* providers;                // Package providing this name plus one, 0 when none
+    
+    uint32_t* dep_offsets;
+    uint32_t* dep_ids;
+    uint32_t dep_total;
+    uint32_t dep_packages;              // Packages covered by dep_offsets
+    
+    uint32_t* edges;                    // (from, to) pairs gathered before the CSR build
+    uint32_t edge_count;
+    uint32_t edge_capacity;
+    
+    /* Trigram index over names, groups and descriptions: the packages holding
+     * trigram t are trigram_postings[trigram_offsets[t] .. trigram_offsets[t + 1]),
+     * each stored as id << 1 with POSTING_IN_NAME set when the name holds it */
+    uint32_t* trigram_offsets;
+    uint32_t* trigram_postings;
+    uint32_t posting_total;
+    
+    void* mapping;                      // Snapshot the columns were loaded from
+    size_t mapping_size;
+    uint64_t source_stamp;              // sync_db_stamp of its databases, 0 when unknown
+    int all_alternatives;               // Local database: every alternative of a dependency is an edge
+    int recommends;                     // Local database: Recommends are edges too, as apt keeps them
+} Catalog;
+
+typedef struct {
+    uint32_t id;
+    int score;
+} SearchHit;
+
+/* Sections of a catalog snapshot, each 8-byte aligned at a file offset */
+enum {
+    SECTION_STRING_OFFSETS,
+    SECTION_STRING_HASHES,
+    SECTION_STRING_PACKAGES,
+    SECTION_BUCKETS,
+    SECTION_STRING_DATA,
+    SECTION_NAMES,
+    SECTION_VERSIONS,
+    SECTION_GROUPS,
+    SECTION_DESCRIPTIONS,
+    SECTION_REPLACES,
+    SECTION_SIZES,
+    SECTION_DOWNLOADS,
+    SECTION_FLAGS,
+    SECTION_PROVIDERS,
+    SECTION_DEP_OFFSETS,
+    SECTION_DEP_IDS,
+    SECTION_TRIGRAM_OFFSETS,
+    SECTION_TRIGRAM_POSTINGS,
+    SNAPSHOT_SECTIONS
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t sys_type;
+    uint64_t source_stamp;              // sync_db_stamp of the databases it was built from
+    uint64_t file_size;
+    uint32_t package_count;
+    uint32_t string_count;
+    uint32_t bucket_count;
+    uint32_t dep_total;
+    uint32_t posting_total;
+    uint32_t reserved;
+    uint64_t offsets[SNAPSHOT_SECTIONS];
+    uint64_t lengths[SNAPSHOT_SECTIONS];
+} SnapshotHeader;
+
+typedef struct {
+    const char* path;                   // First of the checked paths on this filesystem
+    unsigned long long required;
+    unsigned long long available;
+} MountUsage;
+
+typedef struct {
+    uint32_t selected;                  // Planned packages still to install
+    uint32_t closure;                   // Packages the run adds, dependencies included
+    uint32_t installed;                 // Names the local database already satisfies
+    uint32_t cached;                    // Closure packages whose archive is already downloaded
+    uint32_t unresolved;                // Names no sync package is or provides
+    unsigned long long download_bytes;
+    unsigned long long install_bytes;
+    int transactions;
+    MountUsage mounts[MAX_PROBE_MOUNTS];
+    int mount_count;
+    double milliseconds;
+    uint32_t* order;                    // Closure with dependencies first, caller frees
+} InstallPlan;
+
+typedef struct {
+    uint32_t* order;                    // Packages to remove, dependents first, caller frees
+    uint32_t count;
+    uint32_t targets;                   // Selected tools among them
+    uint32_t orphans;                   // Dependencies nothing staying needs
+    uint32_t kept;                      // Selected tools something staying still needs
+    uint32_t missing;                   // Selected names that are not installed
+    unsigned long long bytes;           // Installed size of everything removed
+    int transactions;
+    double milliseconds;
+} RemovalPlan;
+
+/* Where a tool's last use comes from */
+typedef enum {
+    USAGE_FROM_INSTALL,                 // Installed or upgraded, not used since
+    USAGE_FROM_ATIME,
+    USAGE_FROM_EXEC,                    // Recorded by usage --watch
+    USAGE_UNTRACKED                     // No executables to judge by
+} UsageSource;
+
+/* Executables of the tracked packages, looked up by the real path of the
+ * file that runs, which is what exec events and access times refer to */
+typedef struct {
+    StringId* paths;                    // Interned in the catalog
+    uint32_t* packages;                 // Owning package of each path
+    uint8_t* unresolved;                // Per package: an entry point whose target is missing
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* slots;                    // Open addressing on the path hash: index plus one, 0 when empty
+    uint32_t slot_count;                // Power of two
+} ExecutableIndex;
+
+/* One package of a pinned plan: the exact archive a host fetches and installs */
 typedef struct {
+    int batch;
     char name[MAX_LINE_LENGTH];
-    char version[MAX_LINE_LENGTH];
-    char status[MAX_LINE_LENGTH];
-    int retry_count;
-    time_t install_time;
-    size_t size_bytes;
-} Package;
+    char version[128];
+    char filename[MAX_LINE_LENGTH];
+    char sha256[65];
+    unsigned long long download_bytes;
+    unsigned long long install_bytes;
+    char url[MAX_LINE_LENGTH * 4];
+} PlanEntry;
+
+typedef struct {
+    char** names;                       // Sorted
+    size_t count;
+} CacheListing;
+
+typedef enum {
+    RULE_INCLUDE,
+    RULE_EXCLUDE,
+    RULE_PIN,
+    RULE_TIER
+} RuleAction;
+
+typedef enum {
+    RULE_NAME,
+    RULE_GROUP,
+    RULE_GLOB,
+    RULE_REGEX
+} RuleMatch;
+
+typedef struct {
+    RuleAction action;
+    RuleMatch match;
+    char pattern[MAX_LINE_LENGTH];
+    regex_t regex;                      // Compiled for RULE_REGEX only
+    int tier;                           // RULE_TIER only
+} ProfileRule;
+
+typedef struct {
+    ProfileRule rules[MAX_PROFILE_RULES];
+    int rule_count;
+    uint64_t max_size;                  // Installed bytes, 0 for no limit
+} Profile;
+
+/* A compiled selection is valid for one profile file and one catalog */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t package_count;
+    uint64_t profile_hash;
+    uint64_t catalog_stamp;
+} ProfileCacheHeader;
+
+/* Executable name to package, as a perfect hash: a name's bucket gives the
+ * seed that places it in a slot no other name takes */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t sys_type;
+    uint64_t source_stamp;              // sync_db_stamp of the databases it was built from
+    uint64_t file_size;
+    uint32_t command_count;
+    uint32_t bucket_count;
+    uint32_t slot_count;
+    uint32_t string_size;
+} CommandIndexHeader;
+
+typedef struct {
+    uint32_t name;                      // String offsets, UINT32_MAX in an empty slot
+    uint32_t package;                   // Every provider, space separated
+} CommandSlot;
+
+typedef struct {
+    void* mapping;
+    size_t size;
+    const CommandIndexHeader* header;
+    const uint32_t* seeds;              // Per bucket, 0 when the bucket is empty
+    const CommandSlot* slots;
+    const char* strings;
+} CommandIndex;
+
+typedef struct {
+    char* strings;                      // Names and packages, each NUL-terminated
+    size_t string_size;
+    size_t string_capacity;
+    uint32_t* names;
+    uint32_t* packages;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* seen;                     // Command number + 1 by name hash, to drop repeats
+    uint32_t seen_mask;
+    uint32_t last_package;              // File lists repeat one package line after line
+} CommandList;
+
+/* What the install service keeps between requests */
+typedef struct {
+    Catalog* catalog;
+    uint8_t* allowed;                   // Packages the configured selection covers
+    uint32_t allowed_count;
+    uint64_t stamp;                     // Databases the catalog and command index came from
+} ServeState;
+
+/* Install durations of earlier runs, to estimate this one */
+typedef struct {
+    double* seconds;                    // Per package moving average, 0 when never timed
+    double throughput;                  // Bytes per second over whole batches, 0 when unknown
+} InstallHistory;
 
 typedef struct {
     int total_packages;
     int completed_packages;
     char current_package[MAX_LINE_LENGTH];
     int show_details;
+    ProgressBar bar;
+    int live;                           // Redraw while a transaction runs
+    unsigned long long batch_bytes;     // Of the running transaction
+    double batch_estimate;              // Its calibrated duration in seconds
+    struct timespec batch_start;
 } GlobalProgress;
 
+typedef enum {
+    COMMAND_INSTALL,
+    COMMAND_SEARCH,
+    COMMAND_PLAN,
+    COMMAND_APPLY,
+    COMMAND_UPGRADE,
+    COMMAND_VERCMP,
+    COMMAND_REMOVE,
+    COMMAND_FOOTPRINT,
+    COMMAND_USAGE,
+    COMMAND_PRUNE,
+    COMMAND_INDEX,
+    COMMAND_NOT_FOUND,
+    COMMAND_SERVE
+} CommandType;
+
+typedef struct {
+    int nice_level;
+    int ioprio_class;
+    int ioprio_level;
+    int sched_idle;
+    int psi_enabled;
+    double psi_cpu_threshold;
+    double psi_io_threshold;
+    double psi_memory_threshold;
+    int psi_max_pause;
+    int download_jobs;
+    int resume;
+    int sync_max_age;
+    int force_sync;
+    int setup_jobs;
+    int batch_size;
+    int benchmark_runs;
+    const char* profiles[MAX_PROFILES];
+    int profile_count;
+    CommandType command;
+    const char* plan_output;            // plan --output: where to write the pinned plan
+    int new_only;                       // Install only what the catalog gained since the baseline
+    int dry_run;                        // Plan only: installs become the plan command
+    int json_output;                    // footprint --json
+    int watch_usage;                    // usage --watch: record executions until stopped
+    int unused_for;                     // prune --unused-for, in seconds
+    int time_budget;                    // --time-budget, in seconds: stop at a batch boundary
+    char** command_args;                // Operands following the command name
+    int command_arg_count;
+} Config;
+
+typedef struct {
+    char name[64];
+    char server[MAX_LINE_LENGTH * 2];   // First mirror with $repo and $arch expanded
+    char body[MAX_LINE_LENGTH * 4];     // Section lines as written, Include= left unexpanded
+} PacmanRepo;
+
+typedef struct {
+    char options[OUTPUT_BUFFER_SIZE];   // [options] lines as written
+    PacmanRepo repos[MAX_REPOS];
+    int repo_count;
+} PacmanConfig;
+
+typedef struct {
+    char uri[MAX_LINE_LENGTH];
+    char suite[128];
+    char file[PATH_MAX];                // Sources file the entry came from
+} AptSource;
+
+typedef enum {
+    PRESSURE_NORMAL,
+    PRESSURE_ELEVATED,
+    PRESSURE_HIGH
+} PressureLevel;
+
+typedef struct {
+    int available;
+    int paused;
+    int child_stopped;
+    int child_reniced;
+    int stoppable;                      // Current child only downloads, so stopping it cannot leave a transaction half applied
+    int pause_spent;                    // A pause hit its limit; no new pause until pressure is normal again
+    int reduction;
+    int events;
+    PressureLevel level;
+    struct timespec last_tick;
+    double throttled_seconds;
+    double paused_seconds;
+} ThrottleState;
+
+typedef struct {
+    FILE* fp;
+    int unsynced;
+} Journal;
+
+typedef struct {
+    const char* path;
+    dev_t device;
+    char fstype[32];
+    int rotational;                     // 1 spinning, 0 solid state, -1 unknown
+    int reflink;
+    unsigned long long free_bytes;      // Refreshed on every run, never cached
+} MountProbe;
+
+typedef struct {
+    SystemType sys_type;
+    char distro[64];
+    int cores;
+    unsigned long long ram_bytes;
+    MountProbe mounts[MAX_PROBE_MOUNTS];
+    int mount_count;
+    int psi_available;
+    int link_mbps;                      // Fastest link that is up, 0 when unknown
+    int probed;
+} HostProbe;
+
+typedef struct {
+    double wall_seconds;
+    double user_seconds;
+    double system_seconds;
+    double blkio_seconds;
+    unsigned long long read_bytes;
+    unsigned long long write_bytes;
+} ChildUsage;
+
+typedef struct {
+    time_t start_time;
+    int children;
+    int failed_children;
+    ChildUsage total;
+    double setup_seconds;
+    double setup_serial_seconds;
+    char critical_path[MAX_LINE_LENGTH];
+    int tier_packages[TIER_COUNT];
+    long tier_finished[TIER_COUNT];     // Seconds into the run, -1 while packages remain
+} RunReport;
+
+typedef enum {
+    TASK_PENDING,
+    TASK_RUNNING,
+    TASK_DONE,
+    TASK_FAILED,
+    TASK_SKIPPED
+} TaskState;
+
+struct TaskGraph;
+
+typedef struct {
+    const char* name;
+    int (*run)(void* arg);
+    void* arg;
+    int deps[MAX_TASK_DEPS];
+    int dep_count;
+    TaskState state;
+    double started;
+    double finished;
+    pthread_t thread;
+    int joinable;                       // Thread started and not yet joined
+    struct TaskGraph* graph;
+} SetupTask;
+
+typedef struct TaskGraph {
+    SetupTask tasks[MAX_SETUP_TASKS];
+    int count;
+    int running;
+    int max_parallel;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct timespec origin;
+} TaskGraph;
+
+typedef struct {
+    SystemType sys_type;
+    int key_present;
+    char key_path[PATH_MAX];
+    int keyring_installed;
+    int keyring_extracted;              // keyring_path is the bare keyring, not the package
+    char keyring_path[PATH_MAX];
+    Catalog* catalog;
+} SetupContext;
+
+typedef struct {
+    const char* category;
+    char output[PATH_MAX];
+    const SetupContext* context;
+} CategorySearch;
+
 /* Global Instances */
 OutputControl g_output = {
     .suppress_output = 1,
@@ -152,12 +807,61 @@ OutputControl g_output = {
 
 GlobalProgress g_progress = {0};
 
+Config g_config = {
+    .nice_level = DEFAULT_NICE_LEVEL,
+    .ioprio_class = DEFAULT_IOPRIO_CLASS,
+    .ioprio_level = DEFAULT_IOPRIO_LEVEL,
+    .sched_idle = 0,
+    .psi_enabled = 1,
+    .psi_cpu_threshold = PSI_CPU_THRESHOLD,
+    .psi_io_threshold = PSI_IO_THRESHOLD,
+    .psi_memory_threshold = PSI_MEMORY_THRESHOLD,
+    .psi_max_pause = PSI_MAX_PAUSE_SECONDS,
+    .download_jobs = 0,
+    .resume = 0,
+    .sync_max_age = DEFAULT_SYNC_MAX_AGE,
+    .force_sync = 0,
+    .setup_jobs = 0,
+    .batch_size = 0,
+    .benchmark_runs = 0,
+    .profile_count = 0,
+    .command = COMMAND_INSTALL,
+    .plan_output = NULL,
+    .new_only = 0,
+    .command_args = NULL,
+    .command_arg_count = 0
+};
+
+ThrottleState g_throttle = { .available = 0 };
+HostProbe g_host = { .sys_type = SYSTEM_UNKNOWN };
+pthread_once_t g_host_once = PTHREAD_ONCE_INIT;
+Journal g_journal = { .fp = NULL, .unsynced = 0 };
+
+RunReport g_report = {0};
+volatile pid_t g_child_pgids[MAX_ACTIVE_CHILDREN] = {0};
+pthread_mutex_t g_report_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int t_setup_worker = 0;
+
 /* Function Declarations */
 void log_message(const char* message, const char* level);
 void cleanup_resources(void);
 void signal_handler(int signum);
 void show_smooth_progress(const char* package, float percentage);
 int execute_command(const char* command);
+int refresh_sync_databases(SystemType sys_type);
+const HostProbe* probe_host(void);
+Catalog* catalog_open(SystemType sys_type);
+void catalog_destroy(Catalog* catalog);
+const char* catalog_string(const Catalog* catalog, StringId id);
+const char* package_name(const Catalog* catalog, uint32_t id);
+int search_catalog(const Catalog* catalog, const char* query, int limit,
+                   SearchHit** hits_out, int* match_count);
+int write_profile_selection(const Catalog* catalog, const char* output_path);
+int select_category(const Catalog* catalog, const char* category, uint32_t** ids_out);
+int plan_fits(const InstallPlan* plan, char* reason, size_t reason_len);
+int parse_int_option(const char* value, long min, long max, int* out);
+double elapsed_ms(const struct timespec* start);
+uint64_t selection_fingerprint(SystemType sys_type);
 
 /* Terminal Handling Functions */
 void disable_raw_mode() {
@@ -206,6 +910,15 @@ void signal_handler(int signum) {
     keep_running = 0;
     cleanup_needed = 1;
     
+    // Children run in their own process group, so forward the interrupt
+    for (int i = 0; i < MAX_ACTIVE_CHILDREN; i++) {
+        pid_t pgid = g_child_pgids[i];
+        if (pgid > 0) {
+            kill(-pgid, signum);
+            kill(-pgid, SIGCONT);
+        }
+    }
+    
     char signal_msg[MAX_LINE_LENGTH];
     snprintf(signal_msg, sizeof(signal_msg), "Received signal %d", signum);
     log_message(signal_msg, "info");
@@ -223,23 +936,48 @@ void alarm_handler(int signum) {
 }
 
 /* File Operations */
+/* Uses an advisory lock so a lock file left behind by a killed run does not
+ * block the next one. The inode check guards against a concurrent unlink. */
 int create_lock_file() {
-    lock_fd = open(LOCK_FILE, O_CREAT | O_EXCL | O_RDWR, 0644);
-    if (lock_fd < 0) {
-        if (errno == EEXIST) {
-            fprintf(stderr, "%sAnother instance is already running%s\n", FG_RED, RESET);
-        } else {
+    while (1) {
+        lock_fd = open(LOCK_FILE, O_CREAT | O_RDWR, 0644);
+        if (lock_fd < 0) {
             perror("Failed to create lock file");
+            return 0;
         }
-        return 0;
+        
+        if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+            if (errno == EWOULDBLOCK) {
+                fprintf(stderr, "%sAnother instance is already running%s\n", FG_RED, RESET);
+            } else {
+                perror("Failed to lock lock file");
+            }
+            close(lock_fd);
+            lock_fd = -1;
+            return 0;
+        }
+        
+        struct stat held, current;
+        if (fstat(lock_fd, &held) == 0 && stat(LOCK_FILE, &current) == 0 &&
+            held.st_ino == current.st_ino && held.st_dev == current.st_dev) {
+            break;
+        }
+        close(lock_fd);
+    }
+    
+    char pid_text[32];
+    int length = snprintf(pid_text, sizeof(pid_text), "%d\n", (int)getpid());
+    if (ftruncate(lock_fd, 0) == 0 && write(lock_fd, pid_text, length) != length) {
+        log_message("Failed to record pid in lock file", "warning");
     }
     return 1;
 }
 
 void release_lock_file() {
     if (lock_fd >= 0) {
-        close(lock_fd);
         unlink(LOCK_FILE);
+        close(lock_fd);
+        lock_fd = -1;
     }
 }
 
@@ -340,6 +1078,17 @@ void show_smooth_progress(const char* package, float percentage) {
     
     printf("%s] %3d%%", RESET, current_percentage);
     
+    const ProgressBar* eta = &g_progress.bar;
+    if (eta->throughput > 0) {
+        printf(" %s%6.1f MB/s%s", FG_WHITE, eta->throughput / (1024.0*1024.0), RESET);
+    }
+    if (eta->estimated_completion > 0 && percentage < 100.0) {
+        long remaining = (long)(eta->estimated_completion - time(NULL));
+        if (remaining < 0) remaining = 0;
+        printf(" %sETA %ld:%02ld:%02ld%s", FG_WHITE, remaining / 3600, (remaining / 60) % 60,
+               remaining % 60, RESET);
+    }
+    
     static char spinner[] = "⠋⠙⠹⠸⠼⠴⠦⠧⠇⠏";
     static int spinner_pos = 0;
     printf(" %s%c%s", FG_CYAN, spinner[spinner_pos++ % strlen(spinner)], RESET);
@@ -347,36 +1096,45 @@ void show_smooth_progress(const char* package, float percentage) {
     fflush(stdout);
 }
 
+/* Share of the run's bytes done, counting the running transaction by how
+ * much of its expected duration has passed. Package counts stand in until
+ * sizes are known. */
+float progress_percentage(void) {
+    const ProgressBar* bar = &g_progress.bar;
+    if (bar->total_bytes == 0) {
+        return g_progress.total_packages > 0
+            ? ((float)g_progress.completed_packages / g_progress.total_packages) * 100.0 : 0.0;
+    }
+    double done = (double)bar->done_bytes;
+    if (g_progress.live && g_progress.batch_estimate > 0) {
+        double fraction = elapsed_ms(&g_progress.batch_start) / 1000.0 / g_progress.batch_estimate;
+        done += (fraction < 0.95 ? fraction : 0.95) * g_progress.batch_bytes;
+    }
+    double percentage = done * 100.0 / bar->total_bytes;
+    return percentage < 100.0 ? (float)percentage : 100.0f;
+}
+
 /* System Check Functions */
 int check_root_privileges(void) {
     return (geteuid() == 0);
 }
 
 int check_system_requirements(void) {
-    struct statvfs fs_stats;
-    if (statvfs("/", &fs_stats) != 0) {
+    const HostProbe* host = probe_host();
+    
+    if (host->mount_count == 0) {
         log_message("Failed to check disk space", "error");
         return 0;
     }
     
-    unsigned long long available_space = fs_stats.f_bsize * fs_stats.f_bavail;
-    if (available_space < MIN_DISK_SPACE) {
-        char space_msg[MAX_LINE_LENGTH];
-        snprintf(space_msg, sizeof(space_msg),
-                "Insufficient disk space. Required: %.2f GB, Available: %.2f GB",
-                (double)MIN_DISK_SPACE / (1024*1024*1024),
-                (double)available_space / (1024*1024*1024));
-        log_message(space_msg, "error");
-        return 0;
-    }
+    // Disk space is checked against the install plan once the selection is known
     
-    struct sysinfo si;
-    if (sysinfo(&si) != 0) {
+    if (host->ram_bytes == 0) {
         log_message("Failed to check system memory", "error");
         return 0;
     }
     
-    unsigned long total_ram_mb = (si.totalram * si.mem_unit) / (1024*1024);
+    unsigned long total_ram_mb = host->ram_bytes / (1024*1024);
     if (total_ram_mb < MIN_RAM) {
         char ram_msg[MAX_LINE_LENGTH];
         snprintf(ram_msg, sizeof(ram_msg),
@@ -387,23 +1145,12 @@ int check_system_requirements(void) {
     }
     
     // Check if running on Arch Linux
-    FILE* os_release = fopen("/etc/os-release", "r");
-    if (!os_release) {
+    if (host->distro[0] == '\0') {
         log_message("Failed to check OS type", "error");
         return 0;
     }
     
-    char line[MAX_LINE_LENGTH];
-    int is_arch = 0;
-    while (fgets(line, sizeof(line), os_release)) {
-        if (strstr(line, "ID=arch")) {
-            is_arch = 1;
-            break;
-        }
-    }
-    fclose(os_release);
-    
-    if (!is_arch) {
+    if (host->sys_type != SYSTEM_ARCH) {
         log_message("This utility requires Arch Linux", "error");
         return 0;
     }
@@ -420,254 +1167,9230 @@ void str_to_upper(char* str) {
 
 /* System Detection Functions */
 SystemType detect_system_type() {
-    FILE* os_release = fopen("/etc/os-release", "r");
-    if (!os_release) {
-        log_message("Failed to detect OS type", "error");
-        return SYSTEM_UNKNOWN;
-    }
+    return probe_host()->sys_type;
+}
 
-    char line[MAX_LINE_LENGTH];
-    SystemType type = SYSTEM_UNKNOWN;
+const char* package_cache_dir(SystemType sys_type) {
+    return (sys_type == SYSTEM_ARCH) ? PACMAN_CACHE_DIR : APT_CACHE_DIR;
+}
 
-    while (fgets(line, sizeof(line), os_release)) {
-        if (strstr(line, "ID=arch")) {
-            type = SYSTEM_ARCH;
-            break;
-        } else if (strstr(line, "ID=debian") || strstr(line, "ID=ubuntu") || 
-                   strstr(line, "ID=kali") || strstr(line, "ID=parrot")) {
-            type = SYSTEM_DEBIAN;
+/* Pressure Stall Functions */
+/* Returns the "some avg10" percentage of a /proc/pressure file, or -1 */
+double read_pressure_avg10(const char* resource) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/pressure/%s", resource);
+    
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return -1.0;
+    }
+    
+    char line[MAX_LINE_LENGTH];
+    double avg10 = -1.0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "some avg10=%lf", &avg10) == 1) {
             break;
         }
     }
-    
-    fclose(os_release);
-    return type;
+    fclose(fp);
+    return avg10;
 }
 
-int setup_kali_repository() {
-    log_message("Setting up Kali Linux repository...", "info");
-
-    char wget_cmd[MAX_CMD_LENGTH];
-    snprintf(wget_cmd, sizeof(wget_cmd), 
-            "wget -q %s -O %s", KALI_KEYRING_URL, TEMP_KEYRING_DEB);
+PressureLevel sample_pressure(void) {
+    if (!g_config.psi_enabled || g_throttle.available == 0) {
+        return PRESSURE_NORMAL;
+    }
     
-    if (!execute_command(wget_cmd)) {
-        log_message("Failed to download Kali keyring", "error");
-        return 0;
+    const char* resources[3] = { "cpu", "io", "memory" };
+    double thresholds[3] = {
+        g_config.psi_cpu_threshold, g_config.psi_io_threshold, g_config.psi_memory_threshold
+    };
+    
+    PressureLevel level = PRESSURE_NORMAL;
+    for (int i = 0; i < 3; i++) {
+        double avg10 = read_pressure_avg10(resources[i]);
+        if (avg10 < 0 || thresholds[i] <= 0) {
+            continue;
+        }
+        if (avg10 >= thresholds[i]) {
+            level = PRESSURE_HIGH;
+        } else if (avg10 >= thresholds[i] * PSI_RESUME_RATIO && level == PRESSURE_NORMAL) {
+            level = PRESSURE_ELEVATED;
+        }
     }
+    
+    return level;
+}
 
-    if (!execute_command("dpkg -i " TEMP_KEYRING_DEB)) {
-        log_message("Failed to install Kali keyring", "error");
-        return 0;
+/* Charges the time since the last tick to the state that was active during it */
+void account_throttle_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    if (g_throttle.last_tick.tv_sec != 0) {
+        double elapsed = (now.tv_sec - g_throttle.last_tick.tv_sec) +
+                         (now.tv_nsec - g_throttle.last_tick.tv_nsec) / 1e9;
+        if (g_throttle.paused) {
+            g_throttle.paused_seconds += elapsed;
+        } else if (g_throttle.level != PRESSURE_NORMAL) {
+            g_throttle.throttled_seconds += elapsed;
+        }
     }
+    g_throttle.last_tick = now;
+}
 
-    FILE* sources = fopen(KALI_SOURCES_FILE, "w");
-    if (!sources) {
-        log_message("Failed to create Kali sources file", "error");
-        return 0;
+void update_pressure_level(PressureLevel level) {
+    account_throttle_time();
+    
+    if (level != PRESSURE_NORMAL && g_throttle.level == PRESSURE_NORMAL) {
+        g_throttle.events++;
+        log_message("System under pressure, throttling installation work", "warning");
+    } else if (level == PRESSURE_NORMAL && g_throttle.level != PRESSURE_NORMAL) {
+        log_message("Pressure subsided, resuming full speed", "info");
+    }
+    
+    // Each elevated sample halves download concurrency further, each normal one restores a step
+    if (level != PRESSURE_NORMAL && (g_config.download_jobs >> g_throttle.reduction) > 1) {
+        g_throttle.reduction++;
+    } else if (level == PRESSURE_NORMAL && g_throttle.reduction > 0) {
+        g_throttle.reduction--;
     }
+    if (level == PRESSURE_NORMAL) {
+        g_throttle.pause_spent = 0;
+    }
+    
+    g_throttle.level = level;
+}
 
-    fprintf(sources, "%s\n", KALI_REPO_LINE);
-    fclose(sources);
+int current_download_jobs(void) {
+    int jobs = g_config.download_jobs >> g_throttle.reduction;
+    return jobs < 1 ? 1 : jobs;
+}
 
-    if (!execute_command("apt-get update")) {
-        log_message("Failed to update package lists", "error");
-        return 0;
+void set_child_group_priority(pid_t pgid, int nice_level, int ioprio_class, int ioprio_level) {
+    setpriority(PRIO_PGRP, pgid, nice_level);
+    if (ioprio_class != IOPRIO_CLASS_NONE) {
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PGRP, pgid,
+                IOPRIO_PRIO_VALUE(ioprio_class, ioprio_level));
     }
-
-    return 1;
 }
 
-/* Package Management Functions */
-int execute_command(const char* command) {
-    int status = system(command);
-    if (status == -1) {
-        log_message("Command execution failed", "error");
-        return 0;
+/* Called periodically while a child runs. Elevated pressure drops the child
+ * group to the lowest priority; high pressure stops a download child until
+ * pressure falls back below the resume level or the pause budget runs out.
+ * Transactions are never stopped, since they hold the package database and
+ * may be mid-unpack; they wait at the next safe point between batches. Once a
+ * pause has run out, nothing is stopped again until pressure is normal. */
+void throttle_child_group(pid_t pgid, time_t* paused_since) {
+    PressureLevel level = sample_pressure();
+    update_pressure_level(level);
+    
+    if (level != PRESSURE_NORMAL && !g_throttle.child_reniced) {
+        set_child_group_priority(pgid, 19, IOPRIO_CLASS_IDLE, 0);
+        g_throttle.child_reniced = 1;
+    } else if (level == PRESSURE_NORMAL && g_throttle.child_reniced) {
+        set_child_group_priority(pgid, g_config.nice_level,
+                                 g_config.ioprio_class, g_config.ioprio_level);
+        g_throttle.child_reniced = 0;
     }
     
-    if (WIFEXITED(status)) {
-        int exit_status = WEXITSTATUS(status);
-        if (exit_status != 0) {
-            char error_msg[MAX_LINE_LENGTH];
-            snprintf(error_msg, sizeof(error_msg), 
-                    "Command failed with exit status: %d", exit_status);
-            log_message(error_msg, "error");
-            return 0;
+    if (level == PRESSURE_HIGH && !g_throttle.child_stopped && g_throttle.stoppable &&
+        !g_throttle.pause_spent && keep_running) {
+        if (kill(-pgid, SIGSTOP) == 0) {
+            g_throttle.child_stopped = 1;
+            g_throttle.paused = 1;
+            *paused_since = time(NULL);
+            log_message("Paused child process group under pressure", "warning");
         }
+    } else if (g_throttle.child_stopped &&
+               (level == PRESSURE_NORMAL || !keep_running ||
+                time(NULL) - *paused_since >= g_config.psi_max_pause)) {
+        kill(-pgid, SIGCONT);
+        g_throttle.child_stopped = 0;
+        g_throttle.paused = 0;
+        g_throttle.pause_spent = level != PRESSURE_NORMAL && keep_running;
+        log_message(level == PRESSURE_NORMAL ? "Resumed child process group"
+                                             : "Resumed child process group after pause limit",
+                    "info");
     }
-    
-    return 1;
 }
 
-int generate_tool_list(void) {
-    SystemType sys_type = detect_system_type();
+/* Safe point between batches: do not start new work while pressure is high,
+ * unless a pause already ran out without pressure ever returning to normal */
+void wait_for_pressure_relief(void) {
+    PressureLevel level = sample_pressure();
+    update_pressure_level(level);
+    if (level != PRESSURE_HIGH || g_throttle.pause_spent) {
+        return;
+    }
     
-    switch (sys_type) {
-        case SYSTEM_ARCH:
-            log_message("Setting up BlackArch repository...", "info");
-            
-            if (!execute_command("grep -q '\\[blackarch\\]' /etc/pacman.conf")) {
-                const char* repo_cmd = "echo -e '[blackarch]\\nServer = https://blackarch.org/blackarch/$repo/os/$arch' >> /etc/pacman.conf";
-                if (!execute_command(repo_cmd)) {
-                    log_message("Failed to add BlackArch repository", "error");
-                    return 0;
-                }
-                
-                if (!execute_command("pacman-key --recv-key 4345771566D76038C7FEB43863EC0ADBEA87E4E3 && "
-                                   "pacman-key --lsign-key 4345771566D76038C7FEB43863EC0ADBEA87E4E3")) {
-                    log_message("Failed to install BlackArch keyring", "error");
-                    return 0;
-                }
-            }
-            
-            if (!execute_command("pacman -Sy")) {
-                log_message("Failed to update package database", "error");
-                return 0;
-            }
-            
-            if (!execute_command("pacman -Sg | grep -i security > " TEMP_FILE)) {
-                log_message("Failed to generate tool list", "error");
-                return 0;
-            }
-            break;
-            
-        case SYSTEM_DEBIAN:
-            if (!setup_kali_repository()) {
-                return 0;
-            }
-            
-            FILE* tool_file = fopen(TEMP_FILE, "w");
-            if (!tool_file) {
-                log_message("Failed to create tool list", "error");
-                return 0;
-            }
-            
-            const char* categories[] = {
-                "information-gathering", "vulnerability-analysis", 
-                "wireless-attacks", "web-applications", "exploitation-tools",
-                "forensics-tools", "stress-testing", "password-attacks",
-                "reverse-engineering", "sniffing-spoofing", NULL
-            };
-            
-            for (int i = 0; categories[i] != NULL; i++) {
-                char cmd[MAX_CMD_LENGTH];
-                snprintf(cmd, sizeof(cmd),
-                        "apt-cache search '%s' | grep -i 'kali' >> " TEMP_FILE,
-                        categories[i]);
-                execute_command(cmd);
-            }
-            
-            fclose(tool_file);
-            break;
-            
-        default:
-            log_message("Unsupported system type", "error");
-            return 0;
+    time_t deadline = time(NULL) + g_config.psi_max_pause;
+    log_message("Pausing installation until pressure subsides", "warning");
+    g_throttle.paused = 1;
+    
+    while (level != PRESSURE_NORMAL && keep_running && time(NULL) < deadline) {
+        show_smooth_progress("Paused: system under pressure...", progress_percentage());
+        usleep(PSI_POLL_INTERVAL_MS * 1000);
+        
+        level = sample_pressure();
+        update_pressure_level(level);
     }
     
-    return 1;
+    account_throttle_time();
+    g_throttle.paused = 0;
+    g_throttle.pause_spent = level != PRESSURE_NORMAL && keep_running;
 }
 
-void install_tools(void) {
-    SystemType sys_type = detect_system_type();
-    if (sys_type == SYSTEM_UNKNOWN) {
-        log_message("Unsupported system type", "error");
-        return;
+/* Child Process Functions */
+void apply_child_priority(void) {
+    if (g_config.sched_idle) {
+        struct sched_param param = { .sched_priority = 0 };
+        sched_setscheduler(0, SCHED_IDLE, &param);
     }
-
-    g_progress.completed_packages = 0;
-    g_progress.show_details = 0;
     
-    FILE* tool_list = fopen(TEMP_FILE, "r");
-    if (!tool_list) {
-        log_message("Failed to open tool list", "error");
-        return;
-    }
+    setpriority(PRIO_PROCESS, 0, g_config.nice_level);
     
-    // Count total packages
+    if (g_config.ioprio_class != IOPRIO_CLASS_NONE) {
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_PRIO_VALUE(g_config.ioprio_class, g_config.ioprio_level));
+    }
+}
+
+/* Reads the I/O accounting of a child that has exited but not been reaped yet.
+ * The kernel folds reaped grandchildren into these counters, so this covers
+ * everything the shell and the package manager spawned. */
+void read_child_io(pid_t pid, ChildUsage* usage) {
+    char path[64];
     char line[MAX_LINE_LENGTH];
-    while (fgets(line, sizeof(line), tool_list)) {
-        line[strcspn(line, "\n")] = 0;
-        if (strlen(line) > 1) {
-            g_progress.total_packages++;
+    
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE* io_fp = fopen(path, "r");
+    if (io_fp) {
+        while (fgets(line, sizeof(line), io_fp)) {
+            sscanf(line, "read_bytes: %llu", &usage->read_bytes);
+            sscanf(line, "write_bytes: %llu", &usage->write_bytes);
         }
+        fclose(io_fp);
     }
     
-    if (g_progress.total_packages == 0) {
-        log_message("No packages found to install", "warning");
-        fclose(tool_list);
-        return;
+    // Field 42 of stat is delayacct_blkio_ticks (zero unless delayacct is on)
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE* stat_fp = fopen(path, "r");
+    if (stat_fp) {
+        char stat_line[1024];
+        if (fgets(stat_line, sizeof(stat_line), stat_fp)) {
+            char* fields = strrchr(stat_line, ')');
+            int field = 2;
+            char* save = NULL;
+            for (char* tok = fields ? strtok_r(fields + 1, " ", &save) : NULL;
+                 tok; tok = strtok_r(NULL, " ", &save)) {
+                if (++field == 42) {
+                    usage->blkio_seconds = (double)strtoull(tok, NULL, 10) / sysconf(_SC_CLK_TCK);
+                    break;
+                }
+            }
+        }
+        fclose(stat_fp);
+    }
+}
+
+/* Children are tracked per slot so interrupts reach every running group,
+ * including those started by parallel setup tasks */
+void track_child_group(pid_t pgid) {
+    for (int i = 0; i < MAX_ACTIVE_CHILDREN; i++) {
+        if (__sync_bool_compare_and_swap(&g_child_pgids[i], 0, pgid)) {
+            return;
+        }
+    }
+}
+
+void untrack_child_group(pid_t pgid) {
+    for (int i = 0; i < MAX_ACTIVE_CHILDREN; i++) {
+        if (__sync_bool_compare_and_swap(&g_child_pgids[i], pgid, 0)) {
+            return;
+        }
+    }
+}
+
+pid_t spawn_child(const char* command, int stdout_fd) {
+    fflush(stdout);
+    fflush(stderr);
+    
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    
+    if (pid == 0) {
+        setpgid(0, 0);
+        apply_child_priority();
+        if (stdout_fd >= 0) {
+            dup2(stdout_fd, STDOUT_FILENO);
+            close(stdout_fd);
+        }
+        execl("/bin/sh", "sh", "-c", command, (char*)NULL);
+        _exit(127);
+    }
+    
+    setpgid(pid, pid);
+    track_child_group(pid);
+    return pid;
+}
+
+/* Blocks until the child exits, sampling pressure once per poll interval */
+void wait_for_child_exit(pid_t pid) {
+    siginfo_t info;
+    
+    // Throttle state tracks a single child, so parallel setup tasks are not throttled
+    int throttled = g_config.psi_enabled && g_throttle.available != 0 && !t_setup_worker;
+    int ticking = g_progress.live && !t_setup_worker;
+    if (throttled || ticking) {
+        int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+        time_t paused_since = 0;
+        
+        while (1) {
+            if (pidfd >= 0) {
+                struct pollfd pfd = { .fd = pidfd, .events = POLLIN, .revents = 0 };
+                int ready = poll(&pfd, 1, PSI_POLL_INTERVAL_MS);
+                if (ready > 0) {
+                    break;
+                }
+                if (ready < 0 && errno != EINTR) {
+                    usleep(PSI_POLL_INTERVAL_MS * 1000);
+                }
+            } else {
+                memset(&info, 0, sizeof(info));
+                if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid) {
+                    break;
+                }
+                usleep(PSI_POLL_INTERVAL_MS * 1000);
+            }
+            if (throttled) {
+                throttle_child_group(pid, &paused_since);
+            }
+            if (ticking) {
+                show_smooth_progress(g_progress.current_package, progress_percentage());
+            }
+        }
+        
+        if (pidfd >= 0) {
+            close(pidfd);
+        }
+        
+        if (throttled) {
+            account_throttle_time();
+            g_throttle.child_stopped = 0;
+            g_throttle.child_reniced = 0;
+            g_throttle.paused = 0;
+        }
+    }
+    
+    // Leave the child as a zombie until its accounting has been read
+    while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1 && errno == EINTR) {}
+}
+
+int reap_child(pid_t pid, const struct timespec* start, ChildUsage* usage) {
+    wait_for_child_exit(pid);
+    read_child_io(pid, usage);
+    
+    int status = 0;
+    struct rusage ru;
+    while (wait4(pid, &status, 0, &ru) == -1) {
+        if (errno != EINTR) {
+            untrack_child_group(pid);
+            return -1;
+        }
+    }
+    untrack_child_group(pid);
+    
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    usage->wall_seconds = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+    usage->user_seconds = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    usage->system_seconds = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    
+    return status;
+}
+
+int run_child(const char* command, ChildUsage* usage) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    pid_t pid = spawn_child(command, -1);
+    if (pid < 0) {
+        return -1;
+    }
+    return reap_child(pid, &start, usage);
+}
+
+void record_child_usage(const char* command, const ChildUsage* usage, int failed) {
+    pthread_mutex_lock(&g_report_lock);
+    g_report.children++;
+    if (failed) {
+        g_report.failed_children++;
+    }
+    g_report.total.wall_seconds += usage->wall_seconds;
+    g_report.total.user_seconds += usage->user_seconds;
+    g_report.total.system_seconds += usage->system_seconds;
+    g_report.total.blkio_seconds += usage->blkio_seconds;
+    g_report.total.read_bytes += usage->read_bytes;
+    g_report.total.write_bytes += usage->write_bytes;
+    pthread_mutex_unlock(&g_report_lock);
+    
+    char usage_msg[MAX_LINE_LENGTH];
+    snprintf(usage_msg, sizeof(usage_msg),
+            "Child [%.60s] wall %.2fs, cpu %.2fs user / %.2fs sys, "
+            "io %.1f MB read / %.1f MB written, blkio wait %.2fs",
+            command, usage->wall_seconds, usage->user_seconds, usage->system_seconds,
+            usage->read_bytes / (1024.0*1024.0), usage->write_bytes / (1024.0*1024.0),
+            usage->blkio_seconds);
+    log_message(usage_msg, "info");
+}
+
+void print_run_report(void) {
+    char report[9 + TIER_COUNT][MAX_LINE_LENGTH];
+    int lines = 0;
+    
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Elapsed time:      %lds",
+            (long)(time(NULL) - g_report.start_time));
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Child processes:   %d (%d failed)",
+            g_report.children, g_report.failed_children);
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Child CPU time:    %.2fs user, %.2fs system",
+            g_report.total.user_seconds, g_report.total.system_seconds);
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Child I/O:         %.1f MB read, %.1f MB written",
+            g_report.total.read_bytes / (1024.0*1024.0),
+            g_report.total.write_bytes / (1024.0*1024.0));
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Child I/O wait:    %.2fs",
+            g_report.total.blkio_seconds);
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Child scheduling:  nice %d, ioprio %d:%d%s",
+            g_config.nice_level, g_config.ioprio_class, g_config.ioprio_level,
+            g_config.sched_idle ? ", SCHED_IDLE" : "");
+    if (g_report.critical_path[0]) {
+        snprintf(report[lines++], MAX_LINE_LENGTH, "Setup time:        %.2fs (%.2fs of serial work)",
+                g_report.setup_seconds, g_report.setup_serial_seconds);
+        snprintf(report[lines++], MAX_LINE_LENGTH, "Critical path:     %.200s", g_report.critical_path);
+    }
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Pressure throttling: %.0fs throttled, %.0fs paused (%d events)",
+            g_throttle.throttled_seconds, g_throttle.paused_seconds, g_throttle.events);
+    for (int t = 0; t < TIER_COUNT; t++) {
+        if (g_report.tier_packages[t] == 0) {
+            continue;
+        }
+        if (g_report.tier_finished[t] >= 0) {
+            snprintf(report[lines++], MAX_LINE_LENGTH, "Tier %d:            %d packages, finished after %lds",
+                    t, g_report.tier_packages[t], g_report.tier_finished[t]);
+        } else {
+            snprintf(report[lines++], MAX_LINE_LENGTH, "Tier %d:            %d packages, unfinished",
+                    t, g_report.tier_packages[t]);
+        }
+    }
+    
+    printf("\n%s%s Run Report%s\n", FG_CYAN, SYMBOL_INFO, RESET);
+    for (int i = 0; i < lines; i++) {
+        printf("  %s%s%s\n", FG_WHITE, report[i], RESET);
+        log_message(report[i], "info");
+    }
+    fflush(stdout);
+}
+
+/* Package Management Functions */
+int execute_command(const char* command) {
+    ChildUsage usage = {0};
+    int status = run_child(command, &usage);
+    if (status == -1) {
+        log_message("Command execution failed", "error");
+        return 0;
+    }
+    
+    int failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    record_child_usage(command, &usage, failed);
+    
+    if (WIFEXITED(status)) {
+        int exit_status = WEXITSTATUS(status);
+        if (exit_status != 0) {
+            char error_msg[MAX_LINE_LENGTH];
+            snprintf(error_msg, sizeof(error_msg), 
+                    "Command failed with exit status: %d", exit_status);
+            log_message(error_msg, "error");
+            return 0;
+        }
+    } else if (WIFSIGNALED(status)) {
+        char error_msg[MAX_LINE_LENGTH];
+        snprintf(error_msg, sizeof(error_msg), 
+                "Command terminated by signal: %d", WTERMSIG(status));
+        log_message(error_msg, "error");
+        return 0;
+    }
+    
+    return 1;
+}
+
+/* Runs a command with its stdout connected to the returned stream.
+ * Must be paired with close_command_output() to reap and account the child. */
+FILE* open_command_output(const char* command, pid_t* pid_out, struct timespec* start) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return NULL;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, start);
+    pid_t pid = spawn_child(command, fds[1]);
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return NULL;
+    }
+    
+    FILE* fp = fdopen(fds[0], "r");
+    if (!fp) {
+        close(fds[0]);
+        kill(-pid, SIGTERM);
+        ChildUsage usage = {0};
+        reap_child(pid, start, &usage);
+        return NULL;
+    }
+    
+    *pid_out = pid;
+    return fp;
+}
+
+int close_command_output(FILE* fp, pid_t pid, const struct timespec* start, const char* command) {
+    fclose(fp);
+    
+    ChildUsage usage = {0};
+    int status = reap_child(pid, start, &usage);
+    if (status == -1) {
+        log_message("Command execution failed", "error");
+        return 0;
+    }
+    
+    int failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    record_child_usage(command, &usage, failed);
+    return !failed;
+}
+
+/* SHA-256 */
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} Sha256;
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(Sha256* ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256_transform(Sha256* ctx, const unsigned char* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+                      ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_update(Sha256* ctx, const void* data, size_t length) {
+    const unsigned char* bytes = data;
+    ctx->length += length;
+    
+    while (length > 0) {
+        size_t take = 64 - ctx->used;
+        if (take > length) take = length;
+        memcpy(ctx->block + ctx->used, bytes, take);
+        ctx->used += take;
+        bytes += take;
+        length -= take;
+        
+        if (ctx->used == 64) {
+            sha256_transform(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+void sha256_final(Sha256* ctx, unsigned char digest[32]) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad = 0x80;
+    sha256_update(ctx, &pad, 1);
+    
+    pad = 0;
+    while (ctx->used != 56) {
+        sha256_update(ctx, &pad, 1);
+    }
+    
+    unsigned char length_be[8];
+    for (int i = 0; i < 8; i++) {
+        length_be[i] = (unsigned char)(bits >> (56 - i * 8));
+    }
+    sha256_update(ctx, length_be, 8);
+    
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+void sha256_hex(const unsigned char digest[32], char hex[65]) {
+    for (int i = 0; i < 32; i++) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+    hex[64] = '\0';
+}
+
+int sha256_file(const char* path, char hex[65]) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        return 0;
+    }
+    
+    Sha256 ctx;
+    sha256_init(&ctx);
+    
+    unsigned char buffer[65536];
+    size_t read_bytes;
+    while ((read_bytes = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        sha256_update(&ctx, buffer, read_bytes);
+    }
+    
+    int ok = !ferror(fp);
+    fclose(fp);
+    
+    unsigned char digest[32];
+    sha256_final(&ctx, digest);
+    sha256_hex(digest, hex);
+    return ok;
+}
+
+/* Trust Cache Functions */
+int make_directories(const char* path, mode_t mode) {
+    char partial[PATH_MAX];
+    snprintf(partial, sizeof(partial), "%s", path);
+    
+    for (char* slash = partial + 1; *slash; slash++) {
+        if (*slash == '/') {
+            *slash = '\0';
+            if (mkdir(partial, mode) != 0 && errno != EEXIST) {
+                return 0;
+            }
+            *slash = '/';
+        }
+    }
+    return mkdir(partial, mode) == 0 || errno == EEXIST;
+}
+
+/* Manifest lines are "<name> <sha256> <verified-epoch>"; the last entry wins */
+int read_trust_entry(const char* name, char sha256[65], time_t* verified) {
+    FILE* fp = fopen(TRUST_MANIFEST, "r");
+    if (!fp) {
+        return 0;
+    }
+    
+    char line[MAX_LINE_LENGTH];
+    char entry[MAX_LINE_LENGTH], digest[65];
+    long long when;
+    int found = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%255s %64s %lld", entry, digest, &when) == 3 && strcmp(entry, name) == 0) {
+            memcpy(sha256, digest, 65);
+            *verified = (time_t)when;
+            found = 1;
+        }
+    }
+    
+    fclose(fp);
+    return found;
+}
+
+void write_trust_entry(const char* name, const char* sha256, time_t verified) {
+    FILE* fp = fopen(TRUST_MANIFEST, "a");
+    if (fp) {
+        fprintf(fp, "%s %s %lld\n", name, sha256, (long long)verified);
+        fclose(fp);
+    }
+}
+
+/* Downloads url into path only when the remote copy is newer than the cached one.
+ * Returns 1 when new content arrived, 0 when the cache is current, -1 on failure. */
+int fetch_if_modified(const char* url, const char* path, const char* temp_path) {
+    char command[MAX_CMD_LENGTH + PATH_MAX * 2];
+    unlink(temp_path);
+    
+    if (access(path, F_OK) == 0) {
+        snprintf(command, sizeof(command),
+                "curl -fsL -R --max-time 60 -z '%s' -o '%s' '%s'", path, temp_path, url);
+    } else {
+        snprintf(command, sizeof(command),
+                "curl -fsL -R --max-time 60 -o '%s' '%s'", temp_path, url);
+    }
+    
+    if (!execute_command(command)) {
+        unlink(temp_path);
+        return -1;
+    }
+    
+    struct stat st;
+    if (stat(temp_path, &st) != 0 || st.st_size == 0) {
+        unlink(temp_path);
+        return 0;
+    }
+    return 1;
+}
+
+/* Returns the cached copy of a trust file, revalidating it against the origin
+ * once it is older than TRUST_MAX_AGE. New content must match the pinned
+ * checksum when one is given; the manifest checksum guards the cached copy. */
+int refresh_trust_file(const char* name, const char* url, const char* pinned_sha256,
+                       char* path, size_t path_size) {
+    if (!make_directories(TRUST_CACHE_DIR, 0755)) {
+        return 0;
+    }
+    snprintf(path, path_size, "%s/%s", TRUST_CACHE_DIR, name);
+    
+    char recorded[65] = "";
+    char actual[65];
+    time_t verified = 0;
+    int cached = read_trust_entry(name, recorded, &verified) &&
+                 sha256_file(path, actual) && strcmp(actual, recorded) == 0 &&
+                 (!pinned_sha256[0] || strcmp(actual, pinned_sha256) == 0);
+    
+    if (cached && time(NULL) - verified <= TRUST_MAX_AGE) {
+        return 1;
+    }
+    
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.part", path);
+    
+    int fetched = fetch_if_modified(url, cached ? path : "", temp_path);
+    if (fetched < 0) {
+        if (cached) {
+            log_message("Trust material origin unreachable, using cached copy", "warning");
+        }
+        return cached;
+    }
+    
+    if (fetched == 0) {
+        write_trust_entry(name, recorded, time(NULL));
+        return cached;
+    }
+    
+    if (!sha256_file(temp_path, actual) ||
+        (pinned_sha256[0] && strcmp(actual, pinned_sha256) != 0)) {
+        char error_msg[MAX_LINE_LENGTH];
+        snprintf(error_msg, sizeof(error_msg), "Checksum mismatch for %.100s, keeping cached copy", name);
+        log_message(error_msg, "error");
+        unlink(temp_path);
+        return cached;
+    }
+    
+    if (rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return cached;
+    }
+    write_trust_entry(name, actual, time(NULL));
+    return 1;
+}
+
+int remove_tree_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)st;
+    (void)ftw;
+    return type == FTW_DP ? rmdir(path) : unlink(path);
+}
+
+/* Removes a scratch directory and everything in it, without following links */
+int remove_tree(const char* path) {
+    return nftw(path, remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS) == 0;
+}
+
+/* Checks that a key file holds the pinned primary key and no other. gpg runs
+ * against a throwaway home that is removed afterwards. */
+int verify_key_fingerprint(const char* path, const char* fingerprint) {
+    char home[] = "/tmp/blackutility-gpg.XXXXXX";
+    if (!mkdtemp(home)) {
+        return 0;
+    }
+    
+    char command[MAX_CMD_LENGTH + PATH_MAX];
+    snprintf(command, sizeof(command),
+            "GNUPGHOME='%s' gpg --batch --no-autostart --with-colons --import-options show-only "
+            "--import '%s' 2>/dev/null", home, path);
+    
+    pid_t pid;
+    struct timespec start;
+    FILE* output = open_command_output(command, &pid, &start);
+    if (!output) {
+        remove_tree(home);
+        return 0;
+    }
+    
+    char line[MAX_LINE_LENGTH];
+    int primaries = 0, matching = 0;
+    int after_pub = 0;
+    while (fgets(line, sizeof(line), output)) {
+        if (strncmp(line, "pub:", 4) == 0) {
+            after_pub = 1;
+        } else if (after_pub && strncmp(line, "fpr:", 4) == 0) {
+            // fpr:::::::::<FINGERPRINT>:
+            char* field = line;
+            for (int i = 0; i < 9 && field; i++) {
+                field = strchr(field, ':');
+                if (field) field++;
+            }
+            primaries++;
+            if (field && strcspn(field, ":") == strlen(fingerprint) &&
+                strncasecmp(field, fingerprint, strlen(fingerprint)) == 0) {
+                matching++;
+            }
+            after_pub = 0;
+        }
+    }
+    
+    close_command_output(output, pid, &start, command);
+    remove_tree(home);
+    return primaries > 0 && matching == primaries;
+}
+
+/* Repository Configuration Functions */
+char* trim_whitespace(char* str) {
+    while (isspace((unsigned char)*str)) str++;
+    char* end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    return str;
+}
+
+/* Replaces every occurrence of a variable such as $repo in place */
+void expand_variable(char* str, size_t size, const char* variable, const char* value) {
+    char expanded[MAX_LINE_LENGTH * 2];
+    char* found;
+    while ((found = strstr(str, variable)) != NULL) {
+        snprintf(expanded, sizeof(expanded), "%.*s%s%s",
+                (int)(found - str), str, value, found + strlen(variable));
+        snprintf(str, size, "%s", expanded);
+    }
+}
+
+PacmanRepo* find_repo(PacmanConfig* config, const char* name) {
+    for (int i = 0; i < config->repo_count; i++) {
+        if (strcmp(config->repos[i].name, name) == 0) {
+            return &config->repos[i];
+        }
+    }
+    return NULL;
+}
+
+void append_config_line(char* buffer, size_t size, const char* line) {
+    size_t used = strlen(buffer);
+    snprintf(buffer + used, size - used, "%s\n", line);
+}
+
+/* Parses one pacman config file. Included files (mirrorlists, globs) are
+ * followed for their Server= entries; their lines are only kept verbatim when
+ * they open sections of their own, since the Include= line is kept instead. */
+void parse_pacman_conf_file(const char* path, PacmanConfig* config, char* section,
+                            int depth, int record) {
+    if (depth > MAX_INCLUDE_DEPTH) {
+        return;
+    }
+    
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return;
+    }
+    
+    struct utsname machine;
+    const char* arch = (uname(&machine) == 0) ? machine.machine : "x86_64";
+    
+    char line[MAX_LINE_LENGTH * 2];
+    while (fgets(line, sizeof(line), fp)) {
+        char* text = trim_whitespace(line);
+        if (*text == '#' || *text == '\0') {
+            continue;
+        }
+        
+        if (*text == '[') {
+            char* close = strchr(text, ']');
+            if (close) {
+                *close = '\0';
+                snprintf(section, 64, "%s", text + 1);
+                record = 1;
+                if (strcmp(section, "options") != 0 && !find_repo(config, section) &&
+                    config->repo_count < MAX_REPOS) {
+                    PacmanRepo* repo = &config->repos[config->repo_count++];
+                    memset(repo, 0, sizeof(PacmanRepo));
+                    snprintf(repo->name, sizeof(repo->name), "%s", section);
+                }
+            }
+            continue;
+        }
+        
+        PacmanRepo* repo = find_repo(config, section);
+        if (record) {
+            if (strcmp(section, "options") == 0) {
+                append_config_line(config->options, sizeof(config->options), text);
+            } else if (repo) {
+                append_config_line(repo->body, sizeof(repo->body), text);
+            }
+        }
+        
+        char* equals = strchr(text, '=');
+        if (!equals) {
+            continue;
+        }
+        *equals = '\0';
+        char* key = trim_whitespace(text);
+        char* value = trim_whitespace(equals + 1);
+        
+        if (strcmp(key, "Include") == 0) {
+            glob_t matches;
+            if (glob(value, 0, NULL, &matches) == 0) {
+                for (size_t i = 0; i < matches.gl_pathc; i++) {
+                    parse_pacman_conf_file(matches.gl_pathv[i], config, section, depth + 1, 0);
+                }
+                globfree(&matches);
+            }
+        } else if (strcmp(key, "Server") == 0 && repo && repo->server[0] == '\0') {
+            snprintf(repo->server, sizeof(repo->server), "%s", value);
+            expand_variable(repo->server, sizeof(repo->server), "$repo", repo->name);
+            expand_variable(repo->server, sizeof(repo->server), "$arch", arch);
+        }
+    }
+    
+    fclose(fp);
+}
+
+/* Loads pacman.conf with up to MAX_REPOS repositories. Caller frees. */
+PacmanConfig* load_pacman_config(void) {
+    PacmanConfig* config = calloc(1, sizeof(PacmanConfig));
+    if (!config) {
+        return NULL;
+    }
+    
+    char section[64] = "";
+    parse_pacman_conf_file(PACMAN_CONF, config, section, 0, 1);
+    return config;
+}
+
+/* Writes a config with the original [options] and every repository. A
+ * positive parallel_downloads replaces the configured ParallelDownloads. */
+int write_pacman_config(FILE* out, const PacmanConfig* config, int parallel_downloads) {    
+    fprintf(out, "[options]\n");
+    const char* line = config->options;
+    while (*line) {
+        const char* end = strchr(line, '\n');
+        size_t length = end ? (size_t)(end - line) : strlen(line);
+        if (parallel_downloads <= 0 || strncmp(line, "ParallelDownloads", 17) != 0) {
+            fprintf(out, "%.*s\n", (int)length, line);
+        }
+        line += length + (end ? 1 : 0);
+    }
+    if (parallel_downloads > 0) {
+        fprintf(out, "ParallelDownloads = %d\n", parallel_downloads);
+    }
+    
+    for (int i = 0; i < config->repo_count; i++) {
+        fprintf(out, "\n[%s]\n%s", config->repos[i].name, config->repos[i].body);
+    }
+    
+    return fclose(out) == 0;
+}
+
+int add_blackarch_repository(void) {
+    FILE* conf = fopen(PACMAN_CONF, "a");
+    if (!conf) {
+        return 0;
+    }
+    fprintf(conf, "\n[%s]\nServer = %s\n", BLACKARCH_REPO, BLACKARCH_SERVER);
+    return fclose(conf) == 0;
+}
+
+void add_apt_source(AptSource* sources, int* count, int max_sources,
+                    const char* uri, const char* suite, const char* path) {
+    if (*count >= max_sources) {
+        return;
+    }
+    AptSource* source = &sources[(*count)++];
+    snprintf(source->uri, sizeof(source->uri), "%s", uri);
+    snprintf(source->suite, sizeof(source->suite), "%s", suite);
+    snprintf(source->file, sizeof(source->file), "%s", path);
+}
+
+/* Parses one-line "deb URI SUITE COMPONENTS" entries of a .list file */
+void parse_apt_list_file(const char* path, AptSource* sources, int* count, int max_sources) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return;
+    }
+    
+    char line[MAX_LINE_LENGTH * 2];
+    while (fgets(line, sizeof(line), fp)) {
+        char* text = trim_whitespace(line);
+        if (strncmp(text, "deb ", 4) != 0) {
+            continue;
+        }
+        text += 4;
+        
+        // Skip an options block such as [arch=amd64 signed-by=...]
+        if (*text == '[') {
+            char* close = strchr(text, ']');
+            if (!close) {
+                continue;
+            }
+            text = close + 1;
+        }
+        
+        char uri[MAX_LINE_LENGTH];
+        char suite[128];
+        if (sscanf(text, "%255s %127s", uri, suite) == 2) {
+            add_apt_source(sources, count, max_sources, uri, suite, path);
+        }
+    }
+    
+    fclose(fp);
+}
+
+/* Parses deb822 stanzas of a .sources file. Every URI/suite pair of an
+ * enabled "deb" stanza becomes one source. */
+void parse_apt_sources_file(const char* path, AptSource* sources, int* count, int max_sources) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return;
+    }
+    
+    char types[MAX_LINE_LENGTH] = "", uris[MAX_LINE_LENGTH] = "", suites[MAX_LINE_LENGTH] = "";
+    int enabled = 1;
+    char line[MAX_LINE_LENGTH * 2];
+    
+    while (1) {
+        char* read = fgets(line, sizeof(line), fp);
+        char* text = read ? trim_whitespace(line) : "";
+        
+        if (*text == '\0') {
+            // End of stanza
+            if (enabled && strstr(types, " deb ") && uris[0] && suites[0]) {
+                char uri_list[MAX_LINE_LENGTH];
+                snprintf(uri_list, sizeof(uri_list), "%s", uris);
+                char* uri_save = NULL;
+                for (char* uri = strtok_r(uri_list, " \t", &uri_save); uri;
+                     uri = strtok_r(NULL, " \t", &uri_save)) {
+                    char suite_list[MAX_LINE_LENGTH];
+                    snprintf(suite_list, sizeof(suite_list), "%s", suites);
+                    char* suite_save = NULL;
+                    for (char* suite = strtok_r(suite_list, " \t", &suite_save); suite;
+                         suite = strtok_r(NULL, " \t", &suite_save)) {
+                        add_apt_source(sources, count, max_sources, uri, suite, path);
+                    }
+                }
+            }
+            types[0] = uris[0] = suites[0] = '\0';
+            enabled = 1;
+            if (!read) {
+                break;
+            }
+            continue;
+        }
+        
+        if (*text == '#') {
+            continue;
+        }
+        
+        char* colon = strchr(text, ':');
+        if (!colon) {
+            continue;
+        }
+        *colon = '\0';
+        char* value = trim_whitespace(colon + 1);
+        
+        if (strcasecmp(text, "Types") == 0) {
+            snprintf(types, sizeof(types), " %s ", value);  // Padded for whole-word matching
+        } else if (strcasecmp(text, "URIs") == 0) {
+            snprintf(uris, sizeof(uris), "%s", value);
+        } else if (strcasecmp(text, "Suites") == 0) {
+            snprintf(suites, sizeof(suites), "%s", value);
+        } else if (strcasecmp(text, "Enabled") == 0) {
+            enabled = strcasecmp(value, "no") != 0;
+        }
+    }
+    
+    fclose(fp);
+}
+
+int load_apt_sources(AptSource* sources, int max_sources) {
+    int count = 0;
+    parse_apt_list_file(APT_SOURCES_LIST, sources, &count, max_sources);
+    
+    DIR* dir = opendir(APT_SOURCES_DIR);
+    if (dir) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t len = strlen(entry->d_name);
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", APT_SOURCES_DIR, entry->d_name);
+            
+            if (len > 5 && strcmp(entry->d_name + len - 5, ".list") == 0) {
+                parse_apt_list_file(path, sources, &count, max_sources);
+            } else if (len > 8 && strcmp(entry->d_name + len - 8, ".sources") == 0) {
+                parse_apt_sources_file(path, sources, &count, max_sources);
+            }
+        }
+        closedir(dir);
+    }
+    
+    return count;
+}
+
+/* Maps a source to the InRelease file apt keeps for it, e.g.
+ * http://http.kali.org/kali kali-rolling -> http.kali.org_kali_dists_kali-rolling_InRelease */
+void apt_release_path(const AptSource* source, char* path, size_t size) {
+    const char* uri = strstr(source->uri, "://");
+    uri = uri ? uri + 3 : source->uri;
+    
+    char mangled[MAX_LINE_LENGTH * 2];
+    snprintf(mangled, sizeof(mangled), "%s/dists/%s/InRelease", uri, source->suite);
+    for (char* c = mangled; *c; c++) {
+        if (*c == '/') *c = '_';
+    }
+    // Collapse the doubled separator a trailing slash in the URI produces
+    char* doubled;
+    while ((doubled = strstr(mangled, "__")) != NULL) {
+        memmove(doubled, doubled + 1, strlen(doubled));
+    }
+    
+    snprintf(path, size, "%s/%s", APT_LISTS_DIR, mangled);
+}
+
+/* Database Freshness Functions */
+time_t read_sync_verified(const char* name) {
+    FILE* fp = fopen(SYNC_STATE_FILE, "r");
+    if (!fp) {
+        return 0;
+    }
+    
+    char line[MAX_LINE_LENGTH * 2];
+    char entry[MAX_LINE_LENGTH];
+    long long verified = 0, found = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%255s %lld", entry, &verified) == 2 && strcmp(entry, name) == 0) {
+            found = verified;
+        }
+    }
+    
+    fclose(fp);
+    return (time_t)found;
+}
+
+/* Records that a database was confirmed current. Appends; the last entry wins
+ * and the file is compacted when it grows past a few hundred lines. */
+void write_sync_verified(const char* name, time_t verified) {
+    mkdir(STATE_DIR, 0755);
+    
+    struct stat st;
+    if (stat(SYNC_STATE_FILE, &st) == 0 && st.st_size > 32 * 1024) {
+        unlink(SYNC_STATE_FILE);
+    }
+    
+    FILE* fp = fopen(SYNC_STATE_FILE, "a");
+    if (fp) {
+        fprintf(fp, "%s %lld\n", name, (long long)verified);
+        fclose(fp);
+    }
+}
+
+/* Asks the mirror whether a remote file is newer than the local copy. Sends
+ * If-Modified-Since and also compares Last-Modified for servers that ignore it.
+ * Returns 1 when unchanged, 0 when newer or the mirror could not be reached. */
+int remote_file_unchanged(const char* url, const char* local_path) {
+    struct stat st;
+    if (stat(local_path, &st) != 0 || strchr(url, '\'') || strchr(local_path, '\'')) {
+        return 0;
+    }
+    
+    char command[MAX_CMD_LENGTH * 2];
+    snprintf(command, sizeof(command),
+            "curl -sSI --max-time %d -z '%s' '%s' 2>/dev/null",
+            FRESHNESS_TIMEOUT, local_path, url);
+    
+    pid_t pid;
+    struct timespec start;
+    FILE* output = open_command_output(command, &pid, &start);
+    if (!output) {
+        return 0;
+    }
+    
+    char line[MAX_LINE_LENGTH];
+    int http_code = 0;
+    time_t last_modified = 0;
+    while (fgets(line, sizeof(line), output)) {
+        int code;
+        if (sscanf(line, "HTTP/%*s %d", &code) == 1) {
+            http_code = code;  // Redirects print several status lines, keep the last
+        } else if (strncasecmp(line, "Last-Modified:", 14) == 0) {
+            struct tm tm = {0};
+            if (strptime(line + 14, " %a, %d %b %Y %H:%M:%S GMT", &tm)) {
+                last_modified = timegm(&tm);
+            }
+        }
+    }
+    
+    int reachable = close_command_output(output, pid, &start, command);
+    if (!reachable) {
+        return 0;
+    }
+    
+    if (http_code == 304) {
+        return 1;
+    }
+    return http_code == 200 && last_modified != 0 && last_modified <= st.st_mtime;
+}
+
+/* Checks one database against the staleness window, then against its mirror */
+int database_current(const char* name, const char* url, const char* local_path, time_t now) {
+    if (access(local_path, F_OK) != 0) {
+        return 0;
+    }
+    
+    time_t verified = read_sync_verified(name);
+    if (verified != 0 && now - verified <= g_config.sync_max_age) {
+        return 1;
+    }
+    
+    if (url[0] == '\0' || !remote_file_unchanged(url, local_path)) {
+        return 0;
+    }
+    
+    write_sync_verified(name, now);
+    return 1;
+}
+
+/* Skips the refresh when every repository database is current. Otherwise all
+ * of them are synced together: refreshing only some would leave the tool
+ * repository built against newer core libraries than the local databases
+ * offer, the partial upgrade Arch does not support. */
+int refresh_pacman_databases(void) {
+    PacmanConfig* config = load_pacman_config();
+    if (!config || config->repo_count == 0 || g_config.force_sync) {
+        free(config);
+        if (!execute_command("pacman -Sy")) {
+            return 0;
+        }
+        config = load_pacman_config();
+        for (int i = 0; config && i < config->repo_count; i++) {
+            write_sync_verified(config->repos[i].name, time(NULL));
+        }
+        free(config);
+        return 1;
+    }
+    
+    time_t now = time(NULL);
+    int stale = 0;
+    for (int i = 0; i < config->repo_count; i++) {
+        PacmanRepo* repo = &config->repos[i];
+        char local_path[PATH_MAX];
+        char url[MAX_LINE_LENGTH * 2 + 80];
+        snprintf(local_path, sizeof(local_path), "%s/%s.db", PACMAN_SYNC_DIR, repo->name);
+        snprintf(url, sizeof(url), "%s/%s.db", repo->server, repo->name);
+        
+        stale += !database_current(repo->name, repo->server[0] ? url : "", local_path, now);
+    }
+    
+    if (stale == 0) {
+        log_message("Package databases are current, skipping refresh", "info");
+        free(config);
+        return 1;
+    }
+    
+    int refreshed = execute_command("pacman -Sy");
+    if (refreshed) {
+        now = time(NULL);
+        for (int i = 0; i < config->repo_count; i++) {
+            write_sync_verified(config->repos[i].name, now);
+        }
+        
+        char refresh_msg[MAX_LINE_LENGTH];
+        snprintf(refresh_msg, sizeof(refresh_msg), "Refreshed all %d repositories, %d were stale",
+                config->repo_count, stale);
+        log_message(refresh_msg, "info");
+    }
+    
+    free(config);
+    return refreshed;
+}
+
+/* The run only installs from the Kali source, so apt is pointed at that list alone */
+int refresh_apt_lists(void) {
+    if (g_config.force_sync) {
+        return execute_command("apt-get update");
+    }
+    
+    AptSource* sources = calloc(MAX_REPOS, sizeof(AptSource));
+    if (!sources) {
+        return execute_command("apt-get update");
+    }
+    
+    int count = 0;
+    parse_apt_list_file(KALI_SOURCES_FILE, sources, &count, MAX_REPOS);
+    
+    time_t now = time(NULL);
+    int current = count > 0;
+    for (int i = 0; i < count && current; i++) {
+        char local_path[PATH_MAX];
+        char url[MAX_LINE_LENGTH + 160];
+        apt_release_path(&sources[i], local_path, sizeof(local_path));
+        snprintf(url, sizeof(url), "%s/dists/%s/InRelease", sources[i].uri, sources[i].suite);
+        current = database_current(strrchr(local_path, '/') + 1, url, local_path, now);
+    }
+    
+    if (current) {
+        log_message("Package lists are current, skipping refresh", "info");
+        free(sources);
+        return 1;
+    }
+    
+    int refreshed = execute_command("apt-get update "
+                                    "-o Dir::Etc::sourcelist=" KALI_SOURCES_FILE " "
+                                    "-o Dir::Etc::sourceparts=- "
+                                    "-o APT::Get::List-Cleanup=0");
+    if (refreshed) {
+        now = time(NULL);
+        for (int i = 0; i < count; i++) {
+            char local_path[PATH_MAX];
+            apt_release_path(&sources[i], local_path, sizeof(local_path));
+            write_sync_verified(strrchr(local_path, '/') + 1, now);
+        }
+    }
+    
+    free(sources);
+    return refreshed;
+}
+
+int refresh_sync_databases(SystemType sys_type) {
+    return (sys_type == SYSTEM_ARCH) ? refresh_pacman_databases() : refresh_apt_lists();
+}
+
+/* Setup Task Graph Functions */
+double graph_seconds(const TaskGraph* graph) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - graph->origin.tv_sec) + (now.tv_nsec - graph->origin.tv_nsec) / 1e9;
+}
+
+void task_graph_init(TaskGraph* graph, int max_parallel) {
+    memset(graph, 0, sizeof(TaskGraph));
+    graph->max_parallel = max_parallel < 1 ? 1 : max_parallel;
+    pthread_mutex_init(&graph->lock, NULL);
+    pthread_cond_init(&graph->changed, NULL);
+}
+
+void task_graph_destroy(TaskGraph* graph) {
+    pthread_mutex_destroy(&graph->lock);
+    pthread_cond_destroy(&graph->changed);
+}
+
+int task_add(TaskGraph* graph, const char* name, int (*run)(void*), void* arg) {
+    if (graph->count >= MAX_SETUP_TASKS) {
+        return -1;
+    }
+    SetupTask* task = &graph->tasks[graph->count];
+    task->name = name;
+    task->run = run;
+    task->arg = arg;
+    task->state = TASK_PENDING;
+    task->graph = graph;
+    return graph->count++;
+}
+
+void task_depends(TaskGraph* graph, int task, int dependency) {
+    if (task < 0 || dependency < 0 || graph->tasks[task].dep_count >= MAX_TASK_DEPS) {
+        return;
+    }
+    SetupTask* entry = &graph->tasks[task];
+    entry->deps[entry->dep_count++] = dependency;
+}
+
+void* task_worker(void* arg) {
+    SetupTask* task = arg;
+    TaskGraph* graph = task->graph;
+    t_setup_worker = 1;
+    
+    int succeeded = task->run(task->arg);
+    
+    // Built while the task is certainly alive, before the graph can move on
+    char fail_msg[MAX_LINE_LENGTH];
+    snprintf(fail_msg, sizeof(fail_msg), "Setup task failed: %.200s", task->name);
+    
+    pthread_mutex_lock(&graph->lock);
+    task->finished = graph_seconds(graph);
+    task->state = succeeded ? TASK_DONE : TASK_FAILED;
+    graph->running--;
+    pthread_cond_broadcast(&graph->changed);
+    pthread_mutex_unlock(&graph->lock);
+    
+    if (!succeeded) {
+        log_message(fail_msg, "error");
+    }
+    return NULL;
+}
+
+/* Walks back from the last task to finish, always through the dependency that
+ * released it last, and records the chain in the run report */
+void report_critical_path(TaskGraph* graph) {
+    int last = -1;
+    double serial = 0.0;
+    for (int i = 0; i < graph->count; i++) {
+        SetupTask* task = &graph->tasks[i];
+        if (task->state != TASK_DONE && task->state != TASK_FAILED) {
+            continue;
+        }
+        serial += task->finished - task->started;
+        if (last < 0 || task->finished > graph->tasks[last].finished) {
+            last = i;
+        }
+    }
+    if (last < 0) {
+        return;
+    }
+    
+    int chain[MAX_SETUP_TASKS];
+    int length = 0;
+    for (int current = last; current >= 0 && length < MAX_SETUP_TASKS; ) {
+        chain[length++] = current;
+        int gate = -1;
+        for (int d = 0; d < graph->tasks[current].dep_count; d++) {
+            int dep = graph->tasks[current].deps[d];
+            if (gate < 0 || graph->tasks[dep].finished > graph->tasks[gate].finished) {
+                gate = dep;
+            }
+        }
+        current = gate;
+    }
+    
+    char path[MAX_LINE_LENGTH] = "";
+    size_t used = 0;
+    for (int i = length - 1; i >= 0 && used < sizeof(path); i--) {
+        SetupTask* task = &graph->tasks[chain[i]];
+        used += snprintf(path + used, sizeof(path) - used, "%s%s %.2fs",
+                         i == length - 1 ? "" : " -> ", task->name, task->finished - task->started);
+    }
+    
+    pthread_mutex_lock(&g_report_lock);
+    g_report.setup_seconds += graph->tasks[last].finished;
+    g_report.setup_serial_seconds += serial;
+    snprintf(g_report.critical_path, sizeof(g_report.critical_path), "%s", path);
+    pthread_mutex_unlock(&g_report_lock);
+    
+    char path_msg[MAX_LINE_LENGTH * 2];
+    snprintf(path_msg, sizeof(path_msg), "Setup finished in %.2fs (%.2fs of serial work), critical path: %s",
+            graph->tasks[last].finished, serial, path);
+    log_message(path_msg, "info");
+}
+
+/* Runs every task once its dependencies are done, at most max_parallel at a
+ * time. A failed task skips everything that depends on it. Returns 1 when all
+ * tasks succeeded. */
+int run_task_graph(TaskGraph* graph) {
+    clock_gettime(CLOCK_MONOTONIC, &graph->origin);
+    pthread_mutex_lock(&graph->lock);
+    
+    while (1) {
+        int waiting = 0;
+        int changed = 0;
+        
+        for (int i = 0; i < graph->count; i++) {
+            SetupTask* task = &graph->tasks[i];
+            if (task->state != TASK_PENDING) {
+                continue;
+            }
+            
+            int ready = 1, blocked = !keep_running;
+            for (int d = 0; d < task->dep_count; d++) {
+                TaskState dep_state = graph->tasks[task->deps[d]].state;
+                if (dep_state == TASK_FAILED || dep_state == TASK_SKIPPED) {
+                    blocked = 1;
+                } else if (dep_state != TASK_DONE) {
+                    ready = 0;
+                }
+            }
+            
+            if (blocked) {
+                task->state = TASK_SKIPPED;
+                changed = 1;
+            } else if (ready && graph->running < graph->max_parallel) {
+                task->state = TASK_RUNNING;
+                task->started = graph_seconds(graph);
+                graph->running++;
+                if (pthread_create(&task->thread, NULL, task_worker, task) == 0) {
+                    task->joinable = 1;
+                } else {
+                    task->finished = task->started;
+                    task->state = TASK_FAILED;
+                    graph->running--;
+                    changed = 1;
+                }
+            } else {
+                waiting++;
+            }
+        }
+        
+        if (changed) {
+            continue;
+        }
+        if (waiting == 0 && graph->running == 0) {
+            break;
+        }
+        pthread_cond_wait(&graph->changed, &graph->lock);
+    }
+    
+    int succeeded = 1;
+    for (int i = 0; i < graph->count; i++) {
+        if (graph->tasks[i].state != TASK_DONE) {
+            succeeded = 0;
+        }
+    }
+    pthread_mutex_unlock(&graph->lock);
+    
+    // Workers are joined so none still touches the graph once it is freed
+    for (int i = 0; i < graph->count; i++) {
+        if (graph->tasks[i].joinable) {
+            pthread_join(graph->tasks[i].thread, NULL);
+            graph->tasks[i].joinable = 0;
+        }
+    }
+    return succeeded;
+}
+
+/* Host Probe Functions */
+SystemType system_type_for_distro(const char* distro) {
+    if (strcmp(distro, "arch") == 0) {
+        return SYSTEM_ARCH;
+    }
+    if (strcmp(distro, "debian") == 0 || strcmp(distro, "ubuntu") == 0 ||
+        strcmp(distro, "kali") == 0 || strcmp(distro, "parrot") == 0) {
+        return SYSTEM_DEBIAN;
+    }
+    return SYSTEM_UNKNOWN;
+}
+
+int probe_distro(void* arg) {
+    HostProbe* host = arg;
+    FILE* os_release = fopen(OS_RELEASE_FILE, "r");
+    if (!os_release) {
+        log_message("Failed to detect OS type", "error");
+        return 0;
+    }
+    
+    char line[MAX_LINE_LENGTH];
+    while (fgets(line, sizeof(line), os_release)) {
+        if (strncmp(line, "ID=", 3) == 0) {
+            char* value = trim_whitespace(line + 3);
+            value[strcspn(value, "\"'")] = '\0';
+            if (*value == '"' || *value == '\'') value++;
+            snprintf(host->distro, sizeof(host->distro), "%s", value);
+            break;
+        }
+    }
+    fclose(os_release);
+    
+    host->sys_type = system_type_for_distro(host->distro);
+    return 1;
+}
+
+/* Counts the CPUs this process may run on, which is what matters inside a
+ * cpuset or container */
+int probe_cpu_memory(void* arg) {
+    HostProbe* host = arg;
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+        host->cores = CPU_COUNT(&cpus);
+    } else {
+        host->cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    
+    struct sysinfo si;
+    if (sysinfo(&si) == 0) {
+        host->ram_bytes = (unsigned long long)si.totalram * si.mem_unit;
+    }
+    return host->cores > 0 && host->ram_bytes > 0;
+}
+
+int probe_psi(void* arg) {
+    HostProbe* host = arg;
+    host->psi_available = read_pressure_avg10("cpu") >= 0 ||
+                          read_pressure_avg10("io") >= 0 ||
+                          read_pressure_avg10("memory") >= 0;
+    return 1;
+}
+
+/* Reads the speed of every non-loopback interface that is up and keeps the fastest */
+int probe_network(void* arg) {
+    HostProbe* host = arg;
+    DIR* dir = opendir("/sys/class/net");
+    if (!dir) {
+        return 1;
+    }
+    
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || strcmp(entry->d_name, "lo") == 0) {
+            continue;
+        }
+        
+        char path[PATH_MAX];
+        char value[32] = "";
+        snprintf(path, sizeof(path), "/sys/class/net/%s/operstate", entry->d_name);
+        FILE* fp = fopen(path, "r");
+        if (!fp) continue;
+        int up = fgets(value, sizeof(value), fp) && strncmp(value, "up", 2) == 0;
+        fclose(fp);
+        if (!up) continue;
+        
+        snprintf(path, sizeof(path), "/sys/class/net/%s/speed", entry->d_name);
+        fp = fopen(path, "r");
+        if (!fp) continue;
+        int speed = 0;
+        if (fscanf(fp, "%d", &speed) == 1 && speed > host->link_mbps) {
+            host->link_mbps = speed;
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+    return 1;
+}
+
+/* Finds the backing block device and filesystem type of a mount in mountinfo.
+ * Filesystems such as btrfs report an anonymous st_dev, so the mount source is
+ * resolved to its real device. */
+dev_t find_mount_source(dev_t device, char* fstype, size_t fstype_size) {
+    FILE* mountinfo = fopen("/proc/self/mountinfo", "r");
+    if (!mountinfo) {
+        return device;
+    }
+    
+    char line[MAX_LINE_LENGTH * 4];
+    dev_t source_device = device;
+    while (fgets(line, sizeof(line), mountinfo)) {
+        unsigned int major_id, minor_id;
+        if (sscanf(line, "%*d %*d %u:%u", &major_id, &minor_id) != 2 ||
+            makedev(major_id, minor_id) != device) {
+            continue;
+        }
+        
+        char* separator = strstr(line, " - ");
+        char type[32], source[PATH_MAX];
+        if (!separator || sscanf(separator + 3, "%31s %4095s", type, source) != 2) {
+            continue;
+        }
+        snprintf(fstype, fstype_size, "%s", type);
+        
+        struct stat source_stat;
+        if (source[0] == '/' && stat(source, &source_stat) == 0 && S_ISBLK(source_stat.st_mode)) {
+            source_device = source_stat.st_rdev;
+        }
+        break;
+    }
+    fclose(mountinfo);
+    return source_device;
+}
+
+/* Partitions have no queue of their own, so the parent disk is tried next */
+int read_rotational(dev_t device) {
+    const char* candidates[2] = { "queue/rotational", "../queue/rotational" };
+    for (int i = 0; i < 2; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s",
+                major(device), minor(device), candidates[i]);
+        FILE* fp = fopen(path, "r");
+        if (!fp) continue;
+        int rotational = -1;
+        if (fscanf(fp, "%d", &rotational) != 1) rotational = -1;
+        fclose(fp);
+        return rotational;
+    }
+    return -1;
+}
+
+/* Tries an actual FICLONE between two scratch files, since reflink support
+ * depends on mkfs options as well as the filesystem type. The files live in a
+ * scratch directory under CACHE_DIR, so only that filesystem can be probed;
+ * the others report no reflink */
+int probe_reflink(dev_t device) {
+    struct stat st;
+    if (!make_directories(CACHE_DIR, 0755) || stat(CACHE_DIR, &st) != 0 || st.st_dev != device) {
+        return 0;
+    }
+    char scratch[PATH_MAX] = CACHE_DIR "/reflink.XXXXXX";
+    if (!mkdtemp(scratch)) {
+        return 0;
+    }
+    char source_path[PATH_MAX + 8], clone_path[PATH_MAX + 8];
+    snprintf(source_path, sizeof(source_path), "%s/source", scratch);
+    snprintf(clone_path, sizeof(clone_path), "%s/clone", scratch);
+    
+    int supported = 0;
+    int source = open(source_path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (source >= 0) {
+        if (write(source, "reflink", 7) == 7) {
+            int clone = open(clone_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+            if (clone >= 0) {
+                supported = ioctl(clone, FICLONE, source) == 0;
+                close(clone);
+            }
+        }
+        close(source);
+    }
+    remove_tree(scratch);
+    return supported;
+}
+
+/* Probes the filesystems holding the root, the package cache and /var, merging
+ * paths that share a filesystem */
+int probe_mounts(void* arg) {
+    HostProbe* host = arg;
+    const char* paths[MAX_PROBE_MOUNTS] = { "/", package_cache_dir(host->sys_type), "/var" };
+    
+    for (int i = 0; i < MAX_PROBE_MOUNTS; i++) {
+        struct stat st;
+        if (stat(paths[i], &st) != 0) {
+            continue;
+        }
+        
+        int seen = 0;
+        for (int m = 0; m < host->mount_count; m++) {
+            seen |= host->mounts[m].device == st.st_dev;
+        }
+        if (seen) {
+            continue;
+        }
+        
+        MountProbe* mount = &host->mounts[host->mount_count++];
+        mount->path = paths[i];
+        mount->device = st.st_dev;
+        dev_t source = find_mount_source(st.st_dev, mount->fstype, sizeof(mount->fstype));
+        mount->rotational = read_rotational(source);
+        mount->reflink = probe_reflink(st.st_dev);
+    }
+    return host->mount_count > 0;
+}
+
+void refresh_mount_space(HostProbe* host) {
+    for (int m = 0; m < host->mount_count; m++) {
+        struct statvfs fs_stats;
+        if (statvfs(host->mounts[m].path, &fs_stats) == 0) {
+            host->mounts[m].free_bytes = (unsigned long long)fs_stats.f_frsize * fs_stats.f_bavail;
+        }
+    }
+}
+
+/* The cache holds only facts that cannot change without a reboot or an OS
+ * upgrade, so it is keyed by the boot id and the os-release mtime */
+void host_probe_key(char* key, size_t size) {
+    char boot_id[64] = "";
+    FILE* fp = fopen(BOOT_ID_FILE, "r");
+    if (fp) {
+        if (!fgets(boot_id, sizeof(boot_id), fp)) boot_id[0] = '\0';
+        boot_id[strcspn(boot_id, "\n")] = '\0';
+        fclose(fp);
+    }
+    
+    struct stat st;
+    long long mtime = stat(OS_RELEASE_FILE, &st) == 0 ? (long long)st.st_mtime : 0;
+    snprintf(key, size, "%s:%lld", boot_id, mtime);
+}
+
+int load_host_probe(HostProbe* host, const char* key) {
+    FILE* fp = fopen(HOST_PROBE_FILE, "r");
+    if (!fp) {
+        return 0;
+    }
+    
+    char line[MAX_LINE_LENGTH];
+    int valid = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        char value[MAX_LINE_LENGTH];
+        unsigned long long number;
+        
+        if (sscanf(line, "key %255s", value) == 1) {
+            valid = strcmp(value, key) == 0;
+            if (!valid) break;
+        } else if (sscanf(line, "distro %63s", host->distro) == 1) {
+            host->sys_type = system_type_for_distro(host->distro);
+        } else if (sscanf(line, "cores %d", &host->cores) == 1) {
+        } else if (sscanf(line, "ram %llu", &number) == 1) {
+            host->ram_bytes = number;
+        } else if (sscanf(line, "psi %d", &host->psi_available) == 1) {
+        } else if (sscanf(line, "link %d", &host->link_mbps) == 1) {
+        } else if (strncmp(line, "mount ", 6) == 0 && host->mount_count < MAX_PROBE_MOUNTS) {
+            MountProbe* mount = &host->mounts[host->mount_count];
+            char path[PATH_MAX];
+            if (sscanf(line, "mount %4095s %llu %d %d %31s", path, &number,
+                       &mount->rotational, &mount->reflink, mount->fstype) != 5) {
+                continue;
+            }
+            // Paths come from a fixed set, so keep pointing at those literals
+            const char* known[MAX_PROBE_MOUNTS] = { "/", package_cache_dir(host->sys_type), "/var" };
+            for (int i = 0; i < MAX_PROBE_MOUNTS; i++) {
+                if (strcmp(path, known[i]) == 0) {
+                    mount->path = known[i];
+                    mount->device = (dev_t)number;
+                    host->mount_count++;
+                    break;
+                }
+            }
+        }
+    }
+    fclose(fp);
+    
+    if (!valid || host->distro[0] == '\0' || host->mount_count == 0) {
+        memset(host, 0, sizeof(HostProbe));
+        host->sys_type = SYSTEM_UNKNOWN;
+        return 0;
+    }
+    return 1;
+}
+
+void save_host_probe(const HostProbe* host, const char* key) {
+    if (!make_directories(CACHE_DIR, 0755)) {
+        return;
+    }
+    
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", HOST_PROBE_FILE);
+    FILE* fp = fopen(temp_path, "w");
+    if (!fp) {
+        return;
+    }
+    
+    fprintf(fp, "key %s\ndistro %s\ncores %d\nram %llu\npsi %d\nlink %d\n",
+            key, host->distro, host->cores, host->ram_bytes, host->psi_available, host->link_mbps);
+    for (int m = 0; m < host->mount_count; m++) {
+        const MountProbe* mount = &host->mounts[m];
+        fprintf(fp, "mount %s %llu %d %d %s\n", mount->path, (unsigned long long)mount->device,
+                mount->rotational, mount->reflink, mount->fstype[0] ? mount->fstype : "unknown");
+    }
+    
+    if (fclose(fp) == 0) {
+        rename(temp_path, HOST_PROBE_FILE);
+    } else {
+        unlink(temp_path);
+    }
+}
+
+void log_host_probe(const HostProbe* host, int cached) {
+    char host_msg[MAX_LINE_LENGTH * 2];
+    int used = snprintf(host_msg, sizeof(host_msg),
+            "Host%s: %s, %d cores, %.1f GB RAM, PSI %s, link %d Mb/s",
+            cached ? " (cached)" : "", host->distro, host->cores,
+            (double)host->ram_bytes / (1024*1024*1024),
+            host->psi_available ? "yes" : "no", host->link_mbps);
+    
+    for (int m = 0; m < host->mount_count && used < (int)sizeof(host_msg); m++) {
+        const MountProbe* mount = &host->mounts[m];
+        used += snprintf(host_msg + used, sizeof(host_msg) - used, "; %s %s %s%s %.1f GB free",
+                mount->path, mount->fstype,
+                mount->rotational < 0 ? "unknown" : (mount->rotational ? "hdd" : "ssd"),
+                mount->reflink ? " reflink" : "", (double)mount->free_bytes / (1024*1024*1024));
+    }
+    log_message(host_msg, "info");
+}
+
+/* Gathers the host facts in parallel on the first call of a boot, from the
+ * cache afterwards. Free space is always read fresh. */
+void run_host_probe(void) {
+    HostProbe* host = &g_host;
+    char key[MAX_LINE_LENGTH];
+    host_probe_key(key, sizeof(key));
+    
+    int cached = load_host_probe(host, key);
+    if (!cached) {
+        TaskGraph* graph = malloc(sizeof(TaskGraph));
+        if (graph) {
+            task_graph_init(graph, MAX_SETUP_JOBS);
+            int distro = task_add(graph, "distro", probe_distro, host);
+            task_add(graph, "cpu-memory", probe_cpu_memory, host);
+            task_add(graph, "psi", probe_psi, host);
+            task_add(graph, "network", probe_network, host);
+            // The package cache to probe depends on the distribution
+            int mounts = task_add(graph, "mounts", probe_mounts, host);
+            task_depends(graph, mounts, distro);
+            
+            if (run_task_graph(graph)) {
+                save_host_probe(host, key);
+            }
+            task_graph_destroy(graph);
+            free(graph);
+        }
+    }
+    
+    refresh_mount_space(host);
+    host->probed = 1;
+    log_host_probe(host, cached);
+}
+
+const HostProbe* probe_host(void) {
+    pthread_once(&g_host_once, run_host_probe);
+    return &g_host;
+}
+
+/* Concurrency Sizing */
+const MountProbe* find_probed_mount(const HostProbe* host, const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return NULL;
+    }
+    for (int m = 0; m < host->mount_count; m++) {
+        if (host->mounts[m].device == st.st_dev) {
+            return &host->mounts[m];
+        }
+    }
+    return NULL;
+}
+
+/* Scales parallel downloads with link speed, held down when the package cache
+ * sits on a spinning disk where concurrent writes turn into seeks */
+int auto_download_jobs(const HostProbe* host) {
+    int jobs = DEFAULT_DOWNLOAD_JOBS;
+    if (host->link_mbps > 0) {
+        if (host->link_mbps < 100) jobs = 3;
+        else if (host->link_mbps < 1000) jobs = 5;
+        else if (host->link_mbps < 10000) jobs = 8;
+        else jobs = 12;
+    }
+    
+    const MountProbe* cache = find_probed_mount(host, package_cache_dir(host->sys_type));
+    if (cache && cache->rotational == 1 && jobs > 3) {
+        jobs = 3;
+    }
+    return jobs;
+}
+
+/* Setup steps are mostly local CPU work (key handling, cache searches) */
+int auto_setup_jobs(const HostProbe* host) {
+    if (host->cores <= 0) {
+        return DEFAULT_SETUP_JOBS;
+    }
+    int jobs = host->cores;
+    if (jobs < 2) jobs = 2;
+    if (jobs > MAX_SETUP_JOBS) jobs = MAX_SETUP_JOBS;
+    return jobs;
+}
+
+/* A transaction holds its whole batch in memory while resolving, so the batch
+ * grows with RAM: two packages per GB */
+int auto_batch_size(const HostProbe* host) {
+    if (host->ram_bytes == 0) {
+        return DEFAULT_BATCH_SIZE;
+    }
+    int size = (int)(host->ram_bytes / (512ULL * 1024 * 1024));
+    if (size < MIN_BATCH_SIZE) size = MIN_BATCH_SIZE;
+    if (size > MAX_BATCH_SIZE) size = MAX_BATCH_SIZE;
+    return size;
+}
+
+/* Fills in every concurrency setting left on auto from the host probe */
+void size_concurrency(void) {
+    const HostProbe* host = probe_host();
+    
+    if (g_config.download_jobs == 0) {
+        g_config.download_jobs = auto_download_jobs(host);
+    }
+    if (g_config.setup_jobs == 0) {
+        g_config.setup_jobs = auto_setup_jobs(host);
+    }
+    if (g_config.batch_size == 0) {
+        g_config.batch_size = auto_batch_size(host);
+    }
+    
+    g_throttle.available = host->psi_available;
+    if (g_config.psi_enabled && !host->psi_available) {
+        log_message("Pressure stall information unavailable, throttling disabled", "warning");
+    }
+    
+    char sizing_msg[MAX_LINE_LENGTH];
+    snprintf(sizing_msg, sizeof(sizing_msg),
+            "Concurrency: %d download jobs, %d setup jobs, batches of %d packages",
+            g_config.download_jobs, g_config.setup_jobs, g_config.batch_size);
+    log_message(sizing_msg, "info");
+}
+
+/* Setup Tasks */
+int task_blackarch_repository(void* arg) {
+    (void)arg;
+    PacmanConfig* pacman_config = load_pacman_config();
+    int has_blackarch = pacman_config && find_repo(pacman_config, BLACKARCH_REPO);
+    free(pacman_config);
+    
+    if (!has_blackarch && !add_blackarch_repository()) {
+        log_message("Failed to add BlackArch repository", "error");
+        return 0;
+    }
+    return 1;
+}
+
+/* Finds the BlackArch key in the pacman keyring or the trust cache, touching
+ * the keyserver only when the cached key is missing or due for revalidation */
+int task_fetch_blackarch_key(void* arg) {
+    SetupContext* context = arg;
+    
+    if (execute_command("pacman-key --list-keys " BLACKARCH_KEY_FPR " >/dev/null 2>&1")) {
+        context->key_present = 1;
+        return 1;
+    }
+    
+    if (!refresh_trust_file(BLACKARCH_KEY_FPR ".asc", KEYSERVER_URL BLACKARCH_KEY_FPR, "",
+                            context->key_path, sizeof(context->key_path))) {
+        return 0;
+    }
+    
+    if (!verify_key_fingerprint(context->key_path, BLACKARCH_KEY_FPR)) {
+        log_message("Cached BlackArch key does not match the pinned fingerprint", "error");
+        unlink(context->key_path);
+        return 0;
+    }
+    return 1;
+}
+
+int task_add_blackarch_key(void* arg) {
+    SetupContext* context = arg;
+    if (context->key_present) {
+        return 1;
+    }
+    
+    char command[MAX_CMD_LENGTH + PATH_MAX];
+    snprintf(command, sizeof(command), "pacman-key --add '%s'", context->key_path);
+    return execute_command(command);
+}
+
+int task_lsign_blackarch_key(void* arg) {
+    (void)arg;
+    return execute_command("pacman-key --lsign-key " BLACKARCH_KEY_FPR " >/dev/null 2>&1");
+}
+
+int task_sync_databases(void* arg) {
+    SetupContext* context = arg;
+    if (!refresh_sync_databases(context->sys_type)) {
+        log_message("Failed to update package database", "error");
+        return 0;
+    }
+    return 1;
+}
+
+int task_pacman_tool_list(void* arg) {
+    (void)arg;
+    return execute_command("pacman -Sg | grep -i security > " TEMP_FILE);
+}
+
+/* Without a pinned package checksum, the keyring is taken out of the package
+ * and trusted only if it holds the pinned Kali archive key and nothing else */
+int extract_kali_keyring(const char* package_path, char* path, size_t path_size) {
+    snprintf(path, path_size, "%s/kali-archive-keyring.gpg", TRUST_CACHE_DIR);
+    char temp_path[PATH_MAX + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.part", path);
+    
+    char command[MAX_CMD_LENGTH + PATH_MAX * 2];
+    snprintf(command, sizeof(command),
+            "dpkg-deb --fsys-tarfile '%s' | tar -xOf - " KALI_KEYRING_MEMBER " > '%s' 2>/dev/null",
+            package_path, temp_path);
+    if (!execute_command(command) || !verify_key_fingerprint(temp_path, KALI_ARCHIVE_KEY_FPR)) {
+        log_message("Kali keyring does not hold only the pinned archive key", "error");
+        unlink(temp_path);
+        return 0;
+    }
+    return rename(temp_path, path) == 0;
+}
+
+/* Fetches the Kali archive keyring into the trust cache unless that version,
+ * or a newer one apt has since installed, is already in place. The package is
+ * checked against KALI_KEYRING_SHA256 when one is pinned, and otherwise only
+ * its key, checked by fingerprint, is used. */
+int task_fetch_kali_keyring(void* arg) {
+    SetupContext* context = arg;
+    
+    if (execute_command("dpkg --compare-versions \"$(dpkg-query -W -f='${Version}' kali-archive-keyring "
+                        "2>/dev/null)\" ge " KALI_KEYRING_VERSION " 2>/dev/null")) {
+        context->keyring_installed = 1;
+        return 1;
+    }
+    
+    const char* name = strrchr(KALI_KEYRING_URL, '/') + 1;
+    if (!refresh_trust_file(name, KALI_KEYRING_URL, KALI_KEYRING_SHA256,
+                            context->keyring_path, sizeof(context->keyring_path))) {
+        return 0;
+    }
+    if (KALI_KEYRING_SHA256[0]) {
+        return 1;
+    }
+    
+    char package_path[PATH_MAX];
+    snprintf(package_path, sizeof(package_path), "%s", context->keyring_path);
+    context->keyring_extracted = 1;
+    return extract_kali_keyring(package_path, context->keyring_path, sizeof(context->keyring_path));
+}
+
+/* Trust material and database freshness probes are fetched with curl, which
+ * minimal Debian images lack, so it is installed from the host's own sources
+ * before either runs */
+int task_require_curl(void* arg) {
+    (void)arg;
+    if (execute_command("command -v curl >/dev/null 2>&1")) {
+        return 1;
+    }
+    log_message("curl not found, installing it", "info");
+    if (!execute_command("DEBIAN_FRONTEND=noninteractive apt-get install -y curl >/dev/null 2>&1")) {
+        log_message("curl is required and could not be installed", "error");
+        return 0;
+    }
+    return 1;
+}
+
+int task_install_kali_keyring(void* arg) {
+    SetupContext* context = arg;
+    if (context->keyring_installed) {
+        return 1;
+    }
+    
+    char command[MAX_CMD_LENGTH + PATH_MAX];
+    if (context->keyring_extracted) {
+        snprintf(command, sizeof(command), "install -m 0644 '%s' " KALI_TRUSTED_KEYRING,
+                context->keyring_path);
+    } else {
+        snprintf(command, sizeof(command), "dpkg -i '%s'", context->keyring_path);
+    }
+    return execute_command(command);
+}
+
+int task_write_kali_sources(void* arg) {
+    (void)arg;
+    FILE* sources = fopen(KALI_SOURCES_FILE, "w");
+    if (!sources) {
+        log_message("Failed to create Kali sources file", "error");
+        return 0;
+    }
+    
+    fprintf(sources, "%s\n", KALI_REPO_LINE);
+    return fclose(sources) == 0;
+}
+
+int task_open_catalog(void* arg) {
+    SetupContext* context = arg;
+    context->catalog = catalog_open(context->sys_type);
+    return context->catalog != NULL;
+}
+
+int task_select_profiles(void* arg) {
+    SetupContext* context = arg;
+    return write_profile_selection(context->catalog, TEMP_FILE);
+}
+
+int task_search_category(void* arg) {
+    CategorySearch* search = arg;
+    const Catalog* catalog = search->context->catalog;
+    FILE* output = fopen(search->output, "w");
+    if (!output) {
+        return 0;
+    }
+    
+    uint32_t* ids;
+    int count = select_category(catalog, search->category, &ids);
+    for (int i = 0; i < count; i++) {
+        fprintf(output, "%s - %s\n", package_name(catalog, ids[i]),
+                catalog_string(catalog, catalog->descriptions[ids[i]]));
+    }
+    
+    free(ids);
+    return fclose(output) == 0;  // No matches is not an error
+}
+
+/* Concatenates the per-category results in category order */
+int task_merge_tool_list(void* arg) {
+    CategorySearch* searches = arg;
+    FILE* tool_file = fopen(TEMP_FILE, "w");
+    if (!tool_file) {
+        log_message("Failed to create tool list", "error");
+        return 0;
+    }
+    
+    for (int i = 0; searches[i].category != NULL; i++) {
+        FILE* part = fopen(searches[i].output, "r");
+        if (!part) {
+            continue;
+        }
+        char buffer[OUTPUT_BUFFER_SIZE];
+        size_t read_bytes;
+        while ((read_bytes = fread(buffer, 1, sizeof(buffer), part)) > 0) {
+            fwrite(buffer, 1, read_bytes, tool_file);
+        }
+        fclose(part);
+        unlink(searches[i].output);
+    }
+    
+    return fclose(tool_file) == 0;
+}
+
+/* Prepares repositories, keys and package databases as a dependency graph so
+ * independent steps overlap, then writes the tool list */
+int generate_tool_list(void) {
+    SetupContext context = { .sys_type = detect_system_type() };
+    
+    // Zero filled, so the entry after the last category ends the list
+    static CategorySearch searches[sizeof(KALI_TOOL_CATEGORIES) / sizeof(KALI_TOOL_CATEGORIES[0])];
+    
+    TaskGraph* graph = malloc(sizeof(TaskGraph));
+    if (!graph) {
+        return 0;
+    }
+    task_graph_init(graph, g_config.setup_jobs);
+    
+    switch (context.sys_type) {
+        case SYSTEM_ARCH: {
+            log_message("Setting up BlackArch repository...", "info");
+            
+            int repository = task_add(graph, "pacman.conf", task_blackarch_repository, NULL);
+            int fetch_key = task_add(graph, "key-fetch", task_fetch_blackarch_key, &context);
+            int add_key = task_add(graph, "key-add", task_add_blackarch_key, &context);
+            int lsign_key = task_add(graph, "key-lsign", task_lsign_blackarch_key, NULL);
+            int sync = task_add(graph, "db-sync", task_sync_databases, &context);
+            
+            task_depends(graph, add_key, fetch_key);
+            task_depends(graph, lsign_key, add_key);
+            task_depends(graph, sync, repository);
+            task_depends(graph, sync, lsign_key);
+            
+            if (g_config.profile_count > 0) {
+                int catalog = task_add(graph, "catalog", task_open_catalog, &context);
+                int tool_list = task_add(graph, "tool-list", task_select_profiles, &context);
+                task_depends(graph, catalog, sync);
+                task_depends(graph, tool_list, catalog);
+            } else {
+                int tool_list = task_add(graph, "tool-list", task_pacman_tool_list, NULL);
+                task_depends(graph, tool_list, sync);
+            }
+            break;
+        }
+            
+        case SYSTEM_DEBIAN: {
+            log_message("Setting up Kali Linux repository...", "info");
+            
+            int curl = task_add(graph, "curl", task_require_curl, NULL);
+            int fetch_keyring = task_add(graph, "keyring-fetch", task_fetch_kali_keyring, &context);
+            int install_keyring = task_add(graph, "keyring-install", task_install_kali_keyring, &context);
+            int sources = task_add(graph, "sources-write", task_write_kali_sources, NULL);
+            int sync = task_add(graph, "apt-update", task_sync_databases, &context);
+            int catalog = task_add(graph, "catalog", task_open_catalog, &context);
+            
+            task_depends(graph, fetch_keyring, curl);
+            task_depends(graph, install_keyring, fetch_keyring);
+            task_depends(graph, sync, install_keyring);
+            task_depends(graph, sync, sources);
+            task_depends(graph, catalog, sync);
+            
+            if (g_config.profile_count > 0) {
+                int tool_list = task_add(graph, "tool-list", task_select_profiles, &context);
+                task_depends(graph, tool_list, catalog);
+                break;
+            }
+            
+            int merge = task_add(graph, "tool-list", task_merge_tool_list, searches);
+            for (int i = 0; KALI_TOOL_CATEGORIES[i] != NULL; i++) {
+                searches[i].category = KALI_TOOL_CATEGORIES[i];
+                snprintf(searches[i].output, sizeof(searches[i].output),
+                        "%s.%d", TEMP_FILE, i);
+                searches[i].context = &context;
+                int search = task_add(graph, searches[i].category, task_search_category, &searches[i]);
+                task_depends(graph, search, catalog);
+                task_depends(graph, merge, search);
+            }
+            break;
+        }
+            
+        default:
+            log_message("Unsupported system type", "error");
+            task_graph_destroy(graph);
+            free(graph);
+            return 0;
+    }
+    
+    int prepared = run_task_graph(graph);
+    report_critical_path(graph);
+    task_graph_destroy(graph);
+    free(graph);
+    catalog_destroy(context.catalog);
+    
+    if (!prepared) {
+        log_message("Failed to prepare package sources", "error");
+    }
+    return prepared;
+}
+
+/* Arena Functions */
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    
+    ArenaBlock* block = arena->blocks;
+    if (!block || block->size - block->used < size) {
+        // Large columns get a block of their own behind the current one, so the
+        // current block keeps serving small strings
+        int dedicated = block && size > ARENA_BLOCK_SIZE / 4;
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        if (dedicated) {
+            block_size = size;
+        }
+        
+        ArenaBlock* fresh = malloc(sizeof(ArenaBlock) + block_size);
+        if (!fresh) {
+            return NULL;
+        }
+        fresh->used = 0;
+        fresh->size = block_size;
+        fresh->dedicated = dedicated;
+        arena->reserved += block_size;
+        
+        if (dedicated) {
+            fresh->next = block->next;
+            block->next = fresh;
+        } else {
+            fresh->next = arena->blocks;
+            arena->blocks = fresh;
+        }
+        block = fresh;
+    }
+    
+    void* memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+/* Returns a region to the system when it owns a dedicated block. Smaller
+ * regions stay in their shared block until the arena is released. */
+void arena_free(Arena* arena, void* memory) {
+    for (ArenaBlock** link = &arena->blocks; memory && *link; link = &(*link)->next) {
+        ArenaBlock* block = *link;
+        if (block->dedicated && (void*)block->data == memory) {
+            *link = block->next;
+            arena->reserved -= block->size;
+            free(block);
+            return;
+        }
+    }
+}
+
+/* Column growth copies into a fresh region and drops the old one */
+void* arena_grow(Arena* arena, void* old, size_t old_size, size_t new_size) {
+    void* memory = arena_alloc(arena, new_size);
+    if (memory) {
+        if (old) memcpy(memory, old, old_size);
+        memset((unsigned char*)memory + old_size, 0, new_size - old_size);
+        arena_free(arena, old);
+    }
+    return memory;
+}
+
+void arena_release(Arena* arena) {
+    while (arena->blocks) {
+        ArenaBlock* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    arena->reserved = 0;
+}
+
+/* String Interning Functions */
+uint32_t hash_string(const char* text, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+int grow_string_table(Arena* arena, StringTable* table) {
+    // Bucket masks need a power of two; a mapped snapshot can hold any count
+    uint32_t capacity = INTERN_INITIAL_STRINGS;
+    while (capacity <= table->capacity) capacity *= 2;
+    
+    table->strings = arena_grow(arena, table->strings, table->capacity * sizeof(char*),
+                                capacity * sizeof(char*));
+    table->hashes = arena_grow(arena, table->hashes, table->capacity * sizeof(uint32_t),
+                               capacity * sizeof(uint32_t));
+    table->package_ids = arena_grow(arena, table->package_ids, table->capacity * sizeof(uint32_t),
+                                    capacity * sizeof(uint32_t));
+    // Twice as many buckets as strings keeps probe chains short
+    arena_free(arena, table->buckets);
+    StringId* buckets = arena_grow(arena, NULL, 0, capacity * 2 * sizeof(StringId));
+    if (!table->strings || !table->hashes || !table->package_ids || !buckets) {
+        return 0;
+    }
+    
+    for (uint32_t i = table->capacity; i < capacity; i++) {
+        table->package_ids[i] = NO_PACKAGE;
+    }
+    
+    table->bucket_mask = capacity * 2 - 1;
+    for (StringId id = 1; id < table->count; id++) {
+        uint32_t slot = table->hashes[id] & table->bucket_mask;
+        while (buckets[slot]) slot = (slot + 1) & table->bucket_mask;
+        buckets[slot] = id;
+    }
+    table->buckets = buckets;
+    table->capacity = capacity;
+    return 1;
+}
+
+/* Returns the id of an interned copy of the string, 0 for the empty string and
+ * on allocation failure */
+StringId intern_string(Catalog* catalog, const char* text, size_t length) {
+    StringTable* table = &catalog->strings;
+    if (length == 0) {
+        return 0;
+    }
+    
+    uint32_t hash = hash_string(text, length);
+    if (table->buckets) {
+        for (uint32_t slot = hash & table->bucket_mask; table->buckets[slot];
+             slot = (slot + 1) & table->bucket_mask) {
+            StringId id = table->buckets[slot];
+            if (table->hashes[id] == hash && strncmp(table->strings[id], text, length) == 0 &&
+                table->strings[id][length] == '\0') {
+                return id;
+            }
+        }
+    }
+    
+    if (table->count == table->capacity && !grow_string_table(&catalog->arena, table)) {
+        return 0;
+    }
+    
+    char* copy = arena_alloc(&catalog->arena, length + 1);
+    if (!copy) {
+        return 0;
+    }
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    
+    StringId id = table->count++;
+    table->strings[id] = copy;
+    table->hashes[id] = hash;
+    uint32_t slot = hash & table->bucket_mask;
+    while (table->buckets[slot]) slot = (slot + 1) & table->bucket_mask;
+    table->buckets[slot] = id;
+    return id;
+}
+
+const char* catalog_string(const Catalog* catalog, StringId id) {
+    return catalog->strings.strings[id];
+}
+
+/* Package Catalog Functions */
+const char* package_state_name(PackageState state) {
+    static const char* names[] = {
+        PKG_STATUS_PENDING, PKG_STATUS_DEFERRED, PKG_STATUS_INSTALLED,
+        PKG_STATUS_FAILED, PKG_STATUS_SKIPPED
+    };
+    return names[state];
+}
+
+int parse_package_state(const char* name) {
+    for (int state = PKG_PENDING; state <= PKG_SKIPPED; state++) {
+        if (strcmp(name, package_state_name(state)) == 0) {
+            return state;
+        }
+    }
+    return -1;
+}
+
+Catalog* catalog_create(void) {
+    Catalog* catalog = calloc(1, sizeof(Catalog));
+    if (!catalog) {
+        return NULL;
+    }
+    
+    // String 0 is the empty string so that unset columns read as ""
+    if (!grow_string_table(&catalog->arena, &catalog->strings)) {
+        arena_release(&catalog->arena);
+        free(catalog);
+        return NULL;
+    }
+    catalog->strings.strings[0] = "";
+    catalog->strings.count = 1;
+    return catalog;
+}
+
+void catalog_destroy(Catalog* catalog) {
+    if (catalog) {
+        if (catalog->mapping) {
+            munmap(catalog->mapping, catalog->mapping_size);
+        }
+        arena_release(&catalog->arena);
+        free(catalog);
+    }
+}
+
+int grow_catalog(Catalog* catalog) {
+    uint32_t old = catalog->capacity;
+    uint32_t capacity = old ? old * 2 : CATALOG_INITIAL_PACKAGES;
+    Arena* arena = &catalog->arena;
+    
+#define GROW_COLUMN(column) \
+    (catalog->column = arena_grow(arena, catalog->column, old * sizeof(*catalog->column), \
+                                  capacity * sizeof(*catalog->column)))
+    int grown = GROW_COLUMN(names) && GROW_COLUMN(versions) && GROW_COLUMN(groups) &&
+                GROW_COLUMN(descriptions) && GROW_COLUMN(replaces) &&
+                GROW_COLUMN(size_bytes) && GROW_COLUMN(download_bytes) &&
+                GROW_COLUMN(install_times) && GROW_COLUMN(states) &&
+                GROW_COLUMN(flags) && GROW_COLUMN(retries) && GROW_COLUMN(providers) &&
+                GROW_COLUMN(local_versions);
+#undef GROW_COLUMN
+    
+    if (grown) {
+        catalog->capacity = capacity;
+    }
+    return grown;
+}
+
+uint32_t catalog_find(const Catalog* catalog, const char* name) {
+    const StringTable* table = &catalog->strings;
+    size_t length = strlen(name);
+    uint32_t hash = hash_string(name, length);
+    
+    for (uint32_t slot = hash & table->bucket_mask; table->buckets[slot];
+         slot = (slot + 1) & table->bucket_mask) {
+        StringId id = table->buckets[slot];
+        if (table->hashes[id] == hash && strcmp(table->strings[id], name) == 0) {
+            return table->package_ids[id];
+        }
+    }
+    return NO_PACKAGE;
+}
+
+/* Returns the id of the named package, adding it when it is new */
+uint32_t catalog_add(Catalog* catalog, const char* name, size_t length) {
+    StringId name_id = intern_string(catalog, name, length);
+    if (name_id == 0) {
+        return NO_PACKAGE;
+    }
+    if (catalog->strings.package_ids[name_id] != NO_PACKAGE) {
+        return catalog->strings.package_ids[name_id];
+    }
+    
+    if (catalog->count == catalog->capacity && !grow_catalog(catalog)) {
+        return NO_PACKAGE;
+    }
+    
+    uint32_t id = catalog->count++;
+    catalog->names[id] = name_id;
+    catalog->states[id] = PKG_PENDING;
+    catalog->strings.package_ids[name_id] = id;
+    return id;
+}
+
+void catalog_plan(Catalog* catalog, uint32_t id) {
+    if (!(catalog->flags[id] & PKG_FLAG_PLANNED)) {
+        catalog->flags[id] |= PKG_FLAG_PLANNED;
+        catalog->planned++;
+    }
+}
+
+void catalog_unplan(Catalog* catalog, uint32_t id) {
+    if (catalog->flags[id] & PKG_FLAG_PLANNED) {
+        catalog->flags[id] &= ~PKG_FLAG_PLANNED;
+        catalog->planned--;
+    }
+}
+
+const char* package_name(const Catalog* catalog, uint32_t id) {
+    return catalog_string(catalog, catalog->names[id]);
+}
+
+/* Records that a package depends on the named one. Edges are gathered here and
+ * turned into CSR arrays by catalog_build_dependencies. */
+void catalog_add_dependency(Catalog* catalog, uint32_t from, const char* name, size_t length) {
+    uint32_t to = catalog_add(catalog, name, length);
+    if (to == NO_PACKAGE || to == from) {
+        return;
+    }
+    
+    if (catalog->edge_count == catalog->edge_capacity) {
+        uint32_t capacity = catalog->edge_capacity ? catalog->edge_capacity * 2 : CATALOG_INITIAL_PACKAGES;
+        uint32_t* edges = arena_grow(&catalog->arena, catalog->edges,
+                                     catalog->edge_capacity * 2 * sizeof(uint32_t),
+                                     capacity * 2 * sizeof(uint32_t));
+        if (!edges) {
+            return;
+        }
+        catalog->edges = edges;
+        catalog->edge_capacity = capacity;
+    }
+    
+    catalog->edges[catalog->edge_count * 2] = from;
+    catalog->edges[catalog->edge_count * 2 + 1] = to;
+    catalog->edge_count++;
+}
+
+/* Counting sort of the gathered edges, merged with any existing CSR arrays,
+ * into new offset and target arrays. The edge list is dropped afterwards. */
+int catalog_build_dependencies(Catalog* catalog) {
+    uint32_t total = catalog->dep_total + catalog->edge_count;
+    uint32_t* offsets = arena_grow(&catalog->arena, NULL, 0, (catalog->count + 1) * sizeof(uint32_t));
+    uint32_t* targets = arena_alloc(&catalog->arena, (total + 1) * sizeof(uint32_t));
+    uint32_t* cursor = arena_alloc(&catalog->arena, (catalog->count + 1) * sizeof(uint32_t));
+    if (!offsets || !targets || !cursor) {
+        return 0;
+    }
+    
+    for (uint32_t p = 0; p < catalog->dep_packages; p++) {
+        offsets[p + 1] = catalog->dep_offsets[p + 1] - catalog->dep_offsets[p];
+    }
+    for (uint32_t e = 0; e < catalog->edge_count; e++) {
+        offsets[catalog->edges[e * 2] + 1]++;
+    }
+    for (uint32_t p = 0; p < catalog->count; p++) {
+        offsets[p + 1] += offsets[p];
+    }
+    
+    memcpy(cursor, offsets, (catalog->count + 1) * sizeof(uint32_t));
+    for (uint32_t p = 0; p < catalog->dep_packages; p++) {
+        for (uint32_t d = catalog->dep_offsets[p]; d < catalog->dep_offsets[p + 1]; d++) {
+            targets[cursor[p]++] = catalog->dep_ids[d];
+        }
+    }
+    for (uint32_t e = 0; e < catalog->edge_count; e++) {
+        targets[cursor[catalog->edges[e * 2]]++] = catalog->edges[e * 2 + 1];
+    }
+    arena_free(&catalog->arena, cursor);
+    arena_free(&catalog->arena, catalog->edges);
+    arena_free(&catalog->arena, catalog->dep_offsets);
+    arena_free(&catalog->arena, catalog->dep_ids);
+    
+    catalog->dep_offsets = offsets;
+    catalog->dep_ids = targets;
+    catalog->dep_total = total;
+    catalog->dep_packages = catalog->count;
+    catalog->edges = NULL;
+    catalog->edge_count = catalog->edge_capacity = 0;
+    return 1;
+}
+
+int is_package_done(const Catalog* catalog, uint32_t id) {
+    return catalog->states[id] != PKG_PENDING && catalog->states[id] != PKG_DEFERRED;
+}
+
+/* Package List Functions */
+int is_valid_package_name(const char* name) {
+    if (!name[0] || name[0] == '-') {
+        return 0;
+    }
+    for (const char* c = name; *c; c++) {
+        if (!isalnum((unsigned char)*c) && !strchr("@._+-", *c)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Loads the first token of every line of the tool list into the catalog as
+ * planned packages. Lines from apt-cache search carry a description after the
+ * name, which is dropped here. Lines of any length are read whole. */
+int load_package_list(const char* path, Catalog* catalog) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    
+    char* line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, fp) != -1) {
+        char* name = line + strspn(line, " \t");
+        size_t length = strcspn(name, " \t\r\n");
+        if (length == 0) {
+            continue;
+        }
+        name[length] = '\0';
+        
+        if (!is_valid_package_name(name)) {
+            char warn_msg[MAX_LINE_LENGTH];
+            snprintf(warn_msg, sizeof(warn_msg), "Ignoring invalid package name: %.200s", name);
+            log_message(warn_msg, "warning");
+            continue;
+        }
+        
+        uint32_t id = catalog_add(catalog, name, length);
+        if (id == NO_PACKAGE) {
+            free(line);
+            fclose(fp);
+            return 0;
+        }
+        catalog_plan(catalog, id);
+    }
+    
+    free(line);
+    fclose(fp);
+    return 1;
+}
+
+/* Builds "<prefix> name1 name2 ... <suffix>" on the heap */
+char* build_package_command(const char* prefix, const Catalog* catalog, const uint32_t* ids,
+                            int count, const char* suffix) {
+    size_t length = strlen(prefix) + strlen(suffix) + 1;
+    for (int i = 0; i < count; i++) {
+        length += strlen(package_name(catalog, ids[i])) + 1;
+    }
+    
+    char* command = malloc(length);
+    if (!command) {
+        return NULL;
+    }
+    
+    char* cursor = command + sprintf(command, "%s", prefix);
+    for (int i = 0; i < count; i++) {
+        cursor += sprintf(cursor, " %s", package_name(catalog, ids[i]));
+    }
+    sprintf(cursor, "%s", suffix);
+    return command;
+}
+
+/* Parses pacman's "12.34 MiB" style sizes */
+unsigned long long parse_size_value(const char* value) {
+    char* unit;
+    double amount = strtod(value, &unit);
+    while (*unit == ' ') unit++;
+    
+    if (strncmp(unit, "KiB", 3) == 0) amount *= 1024.0;
+    else if (strncmp(unit, "MiB", 3) == 0) amount *= 1024.0 * 1024.0;
+    else if (strncmp(unit, "GiB", 3) == 0) amount *= 1024.0 * 1024.0 * 1024.0;
+    
+    return amount > 0 ? (unsigned long long)amount : 0;
+}
+
+/* Adds the dependencies named in a pacman "Depends On" list ("a  b>=1.2  c")
+ * or an apt "Depends" list ("a (>= 1), b | c, d:any"). Version constraints,
+ * architecture qualifiers and alternatives after the first are dropped. */
+void parse_dependency_list(Catalog* catalog, uint32_t id, char* list, int apt_format) {
+    const char* separators = apt_format ? "," : " ";
+    for (char* save = NULL, *item = strtok_r(list, separators, &save); item;
+         item = strtok_r(NULL, separators, &save)) {
+        item += strspn(item, " ");
+        size_t length = strcspn(item, apt_format ? " (|:" : "<>=:");
+        if (length > 0 && !(length == 4 && strncmp(item, "None", 4) == 0)) {
+            catalog_add_dependency(catalog, id, item, length);
+        }
+        while (apt_format && catalog->all_alternatives && (item = strchr(item, '|')) != NULL) {
+            item += 1 + strspn(item + 1, " ");
+            length = strcspn(item, " (|:");
+            if (length > 0) {
+                catalog_add_dependency(catalog, id, item, length);
+            }
+        }
+    }
+}
+
+/* Records the current package as the provider of each name in a pacman
+ * "Provides" list ("sh  libfoo.so=1-64") or an apt one ("mail-transport-agent,
+ * foo (= 1.0)"). The first provider seen for a name is kept. */
+void parse_provides_list(Catalog* catalog, uint32_t id, char* list, int apt_format) {
+    const char* separators = apt_format ? "," : " ";
+    for (char* save = NULL, *item = strtok_r(list, separators, &save); item;
+         item = strtok_r(NULL, separators, &save)) {
+        item += strspn(item, " ");
+        size_t length = strcspn(item, apt_format ? " (|:" : "<>=:");
+        if (length == 0 || (length == 4 && strncmp(item, "None", 4) == 0)) {
+            continue;
+        }
+        uint32_t provided = catalog_add(catalog, item, length);
+        if (provided != NO_PACKAGE && provided != id && catalog->providers[provided] == 0) {
+            catalog->providers[provided] = id + 1;
+        }
+    }
+}
+
+/* Reads package records from pacman -Si or apt-cache output. Packages new to
+ * the catalog are added when add_packages is set and skipped otherwise. */
+void read_package_records(FILE* output, Catalog* catalog, int add_packages) {
+    char* line = NULL;
+    size_t line_size = 0;
+    uint32_t current = NO_PACKAGE;
+    int apt_record = 0;
+    char last_key[32] = "";
+    
+    while (getline(&line, &line_size, output) != -1) {
+        line[strcspn(line, "\n")] = 0;
+        
+        // pacman wraps long lists onto indented continuation lines
+        if (line[0] == ' ' && current != NO_PACKAGE && strcmp(last_key, "Depends On") == 0) {
+            parse_dependency_list(catalog, current, line, 0);
+            continue;
+        }
+        if (line[0] == ' ' && current != NO_PACKAGE && strcmp(last_key, "Provides") == 0 && !apt_record) {
+            parse_provides_list(catalog, current, line, 0);
+            continue;
+        }
+        
+        char* colon = strchr(line, ':');
+        if (!colon || line[0] == ' ') {
+            continue;
+        }
+        
+        *colon = '\0';
+        char* key = line;
+        char* value = colon + 1;
+        while (*value == ' ') value++;
+        for (char* end = colon - 1; end >= key && *end == ' '; end--) *end = '\0';
+        snprintf(last_key, sizeof(last_key), "%s", key);
+        
+        if (strcmp(key, "Name") == 0 || strcmp(key, "Package") == 0) {
+            apt_record = key[0] == 'P';
+            current = add_packages ? catalog_add(catalog, value, strlen(value))
+                                   : catalog_find(catalog, value);
+            // A package listed twice keeps its first record
+            if (current != NO_PACKAGE && (catalog->flags[current] & PKG_FLAG_QUERIED)) {
+                current = NO_PACKAGE;
+            } else if (current != NO_PACKAGE) {
+                catalog->flags[current] |= PKG_FLAG_QUERIED;
+            }
+        } else if (current == NO_PACKAGE) {
+            continue;
+        } else if (strcmp(key, "Version") == 0) {
+            catalog->versions[current] = intern_string(catalog, value, strlen(value));
+        } else if (strcmp(key, "Description") == 0) {
+            catalog->descriptions[current] = intern_string(catalog, value, strlen(value));
+        } else if (strcmp(key, "Groups") == 0 || strcmp(key, "Section") == 0) {
+            if (strcmp(value, "None") != 0) {
+                catalog->groups[current] = intern_string(catalog, value, strlen(value));
+            }
+        } else if (strcmp(key, "Depends On") == 0) {
+            parse_dependency_list(catalog, current, value, 0);
+        } else if (strcmp(key, "Depends") == 0 || strcmp(key, "Pre-Depends") == 0 ||
+                   (strcmp(key, "Recommends") == 0 && catalog->recommends)) {
+            parse_dependency_list(catalog, current, value, 1);
+        } else if (strcmp(key, "Provides") == 0) {
+            parse_provides_list(catalog, current, value, apt_record);
+        } else if (strcmp(key, "Replaces") == 0) {
+            size_t length = strcspn(value, apt_record ? " (|:," : " <>=:");
+            if (length > 0 && !(length == 4 && strncmp(value, "None", 4) == 0)) {
+                catalog->replaces[current] = intern_string(catalog, value, length);
+            }
+        } else if (strcmp(key, "Install Date") == 0) {
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            if (strptime(value, "%a %b %e %H:%M:%S %Y", &tm)) {
+                tm.tm_isdst = -1;
+                catalog->install_times[current] = mktime(&tm);
+            }
+        } else if (strcmp(key, "Install Reason") == 0) {
+            if (strncmp(value, "Explicitly", 10) == 0) {
+                catalog->flags[current] |= PKG_FLAG_EXPLICIT;
+            }
+        } else if (strcmp(key, "Essential") == 0 || strcmp(key, "Priority") == 0) {
+            if (strcmp(value, "yes") == 0 || strcmp(value, "required") == 0) {
+                catalog->flags[current] |= PKG_FLAG_ESSENTIAL;
+            }
+        } else if (strcmp(key, "Installed Size") == 0) {
+            catalog->size_bytes[current] = parse_size_value(value);
+        } else if (strcmp(key, "Download Size") == 0) {
+            catalog->download_bytes[current] = parse_size_value(value);
+        } else if (strcmp(key, "Installed-Size") == 0) {
+            catalog->size_bytes[current] = strtoull(value, NULL, 10) * 1024ULL;
+        } else if (strcmp(key, "Size") == 0) {
+            catalog->download_bytes[current] = strtoull(value, NULL, 10);
+        }
+    }
+    free(line);
+}
+
+/* Reads version, group, sizes and dependencies of the given packages from the
+ * sync metadata */
+void query_package_metadata(SystemType sys_type, Catalog* catalog, const uint32_t* ids, int count) {
+    const char* prefix = (sys_type == SYSTEM_ARCH)
+        ? "LC_ALL=C pacman -Si --"
+        : "LC_ALL=C apt-cache show --no-all-versions --";
+    char* command = build_package_command(prefix, catalog, ids, count, " 2>/dev/null");
+    if (!command) {
+        return;
+    }
+    
+    pid_t pid;
+    struct timespec start;
+    FILE* output = open_command_output(command, &pid, &start);
+    if (output) {
+        read_package_records(output, catalog, 0);
+        close_command_output(output, pid, &start, command);
+    }
+    free(command);
+}
+
+/* Queries metadata for every planned package still to install that the
+ * snapshot did not cover, in chunks that keep the command line bounded, then
+ * builds the dependency arrays. Packages
+ * the package manager does not know (groups, virtual names) get a
+ * conservative size estimate. */
+int catalog_load_metadata(SystemType sys_type, Catalog* catalog) {
+    uint32_t chunk[METADATA_QUERY_CHUNK];
+    int chunk_count = 0;
+    uint32_t planned_count = catalog->count;
+    
+    for (uint32_t id = 0; id < planned_count && keep_running; id++) {
+        if (!(catalog->flags[id] & PKG_FLAG_PLANNED) || (catalog->flags[id] & PKG_FLAG_QUERIED) ||
+            is_package_done(catalog, id)) {
+            continue;
+        }
+        chunk[chunk_count++] = id;
+        if (chunk_count == METADATA_QUERY_CHUNK) {
+            query_package_metadata(sys_type, catalog, chunk, chunk_count);
+            chunk_count = 0;
+        }
+    }
+    if (chunk_count > 0) {
+        query_package_metadata(sys_type, catalog, chunk, chunk_count);
+    }
+    
+    for (uint32_t id = 0; id < planned_count; id++) {
+        if (catalog->size_bytes[id] == 0) {
+            catalog->size_bytes[id] = DEFAULT_PACKAGE_SIZE;
+            catalog->download_bytes[id] = DEFAULT_PACKAGE_SIZE / 4;
+        }
+    }
+    
+    if (!catalog_build_dependencies(catalog)) {
+        return 0;
+    }
+    
+    char catalog_msg[MAX_LINE_LENGTH];
+    snprintf(catalog_msg, sizeof(catalog_msg),
+            "Catalog: %u packages (%u planned), %u dependencies, %u strings, %.1f MB arena",
+            catalog->count, catalog->planned, catalog->dep_total, catalog->strings.count,
+            (double)catalog->arena.reserved / (1024*1024));
+    log_message(catalog_msg, "info");
+    return 1;
+}
+
+/* Trigram Index Functions */
+/* Appends the trigrams of every word in text. Letters are folded to lower
+ * case, anything other than a letter or digit separates words, and each word
+ * also yields a leading boundary trigram so two-letter words can be found. */
+int text_trigrams(const char* text, uint32_t* keys, int count, int max) {
+    const unsigned char* c = (const unsigned char*)text;
+    while (*c && count < max) {
+        uint32_t window = 0;
+        int length = 0;
+        for (; *c && isascii(*c) && isalnum(*c); c++) {
+            uint32_t symbol = isdigit(*c) ? 27 + (*c - '0') : 1 + (tolower(*c) - 'a');
+            window = (window * TRIGRAM_SYMBOLS + symbol) % TRIGRAM_SPACE;
+            if (++length >= 2 && count < max) {
+                keys[count++] = window;
+            }
+        }
+        if (*c) c++;
+    }
+    return count;
+}
+
+/* Name trigrams come first, so the first sighting of a trigram tells whether
+ * the name holds it */
+int package_trigrams(const Catalog* catalog, uint32_t id, uint32_t* keys, int max, int* name_count) {
+    int count = text_trigrams(catalog_string(catalog, catalog->names[id]), keys, 0, max);
+    *name_count = count;
+    count = text_trigrams(catalog_string(catalog, catalog->groups[id]), keys, count, max);
+    return text_trigrams(catalog_string(catalog, catalog->descriptions[id]), keys, count, max);
+}
+
+/* Builds the index in two passes over the catalog, counting then filling, so
+ * the postings of each trigram come out in ascending package order */
+int catalog_build_trigrams(Catalog* catalog) {
+    uint32_t* keys = malloc(sizeof(uint32_t) * MAX_PACKAGE_TRIGRAMS);
+    uint32_t* cursor = calloc(TRIGRAM_SPACE, sizeof(uint32_t));
+    uint32_t* last_package = malloc(sizeof(uint32_t) * TRIGRAM_SPACE);
+    uint32_t* offsets = arena_alloc(&catalog->arena, sizeof(uint32_t) * (TRIGRAM_SPACE + 1));
+    if (!keys || !cursor || !last_package || !offsets || catalog->count > POSTING_MAX_PACKAGES) {
+        free(keys);
+        free(cursor);
+        free(last_package);
+        return 0;
+    }
+    
+    // Pass one counts each package once per distinct trigram
+    int name_count;
+    memset(last_package, 0xff, sizeof(uint32_t) * TRIGRAM_SPACE);
+    for (uint32_t p = 0; p < catalog->count; p++) {
+        int count = package_trigrams(catalog, p, keys, MAX_PACKAGE_TRIGRAMS, &name_count);
+        for (int k = 0; k < count; k++) {
+            if (last_package[keys[k]] != p) {
+                last_package[keys[k]] = p;
+                cursor[keys[k]]++;
+            }
+        }
+    }
+    
+    uint64_t total = 0;
+    for (uint32_t t = 0; t < TRIGRAM_SPACE; t++) {
+        offsets[t] = (uint32_t)total;
+        total += cursor[t];
+        cursor[t] = offsets[t];
+    }
+    offsets[TRIGRAM_SPACE] = (uint32_t)total;
+    
+    uint32_t* postings = total < UINT32_MAX
+        ? arena_grow(&catalog->arena, NULL, 0, sizeof(uint32_t) * (total + 1)) : NULL;
+    if (postings) {
+        memset(last_package, 0xff, sizeof(uint32_t) * TRIGRAM_SPACE);
+        for (uint32_t p = 0; p < catalog->count; p++) {
+            int count = package_trigrams(catalog, p, keys, MAX_PACKAGE_TRIGRAMS, &name_count);
+            for (int k = 0; k < count; k++) {
+                if (last_package[keys[k]] != p) {
+                    last_package[keys[k]] = p;
+                    postings[cursor[keys[k]]++] = (p << 1) | (k < name_count ? POSTING_IN_NAME : 0);
+                }
+            }
+        }
+        catalog->trigram_offsets = offsets;
+        catalog->trigram_postings = postings;
+        catalog->posting_total = (uint32_t)total;
+    }
+    
+    free(keys);
+    free(cursor);
+    free(last_package);
+    return postings != NULL;
+}
+
+int compare_search_hits(const void* a, const void* b, void* arg) {
+    const SearchHit* left = a;
+    const SearchHit* right = b;
+    if (left->score != right->score) {
+        return right->score - left->score;
+    }
+    const Catalog* catalog = arg;
+    return strcmp(package_name(catalog, left->id), package_name(catalog, right->id));
+}
+
+/* Weighs where a query word appears: the name counts far more than the
+ * groups, and the groups more than the description */
+int score_search_word(const Catalog* catalog, uint32_t id, const char* word) {
+    const char* name = package_name(catalog, id);
+    size_t length = strlen(word);
+    int score = 0;
+    
+    if (strcasecmp(name, word) == 0) {
+        score += 400;
+    } else if (strncasecmp(name, word, length) == 0) {
+        score += 200;
+    } else if (strcasestr(name, word)) {
+        score += 100;
+    }
+    if (strcasestr(catalog_string(catalog, catalog->groups[id]), word)) {
+        score += 50;
+    }
+    if (strcasestr(catalog_string(catalog, catalog->descriptions[id]), word)) {
+        score += 25;
+    }
+    return score;
+}
+
+/* Matches packages sharing at least half of the query's trigrams, which
+ * tolerates typos and partial words. Every match gets a cheap rank from the
+ * postings alone, counting trigrams found in the name three times; only the
+ * best `limit` (all when 0) are then scored on the strings and sorted.
+ * Returns the number of ranked hits, best first, in a heap array the caller
+ * frees, or -1 when the query has no usable word. */
+int search_catalog(const Catalog* catalog, const char* query, int limit,
+                   SearchHit** hits_out, int* match_count) {
+    *hits_out = NULL;
+    *match_count = 0;
+    uint32_t keys[MAX_QUERY_TRIGRAMS];
+    int key_count = 0;
+    int found = text_trigrams(query, keys, 0, MAX_QUERY_TRIGRAMS);
+    for (int k = 0; k < found; k++) {
+        int seen = 0;
+        for (int j = 0; j < key_count && !seen; j++) {
+            seen = keys[j] == keys[k];
+        }
+        if (!seen) keys[key_count++] = keys[k];
+    }
+    if (key_count == 0) {
+        return -1;
+    }
+    if (!catalog->trigram_offsets || catalog->count == 0) {
+        return 0;
+    }
+    
+    uint16_t* matched = calloc(catalog->count, sizeof(uint16_t));
+    uint16_t* in_name = calloc(catalog->count, sizeof(uint16_t));
+    SearchHit* hits = malloc(sizeof(SearchHit) * catalog->count);
+    if (!matched || !in_name || !hits) {
+        free(matched);
+        free(in_name);
+        free(hits);
+        return 0;
+    }
+    
+    // Candidates are gathered in the hits array as they are first seen
+    uint32_t candidate_count = 0;
+    for (int k = 0; k < key_count; k++) {
+        for (uint32_t i = catalog->trigram_offsets[keys[k]];
+             i < catalog->trigram_offsets[keys[k] + 1]; i++) {
+            uint32_t id = catalog->trigram_postings[i] >> 1;
+            if (id >= catalog->count) {
+                continue;
+            }
+            if (matched[id]++ == 0) {
+                hits[candidate_count++].id = id;
+            }
+            in_name[id] += catalog->trigram_postings[i] & POSTING_IN_NAME;
+        }
+    }
+    
+    int rank_counts[SEARCH_MAX_RANK + 1] = {0};
+    int hit_count = 0;
+    for (uint32_t c = 0; c < candidate_count; c++) {
+        uint32_t id = hits[c].id;
+        if (matched[id] * 2 >= key_count) {
+            hits[hit_count].id = id;
+            hits[hit_count].score = (matched[id] + 2 * in_name[id]) * 100 / key_count;
+            rank_counts[hits[hit_count].score]++;
+            hit_count++;
+        }
+    }
+    free(matched);
+    free(in_name);
+    *match_count = hit_count;
+    
+    // Keeps the best ranks, taking ties at the cutoff in package order
+    if (limit > 0 && hit_count > limit) {
+        int cutoff = SEARCH_MAX_RANK;
+        int above = 0;
+        while (cutoff > 0 && above + rank_counts[cutoff] < limit) {
+            above += rank_counts[cutoff--];
+        }
+        int at_cutoff = limit - above;
+        int kept = 0;
+        for (int h = 0; h < hit_count; h++) {
+            if (hits[h].score > cutoff || (hits[h].score == cutoff && at_cutoff-- > 0)) {
+                hits[kept++] = hits[h];
+            }
+        }
+        hit_count = kept;
+    }
+    
+    char words_buffer[MAX_LINE_LENGTH];
+    char* save = NULL;
+    snprintf(words_buffer, sizeof(words_buffer), "%s", query);
+    char* words[MAX_QUERY_WORDS];
+    int word_count = 0;
+    for (char* word = strtok_r(words_buffer, " \t", &save);
+         word && word_count < MAX_QUERY_WORDS; word = strtok_r(NULL, " \t", &save)) {
+        words[word_count++] = word;
+    }
+    for (int h = 0; h < hit_count; h++) {
+        for (int w = 0; w < word_count; w++) {
+            hits[h].score += score_search_word(catalog, hits[h].id, words[w]);
+        }
+    }
+    
+    qsort_r(hits, hit_count, sizeof(SearchHit), compare_search_hits, (void*)catalog);
+    *hits_out = hits;
+    return hit_count;
+}
+
+/* Selects what "apt-cache search CATEGORY | grep -i kali" used to: packages
+ * whose name or description holds the category and mention Kali. The trigram
+ * index narrows the candidates, the substring checks keep the old meaning.
+ * Returns the number of ids placed in a heap array the caller frees. */
+int select_category(const Catalog* catalog, const char* category, uint32_t** ids_out) {
+    SearchHit* hits;
+    int match_count;
+    int hit_count = search_catalog(catalog, category, 0, &hits, &match_count);
+    uint32_t* ids = malloc(sizeof(uint32_t) * (hit_count > 0 ? hit_count : 1));
+    int count = 0;
+    
+    for (int i = 0; ids && i < hit_count; i++) {
+        const char* name = package_name(catalog, hits[i].id);
+        const char* description = catalog_string(catalog, catalog->descriptions[hits[i].id]);
+        if ((strcasestr(name, category) || strcasestr(description, category)) &&
+            (strcasestr(name, "kali") || strcasestr(description, "kali"))) {
+            ids[count++] = hits[i].id;
+        }
+    }
+    
+    free(hits);
+    *ids_out = ids;
+    return count;
+}
+
+/* Catalog Snapshot Functions */
+/* Fingerprints the sync databases by name, size and mtime */
+unsigned long long sync_db_stamp(SystemType sys_type) {
+    const char* dir_path = (sys_type == SYSTEM_ARCH) ? PACMAN_SYNC_DIR : APT_LISTS_DIR;
+    DIR* dir = opendir(dir_path);
+    if (!dir) {
+        return 0;
+    }
+    
+    unsigned long long stamp = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        
+        struct stat st;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        
+        // FNV-1a per entry, summed so the directory order does not matter
+        unsigned long long hash = 14695981039346656037ULL;
+        for (const char* c = entry->d_name; *c; c++) {
+            hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+        }
+        hash = (hash ^ (unsigned long long)st.st_size) * 1099511628211ULL;
+        hash = (hash ^ (unsigned long long)st.st_mtim.tv_sec) * 1099511628211ULL;
+        hash = (hash ^ (unsigned long long)st.st_mtim.tv_nsec) * 1099511628211ULL;
+        stamp += hash;
+    }
+    
+    closedir(dir);
+    return stamp;
+}
+
+/* Writes one section at the next 8-byte boundary and records where it went */
+int write_snapshot_section(FILE* fp, SnapshotHeader* header, int section,
+                           const void* data, size_t length) {
+    static const unsigned char padding[8] = {0};
+    long position = ftell(fp);
+    size_t pad = (8 - (position & 7)) & 7;
+    if (pad && fwrite(padding, 1, pad, fp) != pad) {
+        return 0;
+    }
+    
+    header->offsets[section] = (uint64_t)position + pad;
+    header->lengths[section] = length;
+    return length == 0 || fwrite(data, 1, length, fp) == length;
+}
+
+/* Serializes the catalog as offsets into one file, so a later run can map it
+ * and use it without parsing. Written to a temporary file and renamed, so
+ * readers holding the old mapping are unaffected. */
+int catalog_save_snapshot(const Catalog* catalog, SystemType sys_type, uint64_t stamp) {
+    if (!catalog->trigram_offsets || !make_directories(CACHE_DIR, 0755)) {
+        return 0;
+    }
+    
+    const StringTable* table = &catalog->strings;
+    uint32_t* string_offsets = malloc(sizeof(uint32_t) * table->count);
+    uint8_t* flags = malloc(catalog->count + 1);
+    if (!string_offsets || !flags) {
+        free(string_offsets);
+        free(flags);
+        return 0;
+    }
+    
+    size_t data_length = 0;
+    for (uint32_t i = 0; i < table->count; i++) {
+        string_offsets[i] = (uint32_t)data_length;
+        data_length += strlen(table->strings[i]) + 1;
+    }
+    // Run state is not part of the snapshot
+    for (uint32_t p = 0; p < catalog->count; p++) {
+        flags[p] = catalog->flags[p] & PKG_FLAG_QUERIED;
+    }
+    
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", CATALOG_SNAPSHOT_FILE, (int)getpid());
+    FILE* fp = fopen(temp_path, "w");
+    if (!fp) {
+        free(string_offsets);
+        free(flags);
+        return 0;
+    }
+    
+    SnapshotHeader header = {0};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.sys_type = (uint32_t)sys_type;
+    header.source_stamp = stamp;
+    header.package_count = catalog->count;
+    header.string_count = table->count;
+    header.bucket_count = table->bucket_mask + 1;
+    header.dep_total = catalog->dep_total;
+    header.posting_total = catalog->posting_total;
+    
+    int written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        write_snapshot_section(fp, &header, SECTION_STRING_OFFSETS, string_offsets,
+                               sizeof(uint32_t) * table->count) &&
+        write_snapshot_section(fp, &header, SECTION_STRING_HASHES, table->hashes,
+                               sizeof(uint32_t) * table->count) &&
+        write_snapshot_section(fp, &header, SECTION_STRING_PACKAGES, table->package_ids,
+                               sizeof(uint32_t) * table->count) &&
+        write_snapshot_section(fp, &header, SECTION_BUCKETS, table->buckets,
+                               sizeof(StringId) * header.bucket_count);
+    
+    // String bytes go out one by one, in id order, matching string_offsets
+    if (written) {
+        written = write_snapshot_section(fp, &header, SECTION_STRING_DATA, NULL, 0);
+        header.lengths[SECTION_STRING_DATA] = data_length;
+        for (uint32_t i = 0; written && i < table->count; i++) {
+            size_t length = strlen(table->strings[i]) + 1;
+            written = fwrite(table->strings[i], 1, length, fp) == length;
+        }
+    }
+    
+    written = written &&
+        write_snapshot_section(fp, &header, SECTION_NAMES, catalog->names,
+                               sizeof(StringId) * catalog->count) &&
+        write_snapshot_section(fp, &header, SECTION_VERSIONS, catalog->versions,
+                               sizeof(StringId) * catalog->count) &&
+        write_snapshot_section(fp, &header, SECTION_GROUPS, catalog->groups,
+                               sizeof(StringId) * catalog->count) &&
+        write_snapshot_section(fp, &header, SECTION_DESCRIPTIONS, catalog->descriptions,
+                               sizeof(StringId) * catalog->count) &&
+        write_snapshot_section(fp, &header, SECTION_REPLACES, catalog->replaces,
+                               sizeof(StringId) * catalog->count) &&
+        write_snapshot_section(fp, &header, SECTION_SIZES, catalog->size_bytes,
+                               sizeof(uint64_t) * catalog->count) &&
+        write_snapshot_section(fp, &header, SECTION_DOWNLOADS, catalog->download_bytes,
+                               sizeof(uint64_t) * catalog->count) &&
+        write_snapshot_section(fp, &header, SECTION_FLAGS, flags, catalog->count) &&
+        write_snapshot_section(fp, &header, SECTION_PROVIDERS, catalog->providers,
+                               sizeof(uint32_t) * catalog->count) &&
+        write_snapshot_section(fp, &header, SECTION_DEP_OFFSETS, catalog->dep_offsets,
+                               sizeof(uint32_t) * (catalog->count + 1)) &&
+        write_snapshot_section(fp, &header, SECTION_DEP_IDS, catalog->dep_ids,
+                               sizeof(uint32_t) * catalog->dep_total) &&
+        write_snapshot_section(fp, &header, SECTION_TRIGRAM_OFFSETS, catalog->trigram_offsets,
+                               sizeof(uint32_t) * (TRIGRAM_SPACE + 1)) &&
+        write_snapshot_section(fp, &header, SECTION_TRIGRAM_POSTINGS, catalog->trigram_postings,
+                               sizeof(uint32_t) * catalog->posting_total);
+    
+    header.file_size = (uint64_t)ftell(fp);
+    written = written && fseek(fp, 0, SEEK_SET) == 0 &&
+              fwrite(&header, sizeof(header), 1, fp) == 1 && fflush(fp) == 0;
+    
+    free(string_offsets);
+    free(flags);
+    if (fclose(fp) != 0 || !written || rename(temp_path, CATALOG_SNAPSHOT_FILE) != 0) {
+        unlink(temp_path);
+        log_message("Failed to write catalog snapshot", "warning");
+        return 0;
+    }
+    return 1;
+}
+
+/* Returns the start of a section when it lies inside the mapping and holds
+ * exactly the expected number of bytes */
+void* snapshot_section(void* mapping, const SnapshotHeader* header, int section, size_t expected) {
+    uint64_t offset = header->offsets[section];
+    uint64_t length = header->lengths[section];
+    if (length != expected || offset % 8 != 0 || offset < sizeof(SnapshotHeader) ||
+        offset > header->file_size || length > header->file_size - offset) {
+        return NULL;
+    }
+    return (unsigned char*)mapping + offset;
+}
+
+/* Maps a snapshot built from the given sync databases, or from any when stamp
+ * is NULL. The mapping is private and writable, so run state written into its
+ * columns is copied on write and never reaches the file. Returns NULL when
+ * there is no matching snapshot. */
+Catalog* catalog_load_snapshot(const char* path, SystemType sys_type, const uint64_t* stamp) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    struct stat st;
+    SnapshotHeader header;
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        header.version != SNAPSHOT_VERSION || header.sys_type != (uint32_t)sys_type ||
+        (stamp && header.source_stamp != *stamp) || header.file_size != (uint64_t)st.st_size ||
+        header.string_count == 0 || (header.bucket_count & (header.bucket_count - 1)) != 0 ||
+        header.bucket_count < header.string_count) {
+        close(fd);
+        return NULL;
+    }
+    
+    void* mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    
+    Catalog* catalog = calloc(1, sizeof(Catalog));
+    if (!catalog) {
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+    catalog->mapping = mapping;
+    catalog->mapping_size = st.st_size;
+    
+    uint32_t packages = header.package_count;
+    uint32_t strings = header.string_count;
+    size_t id_column = sizeof(StringId) * packages;
+    
+    uint32_t* string_offsets = snapshot_section(mapping, &header, SECTION_STRING_OFFSETS, sizeof(uint32_t) * strings);
+    char* string_data = snapshot_section(mapping, &header, SECTION_STRING_DATA,
+                                         header.lengths[SECTION_STRING_DATA]);
+    StringTable* table = &catalog->strings;
+    table->hashes = snapshot_section(mapping, &header, SECTION_STRING_HASHES, sizeof(uint32_t) * strings);
+    table->package_ids = snapshot_section(mapping, &header, SECTION_STRING_PACKAGES, sizeof(uint32_t) * strings);
+    table->buckets = snapshot_section(mapping, &header, SECTION_BUCKETS, sizeof(StringId) * header.bucket_count);
+    catalog->names = snapshot_section(mapping, &header, SECTION_NAMES, id_column);
+    catalog->versions = snapshot_section(mapping, &header, SECTION_VERSIONS, id_column);
+    catalog->groups = snapshot_section(mapping, &header, SECTION_GROUPS, id_column);
+    catalog->descriptions = snapshot_section(mapping, &header, SECTION_DESCRIPTIONS, id_column);
+    catalog->replaces = snapshot_section(mapping, &header, SECTION_REPLACES, id_column);
+    catalog->size_bytes = snapshot_section(mapping, &header, SECTION_SIZES, sizeof(uint64_t) * packages);
+    catalog->download_bytes = snapshot_section(mapping, &header, SECTION_DOWNLOADS, sizeof(uint64_t) * packages);
+    catalog->flags = snapshot_section(mapping, &header, SECTION_FLAGS, packages);
+    catalog->providers = snapshot_section(mapping, &header, SECTION_PROVIDERS, sizeof(uint32_t) * packages);
+    catalog->dep_offsets = snapshot_section(mapping, &header, SECTION_DEP_OFFSETS, sizeof(uint32_t) * (packages + 1));
+    catalog->dep_ids = snapshot_section(mapping, &header, SECTION_DEP_IDS, sizeof(uint32_t) * header.dep_total);
+    catalog->trigram_offsets = snapshot_section(mapping, &header, SECTION_TRIGRAM_OFFSETS,
+                                                sizeof(uint32_t) * (TRIGRAM_SPACE + 1));
+    catalog->trigram_postings = snapshot_section(mapping, &header, SECTION_TRIGRAM_POSTINGS,
+                                                 sizeof(uint32_t) * header.posting_total);
+    
+    // Run state columns start zeroed, and every string id gets its pointer
+    table->strings = arena_alloc(&catalog->arena, sizeof(char*) * strings);
+    catalog->states = arena_grow(&catalog->arena, NULL, 0, packages + 1);
+    catalog->retries = arena_grow(&catalog->arena, NULL, 0, packages + 1);
+    catalog->local_versions = arena_grow(&catalog->arena, NULL, 0, sizeof(StringId) * (packages + 1));
+    catalog->install_times = arena_grow(&catalog->arena, NULL, 0, sizeof(int64_t) * (packages + 1));
+    
+    int valid = string_offsets && string_data && table->hashes && table->package_ids &&
+                table->buckets && catalog->names && catalog->versions && catalog->groups &&
+                catalog->descriptions && catalog->replaces && catalog->size_bytes && catalog->download_bytes &&
+                catalog->flags && catalog->providers && catalog->dep_offsets && catalog->dep_ids &&
+                table->strings &&
+                catalog->trigram_offsets && catalog->trigram_postings &&
+                catalog->trigram_offsets[TRIGRAM_SPACE] == header.posting_total &&
+                catalog->states && catalog->retries && catalog->install_times &&
+                catalog->local_versions &&
+                header.lengths[SECTION_STRING_DATA] > 0 &&
+                string_data[header.lengths[SECTION_STRING_DATA] - 1] == '\0' &&
+                catalog->dep_offsets[packages] == header.dep_total;
+    
+    for (uint32_t i = 0; valid && i < strings; i++) {
+        valid = string_offsets[i] < header.lengths[SECTION_STRING_DATA];
+        if (valid) table->strings[i] = string_data + string_offsets[i];
+    }
+    for (uint32_t p = 0; valid && p < packages; p++) {
+        valid = catalog->names[p] < strings && catalog->versions[p] < strings &&
+                catalog->groups[p] < strings && catalog->descriptions[p] < strings &&
+                catalog->replaces[p] < strings &&
+                catalog->providers[p] <= packages &&
+                catalog->dep_offsets[p] <= catalog->dep_offsets[p + 1];
+    }
+    for (uint32_t d = 0; valid && d < header.dep_total; d++) {
+        valid = catalog->dep_ids[d] < packages;
+    }
+    // Posting ids are bounds checked where they are read
+    for (uint32_t t = 0; valid && t < TRIGRAM_SPACE; t++) {
+        valid = catalog->trigram_offsets[t] <= catalog->trigram_offsets[t + 1];
+    }
+    
+    if (!valid) {
+        log_message("Catalog snapshot is corrupt, rebuilding it", "warning");
+        catalog_destroy(catalog);
+        return NULL;
+    }
+    
+    // Full columns: the next addition grows them into the arena
+    table->count = table->capacity = strings;
+    table->bucket_mask = header.bucket_count - 1;
+    catalog->count = catalog->capacity = packages;
+    catalog->dep_total = header.dep_total;
+    catalog->dep_packages = packages;
+    catalog->posting_total = header.posting_total;
+    catalog->source_stamp = header.source_stamp;
+    return catalog;
+}
+
+/* Builds a catalog of every package the sync databases offer, with its search index */
+Catalog* catalog_build_available(SystemType sys_type) {
+    Catalog* catalog = catalog_create();
+    if (!catalog) {
+        return NULL;
+    }
+    
+    const char* command = (sys_type == SYSTEM_ARCH)
+        ? "LC_ALL=C pacman -Si 2>/dev/null"
+        : "LC_ALL=C apt-cache dumpavail 2>/dev/null";
+    pid_t pid;
+    struct timespec start;
+    FILE* output = open_command_output(command, &pid, &start);
+    if (!output) {
+        catalog_destroy(catalog);
+        return NULL;
+    }
+    read_package_records(output, catalog, 1);
+    int listed = close_command_output(output, pid, &start, command);
+    
+    if (!listed || !catalog_build_dependencies(catalog) || !catalog_build_trigrams(catalog)) {
+        catalog_destroy(catalog);
+        return NULL;
+    }
+    return catalog;
+}
+
+/* Opens the catalog for the current sync databases: the snapshot when one
+ * matches, otherwise a fresh build that is then saved as the new snapshot.
+ * Falls back to an empty catalog filled by per-package queries. */
+Catalog* catalog_open(SystemType sys_type) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t stamp = sync_db_stamp(sys_type);
+    
+    Catalog* catalog = catalog_load_snapshot(CATALOG_SNAPSHOT_FILE, sys_type, &stamp);
+    const char* source = "snapshot";
+    if (!catalog) {
+        catalog = catalog_build_available(sys_type);
+        source = "sync databases";
+        if (catalog) {
+            catalog->source_stamp = stamp;
+            catalog_save_snapshot(catalog, sys_type, stamp);
+        }
+    }
+    if (!catalog) {
+        log_message("Package catalog unavailable, querying packages individually", "warning");
+        return catalog_create();
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    char open_msg[MAX_LINE_LENGTH];
+    snprintf(open_msg, sizeof(open_msg), "Catalog of %u packages loaded from %s in %.2f ms",
+            catalog->count, source,
+            (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    log_message(open_msg, "info");
+    return catalog;
+}
+
+/* Search Command */
+double elapsed_ms(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double left = *(const double*)a;
+    double right = *(const double*)b;
+    return (left > right) - (left < right);
+}
+
+/* Repeats the query and reports the latency distribution, as a check that
+ * search stays in the millisecond range on the catalog at hand */
+void benchmark_search(const Catalog* catalog, const char* query, int runs, double open_ms) {
+    double* samples = malloc(sizeof(double) * runs);
+    if (!samples) {
+        return;
+    }
+    
+    int match_count = 0;
+    for (int r = 0; r < runs; r++) {
+        struct timespec start;
+        SearchHit* hits;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        search_catalog(catalog, query, SEARCH_RANK_LIMIT, &hits, &match_count);
+        samples[r] = elapsed_ms(&start);
+        free(hits);
+    }
+    qsort(samples, runs, sizeof(double), compare_doubles);
+    
+    printf("%sCatalog:%s %u packages, %u postings, opened in %.2f ms\n",
+           BOLD, RESET, catalog->count, catalog->posting_total, open_ms);
+    printf("%sQuery:%s \"%s\", %d matches over %d runs\n", BOLD, RESET, query, match_count, runs);
+    printf("%sLatency:%s min %.3f ms, median %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           BOLD, RESET, samples[0], samples[runs / 2], samples[(runs - 1) * 99 / 100],
+           samples[runs - 1]);
+    free(samples);
+}
+
+/* Looks up tools in the catalog snapshot. Needs neither root nor the lock,
+ * so it can run alongside an install. */
+int run_search_command(void) {
+    char query[MAX_LINE_LENGTH] = {0};
+    size_t used = 0;
+    for (int i = 0; i < g_config.command_arg_count; i++) {
+        int written = snprintf(query + used, sizeof(query) - used, "%s%s",
+                               i ? " " : "", g_config.command_args[i]);
+        if (written < 0 || (size_t)written >= sizeof(query) - used) {
+            fprintf(stderr, "%sSearch query too long%s\n", FG_RED, RESET);
+            return 1;
+        }
+        used += written;
+    }
+    
+    SystemType sys_type = detect_system_type();
+    if (sys_type == SYSTEM_UNKNOWN) {
+        fprintf(stderr, "%sUnsupported system type%s\n", FG_RED, RESET);
+        return 1;
+    }
+    
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Catalog* catalog = catalog_open(sys_type);
+    double open_ms = elapsed_ms(&start);
+    if (!catalog || catalog->count == 0) {
+        fprintf(stderr, "%sPackage catalog unavailable%s\n", FG_RED, RESET);
+        catalog_destroy(catalog);
+        return 1;
+    }
+    
+    if (g_config.benchmark_runs > 0) {
+        benchmark_search(catalog, query, g_config.benchmark_runs, open_ms);
+        catalog_destroy(catalog);
+        return 0;
+    }
+    
+    SearchHit* hits;
+    int match_count;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int hit_count = search_catalog(catalog, query, SEARCH_RANK_LIMIT, &hits, &match_count);
+    double search_ms = elapsed_ms(&start);
+    if (hit_count < 0) {
+        fprintf(stderr, "%sSearch terms need at least two letters or digits%s\n", FG_RED, RESET);
+        catalog_destroy(catalog);
+        return 1;
+    }
+    
+    int shown = hit_count < SEARCH_RESULT_LIMIT ? hit_count : SEARCH_RESULT_LIMIT;
+    for (int i = 0; i < shown; i++) {
+        uint32_t id = hits[i].id;
+        const char* groups = catalog_string(catalog, catalog->groups[id]);
+        printf("%s%s%s %s%s%s", BOLD FG_GREEN, package_name(catalog, id), RESET,
+               FG_CYAN, catalog_string(catalog, catalog->versions[id]), RESET);
+        if (*groups) {
+            printf(" %s(%s)%s", FG_BLUE, groups, RESET);
+        }
+        printf("\n    %s\n", catalog_string(catalog, catalog->descriptions[id]));
+    }
+    printf("%s%d of %d matches in %.2f ms%s\n", DIM, shown, match_count, search_ms, RESET);
+    
+    free(hits);
+    catalog_destroy(catalog);
+    return match_count > 0 ? 0 : 1;
+}
+
+/* Tool Profile Functions */
+void profile_paths(const char* name, char* path, size_t path_size,
+                   char* cache_path, size_t cache_size) {
+    if (strchr(name, '/')) {
+        snprintf(path, path_size, "%s", name);
+    } else {
+        snprintf(path, path_size, "%s/%s.profile", PROFILE_DIR, name);
+    }
+    
+    const char* base = strrchr(path, '/') + 1;
+    size_t length = strcspn(base, ".");
+    snprintf(cache_path, cache_size, "%s/%.*s.bits", PROFILE_CACHE_DIR, (int)length, base);
+}
+
+/* FNV-1a over the file, so an edited profile or config never matches a stale key */
+int hash_file_contents(const char* path, uint64_t* hash) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    
+    unsigned char buffer[OUTPUT_BUFFER_SIZE];
+    size_t length;
+    *hash = 14695981039346656037ULL;
+    while ((length = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        for (size_t i = 0; i < length; i++) {
+            *hash = (*hash ^ buffer[i]) * 1099511628211ULL;
+        }
+    }
+    
+    int read_ok = !ferror(fp);
+    fclose(fp);
+    return read_ok;
+}
+
+void free_profile(Profile* profile) {
+    for (int i = 0; i < profile->rule_count; i++) {
+        if (profile->rules[i].match == RULE_REGEX) {
+            regfree(&profile->rules[i].regex);
+        }
+    }
+    free(profile);
+}
+
+int parse_profile_rule(ProfileRule* rule, const char* action, const char* kind, const char* pattern) {
+    if (strcmp(action, "pin") == 0) {
+        rule->action = RULE_PIN;
+        rule->match = RULE_NAME;
+        snprintf(rule->pattern, sizeof(rule->pattern), "%s", kind);
+        return pattern == NULL || *pattern == '\0';
+    }
+    
+    if (strcmp(action, "include") == 0) {
+        rule->action = RULE_INCLUDE;
+    } else if (strcmp(action, "exclude") == 0) {
+        rule->action = RULE_EXCLUDE;
+    } else {
+        return 0;
+    }
+    if (!pattern || *pattern == '\0') {
+        return 0;
+    }
+    snprintf(rule->pattern, sizeof(rule->pattern), "%s", pattern);
+    
+    if (strcmp(kind, "group") == 0) {
+        rule->match = RULE_GROUP;
+    } else if (strcmp(kind, "glob") == 0) {
+        rule->match = RULE_GLOB;
+    } else if (strcmp(kind, "regex") == 0) {
+        rule->match = RULE_REGEX;
+        return regcomp(&rule->regex, rule->pattern, REG_EXTENDED | REG_NOSUB) == 0;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* Parses one rule per line:
+ *   include|exclude group NAME | glob PATTERN | regex PATTERN
+ *   pin PACKAGE
+ *   tier N group|glob|regex PATTERN
+ *   max-size SIZE            (bytes, or "500 MiB" style)
+ * Text after # is a comment. */
+Profile* parse_profile(const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        char error_msg[MAX_LINE_LENGTH];
+        snprintf(error_msg, sizeof(error_msg), "Profile not found: %.200s", path);
+        log_message(error_msg, "error");
+        return NULL;
+    }
+    
+    Profile* profile = calloc(1, sizeof(Profile));
+    char* line = NULL;
+    size_t line_size = 0;
+    int line_number = 0;
+    int valid = profile != NULL;
+    
+    while (valid && getline(&line, &line_size, fp) != -1) {
+        line_number++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        
+        char* save = NULL;
+        char* action = strtok_r(line, " \t", &save);
+        if (!action) {
+            continue;
+        }
+        char* argument = strtok_r(NULL, " \t", &save);
+        char* rest = strtok_r(NULL, "", &save);
+        while (rest && (*rest == ' ' || *rest == '\t')) rest++;
+        
+        if (!argument) {
+            valid = 0;
+        } else if (strcmp(action, "tier") == 0) {
+            // tier N KIND PATTERN ranks what KIND PATTERN matches without selecting it
+            char* kind = rest ? strtok_r(rest, " \t", &save) : NULL;
+            char* pattern = kind ? strtok_r(NULL, "", &save) : NULL;
+            ProfileRule* rule = &profile->rules[profile->rule_count];
+            int tier;
+            valid = profile->rule_count < MAX_PROFILE_RULES && kind &&
+                    parse_int_option(argument, 0, TIER_COUNT - 1, &tier) &&
+                    parse_profile_rule(rule, "include", kind, pattern);
+            if (valid) {
+                rule->action = RULE_TIER;
+                rule->tier = tier;
+                profile->rule_count++;
+            }
+        } else if (strcmp(action, "max-size") == 0) {
+            char size_text[MAX_LINE_LENGTH];
+            snprintf(size_text, sizeof(size_text), "%s %s", argument, rest ? rest : "");
+            profile->max_size = parse_size_value(size_text);
+            valid = profile->max_size > 0;
+        } else if (profile->rule_count < MAX_PROFILE_RULES &&
+                   parse_profile_rule(&profile->rules[profile->rule_count], action, argument, rest)) {
+            profile->rule_count++;
+        } else {
+            valid = 0;
+        }
+    }
+    
+    free(line);
+    fclose(fp);
+    if (!valid) {
+        char error_msg[MAX_LINE_LENGTH];
+        snprintf(error_msg, sizeof(error_msg), "Invalid rule in profile %.200s at line %d",
+                path, line_number);
+        log_message(error_msg, "error");
+        if (profile) free_profile(profile);
+        return NULL;
+    }
+    return profile;
+}
+
+/* Groups are a space separated list, so only whole entries match */
+int has_group(const char* groups, const char* group) {
+    size_t length = strlen(group);
+    for (const char* found = strstr(groups, group); found; found = strstr(found + 1, group)) {
+        if ((found == groups || found[-1] == ' ') &&
+            (found[length] == '\0' || found[length] == ' ')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int rule_matches(const ProfileRule* rule, const char* name, const char* groups) {
+    switch (rule->match) {
+        case RULE_NAME:  return strcmp(name, rule->pattern) == 0;
+        case RULE_GROUP: return has_group(groups, rule->pattern);
+        case RULE_GLOB:  return fnmatch(rule->pattern, name, 0) == 0;
+        case RULE_REGEX: return regexec(&rule->regex, name, 0, NULL, 0) == 0;
+    }
+    return 0;
+}
+
+/* A package is selected when it is pinned, or when an include rule matches,
+ * no exclude rule does and it fits under max-size. Only packages the sync
+ * databases offer are candidates, not names seen only as dependencies. */
+void compile_profile(const Profile* profile, const Catalog* catalog, uint64_t* bits) {
+    for (uint32_t p = 0; p < catalog->count; p++) {
+        if (!(catalog->flags[p] & PKG_FLAG_QUERIED)) {
+            continue;
+        }
+        const char* name = package_name(catalog, p);
+        const char* groups = catalog_string(catalog, catalog->groups[p]);
+        int included = 0, excluded = 0, pinned = 0;
+        
+        for (int r = 0; r < profile->rule_count && !pinned; r++) {
+            const ProfileRule* rule = &profile->rules[r];
+            if (rule->action == RULE_TIER || (rule->action == RULE_INCLUDE && included) ||
+                (rule->action == RULE_EXCLUDE && excluded) || !rule_matches(rule, name, groups)) {
+                continue;
+            }
+            if (rule->action == RULE_PIN) pinned = 1;
+            else if (rule->action == RULE_INCLUDE) included = 1;
+            else excluded = 1;
+        }
+        
+        if (pinned || (included && !excluded &&
+                       (profile->max_size == 0 || catalog->size_bytes[p] <= profile->max_size))) {
+            bits[p / 64] |= 1ULL << (p % 64);
+        }
+    }
+    
+    for (int r = 0; r < profile->rule_count; r++) {
+        if (profile->rules[r].action == RULE_PIN &&
+            catalog_find(catalog, profile->rules[r].pattern) == NO_PACKAGE) {
+            char warn_msg[MAX_LINE_LENGTH];
+            snprintf(warn_msg, sizeof(warn_msg), "Pinned package %.200s is not in the sync databases",
+                    profile->rules[r].pattern);
+            log_message(warn_msg, "warning");
+        }
+    }
+}
+
+int load_profile_bits(const char* cache_path, const ProfileCacheHeader* expected,
+                      uint64_t* bits, size_t words) {
+    FILE* fp = fopen(cache_path, "r");
+    if (!fp) {
+        return 0;
+    }
+    
+    ProfileCacheHeader header;
+    int loaded = fread(&header, sizeof(header), 1, fp) == 1 &&
+                 memcmp(&header, expected, sizeof(header)) == 0 &&
+                 fread(bits, sizeof(uint64_t), words, fp) == words;
+    fclose(fp);
+    return loaded;
+}
+
+void save_profile_bits(const char* cache_path, const ProfileCacheHeader* header,
+                       const uint64_t* bits, size_t words) {
+    if (!make_directories(PROFILE_CACHE_DIR, 0755)) {
+        return;
+    }
+    
+    char temp_path[PATH_MAX + 16];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", cache_path, (int)getpid());
+    FILE* fp = fopen(temp_path, "w");
+    if (!fp) {
+        return;
+    }
+    
+    int written = fwrite(header, sizeof(*header), 1, fp) == 1 &&
+                  fwrite(bits, sizeof(uint64_t), words, fp) == words;
+    if (fclose(fp) != 0 || !written || rename(temp_path, cache_path) != 0) {
+        unlink(temp_path);
+    }
+}
+
+/* Fills bits with the packages a profile selects from the catalog. The
+ * compiled bitset is cached per profile and reused while neither the profile
+ * file nor the sync databases change. */
+int profile_selection(const char* name, const Catalog* catalog, uint64_t* bits) {
+    char path[PATH_MAX];
+    char cache_path[PATH_MAX];
+    profile_paths(name, path, sizeof(path), cache_path, sizeof(cache_path));
+    
+    size_t words = (catalog->count + 63) / 64;
+    ProfileCacheHeader header = {0};
+    memcpy(header.magic, PROFILE_CACHE_MAGIC, sizeof(PROFILE_CACHE_MAGIC));
+    header.version = PROFILE_CACHE_VERSION;
+    header.package_count = catalog->count;
+    header.catalog_stamp = catalog->source_stamp;
+    int cacheable = catalog->source_stamp != 0 && hash_file_contents(path, &header.profile_hash);
+    
+    if (cacheable && load_profile_bits(cache_path, &header, bits, words)) {
+        return 1;
+    }
+    
+    Profile* profile = parse_profile(path);
+    if (!profile) {
+        return 0;
+    }
+    memset(bits, 0, sizeof(uint64_t) * words);
+    compile_profile(profile, catalog, bits);
+    free_profile(profile);
+    
+    if (cacheable) {
+        save_profile_bits(cache_path, &header, bits, words);
+    }
+    return 1;
+}
+
+/* Returns the union of the selected profiles as a heap bitset over the
+ * catalog, or NULL when a profile cannot be read */
+uint64_t* profile_selection_bits(const Catalog* catalog) {
+    size_t words = (catalog->count + 63) / 64;
+    uint64_t* selection = calloc(words + 1, sizeof(uint64_t));
+    uint64_t* bits = calloc(words + 1, sizeof(uint64_t));
+    if (!selection || !bits) {
+        free(selection);
+        free(bits);
+        return NULL;
+    }
+    
+    for (int i = 0; i < g_config.profile_count; i++) {
+        if (!profile_selection(g_config.profiles[i], catalog, bits)) {
+            free(selection);
+            free(bits);
+            return NULL;
+        }
+        for (size_t w = 0; w < words; w++) {
+            selection[w] |= bits[w];
+        }
+    }
+    
+    free(bits);
+    return selection;
+}
+
+/* Writes the union of the selected profiles as the tool list */
+int write_profile_selection(const Catalog* catalog, const char* output_path) {
+    uint64_t* selection = profile_selection_bits(catalog);
+    FILE* output = selection ? fopen(output_path, "w") : NULL;
+    uint32_t selected = 0;
+    for (uint32_t p = 0; output && p < catalog->count; p++) {
+        if (selection[p / 64] & (1ULL << (p % 64))) {
+            fprintf(output, "%s\n", package_name(catalog, p));
+            selected++;
+        }
+    }
+    
+    free(selection);
+    if (!output || fclose(output) != 0) {
+        return 0;
+    }
+    
+    char select_msg[MAX_LINE_LENGTH];
+    snprintf(select_msg, sizeof(select_msg), "Profiles select %u of %u packages",
+            selected, catalog->count);
+    log_message(select_msg, "info");
+    return 1;
+}
+
+/* Priority Tier Functions */
+/* Ranks the planned packages by a popularity list: one tool per line, most
+ * popular first, or popcon's "RANK NAME ..." lines */
+void apply_popularity_tiers(const Catalog* catalog, uint8_t* tiers) {
+    FILE* fp = fopen(POPULARITY_FILE, "r");
+    if (!fp) {
+        return;
+    }
+    char* line = NULL;
+    size_t line_size = 0;
+    uint32_t rank = 0;
+    while (getline(&line, &line_size, fp) != -1) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        char* save = NULL;
+        char* name = strtok_r(line, " \t", &save);
+        if (name && strspn(name, "0123456789") == strlen(name)) {
+            name = strtok_r(NULL, " \t", &save);
+        }
+        uint32_t id = name ? catalog_find(catalog, name) : NO_PACKAGE;
+        if (id == NO_PACKAGE || !(catalog->flags[id] & PKG_FLAG_PLANNED) || tiers[id] != DEFAULT_TIER) {
+            continue;
+        }
+        tiers[id] = (rank < POPULAR_TIER0_TOOLS) ? 0 : (rank < POPULAR_TIER1_TOOLS) ? 1 : 2;
+        rank++;
+    }
+    free(line);
+    fclose(fp);
+}
+
+/* Profile tier rules override popularity; the first rule matching a package
+ * places it */
+void apply_profile_tiers(const Catalog* catalog, uint8_t* tiers) {
+    uint8_t* placed = calloc(catalog->count + 1, 1);
+    for (int i = 0; placed && i < g_config.profile_count; i++) {
+        char path[PATH_MAX];
+        char cache_path[PATH_MAX];
+        profile_paths(g_config.profiles[i], path, sizeof(path), cache_path, sizeof(cache_path));
+        Profile* profile = parse_profile(path);
+        if (!profile) {
+            continue;
+        }
+        for (int r = 0; r < profile->rule_count; r++) {
+            const ProfileRule* rule = &profile->rules[r];
+            if (rule->action != RULE_TIER) {
+                continue;
+            }
+            for (uint32_t id = 0; id < catalog->count; id++) {
+                if ((catalog->flags[id] & PKG_FLAG_PLANNED) && !placed[id] &&
+                    rule_matches(rule, package_name(catalog, id), catalog_string(catalog, catalog->groups[id]))) {
+                    tiers[id] = (uint8_t)rule->tier;
+                    placed[id] = 1;
+                }
+            }
+        }
+        free_profile(profile);
+    }
+    free(placed);
+}
+
+/* Tier of every planned package, 0 installed first. Returns NULL when out of
+ * memory, which leaves the install in catalog order. */
+uint8_t* plan_tiers(const Catalog* catalog) {
+    uint8_t* tiers = malloc(catalog->count + 1);
+    if (!tiers) {
+        return NULL;
+    }
+    memset(tiers, DEFAULT_TIER, catalog->count + 1);
+    apply_popularity_tiers(catalog, tiers);
+    apply_profile_tiers(catalog, tiers);
+    return tiers;
+}
+
+int compare_tiers(const void* a, const void* b, void* arg) {
+    const uint8_t* tiers = arg;
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    if (tiers[x] != tiers[y]) {
+        return tiers[x] - tiers[y];
+    }
+    return (x > y) - (x < y);
+}
+
+/* Records the run time at which the last queued package of each tier was done */
+void record_finished_tiers(const uint8_t* tiers, const uint32_t* queue, int head, int tail) {
+    int pending[TIER_COUNT] = {0};
+    for (int i = head; i < tail; i++) {
+        pending[tiers[queue[i]]]++;
+    }
+    for (int t = 0; t < TIER_COUNT; t++) {
+        if (g_report.tier_packages[t] > 0 && g_report.tier_finished[t] < 0 && pending[t] == 0) {
+            g_report.tier_finished[t] = (long)(time(NULL) - g_report.start_time);
+            char tier_msg[MAX_LINE_LENGTH];
+            snprintf(tier_msg, sizeof(tier_msg), "Tier %d finished after %lds", t, g_report.tier_finished[t]);
+            log_message(tier_msg, "info");
+        }
+    }
+}
+
+/* Resume Journal Functions */
+void journal_append(const char* format, ...) {
+    if (!g_journal.fp) {
+        return;
+    }
+    
+    va_list args;
+    va_start(args, format);
+    vfprintf(g_journal.fp, format, args);
+    va_end(args);
+    
+    if (++g_journal.unsynced >= JOURNAL_SYNC_RECORDS) {
+        fflush(g_journal.fp);
+        fdatasync(fileno(g_journal.fp));
+        g_journal.unsynced = 0;
+    }
+}
+
+void journal_sync(void) {
+    if (g_journal.fp && g_journal.unsynced > 0) {
+        fflush(g_journal.fp);
+        fdatasync(fileno(g_journal.fp));
+        g_journal.unsynced = 0;
+    }
+}
+
+void journal_record_package(const Catalog* catalog, uint32_t id) {
+    journal_append("S %s %s %d %lld %llu\n", package_name(catalog, id),
+                   package_state_name(catalog->states[id]), catalog->retries[id],
+                   (long long)catalog->install_times[id], (unsigned long long)catalog->size_bytes[id]);
+}
+
+/* Starts a fresh journal holding the plan for this run */
+int journal_begin(SystemType sys_type, const Catalog* catalog) {
+    mkdir(STATE_DIR, 0755);
+    
+    g_journal.fp = fopen(JOURNAL_FILE, "w");
+    if (!g_journal.fp) {
+        log_message("Failed to create resume journal", "warning");
+        return 0;
+    }
+    
+    journal_append("H %d %d %llu %016llx\n", JOURNAL_VERSION, (int)sys_type, sync_db_stamp(sys_type),
+                   (unsigned long long)selection_fingerprint(sys_type));
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (catalog->flags[id] & PKG_FLAG_PLANNED) {
+            journal_append("P %s\n", package_name(catalog, id));
+        }
+    }
+    journal_sync();
+    
+    // Make the new journal's directory entry durable as well
+    int dir_fd = open(STATE_DIR, O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 1;
+}
+
+/* Closes the journal. A completed run removes it, an interrupted one keeps it for --resume. */
+void journal_close(int completed) {
+    if (!g_journal.fp) {
+        return;
+    }
+    
+    journal_sync();
+    fclose(g_journal.fp);
+    g_journal.fp = NULL;
+    
+    if (completed) {
+        unlink(JOURNAL_FILE);
+    }
+}
+
+/* Whether the journal was written for the selection this run makes: same
+ * command, --new-only and profiles. 0 when it differs or is unreadable. */
+int journal_matches_selection(SystemType sys_type) {
+    FILE* fp = fopen(JOURNAL_FILE, "r");
+    if (!fp) {
+        return 0;
+    }
+    int version = 0, journal_type = 0;
+    unsigned long long stamp = 0, selection = 0;
+    int parsed = fscanf(fp, "H %d %d %llu %llx", &version, &journal_type, &stamp, &selection) == 4;
+    fclose(fp);
+    return parsed && version == JOURNAL_VERSION && journal_type == (int)sys_type &&
+           selection == selection_fingerprint(sys_type);
+}
+
+/* Rebuilds the plan and package outcomes of an interrupted run. Fails when no
+ * journal exists or the sync databases changed since it was written, in which
+ * case the caller plans from scratch. A torn final record is ignored. */
+int journal_load(SystemType sys_type, Catalog** catalog_out) {
+    FILE* fp = fopen(JOURNAL_FILE, "r");
+    if (!fp) {
+        return 0;
+    }
+    
+    char line[MAX_LINE_LENGTH * 2];
+    int version = 0, journal_type = 0;
+    unsigned long long stamp = 0, selection = 0;
+    
+    if (!fgets(line, sizeof(line), fp) ||
+        sscanf(line, "H %d %d %llu %llx", &version, &journal_type, &stamp, &selection) != 4 ||
+        version != JOURNAL_VERSION || journal_type != (int)sys_type) {
+        log_message("Resume journal is unreadable, planning from scratch", "warning");
+        fclose(fp);
+        return 0;
+    }
+    if (selection != selection_fingerprint(sys_type)) {
+        log_message("Resuming the interrupted run's own selection, not the profiles given now", "warning");
+    }
+    
+    if (stamp != sync_db_stamp(sys_type)) {
+        log_message("Sync databases changed since the interrupted run, planning from scratch", "info");
+        fclose(fp);
+        return 0;
+    }
+    
+    Catalog* catalog = catalog_open(sys_type);
+    if (!catalog) {
+        fclose(fp);
+        return 0;
+    }
+    
+    char* record = NULL;
+    size_t record_size = 0;
+    while (getline(&record, &record_size, fp) != -1) {
+        if (!strchr(record, '\n')) {
+            break;  // Torn write at the crash point
+        }
+        record[strcspn(record, "\n")] = '\0';
+        
+        char* name = NULL;
+        char status[32];
+        int retry_count;
+        long long install_time;
+        unsigned long long size_bytes;
+        
+        if (strncmp(record, "P ", 2) == 0 && record[2]) {
+            uint32_t id = catalog_add(catalog, record + 2, strlen(record + 2));
+            if (id == NO_PACKAGE) {
+                free(record);
+                catalog_destroy(catalog);
+                fclose(fp);
+                return 0;
+            }
+            catalog_plan(catalog, id);
+        } else if (record[0] == 'S' &&
+                   sscanf(record, "S %ms %31s %d %lld %llu", &name, status, &retry_count,
+                          &install_time, &size_bytes) == 5) {
+            // Later records win
+            uint32_t id = catalog_find(catalog, name);
+            int state = parse_package_state(status);
+            if (id != NO_PACKAGE && state >= 0) {
+                catalog->states[id] = (uint8_t)state;
+                catalog->retries[id] = (uint8_t)retry_count;
+                catalog->install_times[id] = install_time;
+                catalog->size_bytes[id] = size_bytes;
+            }
+        }
+        free(name);
+    }
+    free(record);
+    fclose(fp);
+    
+    // Keep appending to the same journal so a second interruption resumes as well
+    g_journal.fp = fopen(JOURNAL_FILE, "a");
+    
+    *catalog_out = catalog;
+    return 1;
+}
+
+/* Run Fingerprint Functions */
+uint64_t fingerprint_mix(uint64_t hash, const void* data, size_t length) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t fingerprint_mix_file(uint64_t hash, const char* path) {
+    uint64_t contents = 0;
+    hash_file_contents(path, &contents);
+    return fingerprint_mix(hash, &contents, sizeof(contents));
+}
+
+/* Size, times and inode stand in for the contents of the local database */
+uint64_t fingerprint_mix_stat(uint64_t hash, const char* path) {
+    struct stat st;
+    unsigned long long fields[4] = {0};
+    if (stat(path, &st) == 0) {
+        fields[0] = (unsigned long long)st.st_size;
+        fields[1] = (unsigned long long)st.st_mtim.tv_sec;
+        fields[2] = (unsigned long long)st.st_mtim.tv_nsec;
+        fields[3] = (unsigned long long)st.st_ino;
+    }
+    return fingerprint_mix(hash, fields, sizeof(fields));
+}
+
+/* pacman.conf and every file it includes, mirrorlists among them, followed
+ * the way pacman reads them */
+uint64_t fingerprint_mix_pacman_conf(uint64_t hash, const char* path, int depth) {
+    hash = fingerprint_mix(hash, path, strlen(path) + 1);
+    hash = fingerprint_mix_file(hash, path);
+    FILE* fp = depth <= MAX_INCLUDE_DEPTH ? fopen(path, "r") : NULL;
+    if (!fp) {
+        return hash;
+    }
+    char line[MAX_LINE_LENGTH * 2];
+    while (fgets(line, sizeof(line), fp)) {
+        char* text = trim_whitespace(line);
+        char* equals = strchr(text, '=');
+        if (*text == '#' || !equals) {
+            continue;
+        }
+        *equals = '\0';
+        glob_t matches;
+        if (strcmp(trim_whitespace(text), "Include") == 0 &&
+            glob(trim_whitespace(equals + 1), 0, NULL, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; i++) {
+                hash = fingerprint_mix_pacman_conf(hash, matches.gl_pathv[i], depth + 1);
+            }
+            globfree(&matches);
+        }
+    }
+    fclose(fp);
+    return hash;
+}
+
+/* sources.list and every list in sources.list.d, in sorted order */
+uint64_t fingerprint_mix_apt_sources(uint64_t hash) {
+    hash = fingerprint_mix_file(hash, APT_SOURCES_LIST);
+    const char* patterns[] = { APT_SOURCES_DIR "/*.list", APT_SOURCES_DIR "/*.sources" };
+    for (int p = 0; p < 2; p++) {
+        glob_t matches;
+        if (glob(patterns[p], 0, NULL, &matches) != 0) {
+            continue;
+        }
+        for (size_t i = 0; i < matches.gl_pathc; i++) {
+            hash = fingerprint_mix(hash, matches.gl_pathv[i], strlen(matches.gl_pathv[i]) + 1);
+            hash = fingerprint_mix_file(hash, matches.gl_pathv[i]);
+        }
+        globfree(&matches);
+    }
+    return hash;
+}
+
+/* What a run selects: the command, --new-only and the profiles, by path and
+ * contents, or the default categories */
+uint64_t selection_fingerprint(SystemType sys_type) {
+    uint64_t hash = 14695981039346656037ULL;
+    hash = fingerprint_mix(hash, &sys_type, sizeof(sys_type));
+    hash = fingerprint_mix(hash, &g_config.command, sizeof(g_config.command));
+    hash = fingerprint_mix(hash, &g_config.new_only, sizeof(g_config.new_only));
+    for (int i = 0; i < g_config.profile_count; i++) {
+        char path[PATH_MAX], cache_path[PATH_MAX];
+        profile_paths(g_config.profiles[i], path, sizeof(path), cache_path, sizeof(cache_path));
+        hash = fingerprint_mix(hash, path, strlen(path) + 1);
+        hash = fingerprint_mix_file(hash, path);
+    }
+    if (g_config.profile_count == 0) {
+        for (int i = 0; KALI_TOOL_CATEGORIES[i] != NULL; i++) {
+            hash = fingerprint_mix(hash, KALI_TOOL_CATEGORIES[i], strlen(KALI_TOOL_CATEGORIES[i]) + 1);
+        }
+    }
+    return hash;
+}
+
+/* Everything that decides what a run would do and can be read locally: the
+ * selection, the repository configuration, the sync databases and the local
+ * package database */
+uint64_t run_fingerprint(SystemType sys_type) {
+    uint64_t selection = selection_fingerprint(sys_type);
+    uint64_t hash = fingerprint_mix(14695981039346656037ULL, &selection, sizeof(selection));
+    
+    if (sys_type == SYSTEM_ARCH) {
+        hash = fingerprint_mix_pacman_conf(hash, PACMAN_CONF, 0);
+        hash = fingerprint_mix_stat(hash, PACMAN_LOCAL_DIR);
+    } else {
+        hash = fingerprint_mix_apt_sources(hash);
+        hash = fingerprint_mix_stat(hash, DPKG_STATUS_FILE);
+    }
+    
+    unsigned long long databases = sync_db_stamp(sys_type);
+    return fingerprint_mix(hash, &databases, sizeof(databases));
+}
+
+/* A run may be skipped when its fingerprint matches the last complete run,
+ * unless that run is older than FINGERPRINT_MAX_AGE or one was interrupted */
+int run_is_unchanged(SystemType sys_type, time_t* recorded_at) {
+    if (access(JOURNAL_FILE, F_OK) == 0) {
+        return 0;
+    }
+    FILE* fp = fopen(FINGERPRINT_FILE, "r");
+    if (!fp) {
+        return 0;
+    }
+    
+    unsigned long long recorded;
+    long long when;
+    int parsed = fscanf(fp, "%llx %lld", &recorded, &when) == 2;
+    fclose(fp);
+    if (!parsed || time(NULL) - when > FINGERPRINT_MAX_AGE) {
+        return 0;
+    }
+    
+    *recorded_at = (time_t)when;
+    return recorded == run_fingerprint(sys_type);
+}
+
+/* Called after a run installed everything it planned, so the fingerprint
+ * covers the databases as that run left them */
+void record_run_fingerprint(SystemType sys_type) {
+    mkdir(STATE_DIR, 0755);
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.part", FINGERPRINT_FILE);
+    
+    FILE* fp = fopen(temp_path, "w");
+    if (!fp) {
+        return;
+    }
+    fprintf(fp, "%016llx %lld\n", (unsigned long long)run_fingerprint(sys_type), (long long)time(NULL));
+    if (fclose(fp) != 0 || rename(temp_path, FINGERPRINT_FILE) != 0) {
+        unlink(temp_path);
+        log_message("Failed to record run fingerprint", "warning");
+    }
+}
+
+/* Catalog Diff Functions */
+/* Reads the baseline, one package name per line, into a bare catalog whose
+ * packages are all marked as queried. Returns NULL when there is none. */
+Catalog* load_selection_baseline(void) {
+    FILE* fp = fopen(SELECTION_BASELINE_FILE, "r");
+    if (!fp) {
+        return NULL;
+    }
+    Catalog* baseline = catalog_create();
+    char line[MAX_LINE_LENGTH];
+    while (baseline && fgets(line, sizeof(line), fp)) {
+        size_t length = strcspn(line, "\n");
+        uint32_t id = length > 0 ? catalog_add(baseline, line, length) : NO_PACKAGE;
+        if (id != NO_PACKAGE) {
+            baseline->flags[id] |= PKG_FLAG_QUERIED;
+        }
+    }
+    fclose(fp);
+    return baseline;
+}
+
+/* Adds what a complete run installed to the baseline: its planned packages,
+ * with planned group names written as their members. Earlier entries stay,
+ * so runs with different profiles build up one baseline. */
+void record_selection_baseline(const Catalog* catalog) {
+    mkdir(STATE_DIR, 0755);
+    Catalog* previous = load_selection_baseline();
+    const char* temp_path = SELECTION_BASELINE_FILE ".part";
+    FILE* fp = fopen(temp_path, "w");
+    if (!fp) {
+        catalog_destroy(previous);
+        log_message("Failed to record selection baseline", "warning");
+        return;
+    }
+    
+    // Names this run planned are written below
+    for (uint32_t id = 0; previous && id < previous->count; id++) {
+        uint32_t current = catalog_find(catalog, package_name(previous, id));
+        if (current == NO_PACKAGE || !(catalog->flags[current] & PKG_FLAG_PLANNED)) {
+            fprintf(fp, "%s\n", package_name(previous, id));
+        }
+    }
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (!(catalog->flags[id] & PKG_FLAG_PLANNED)) {
+            continue;
+        }
+        if (catalog->flags[id] & PKG_FLAG_QUERIED) {
+            fprintf(fp, "%s\n", package_name(catalog, id));
+            continue;
+        }
+        const char* group = package_name(catalog, id);
+        for (uint32_t p = 0; p < catalog->count; p++) {
+            if ((catalog->flags[p] & PKG_FLAG_QUERIED) && !(catalog->flags[p] & PKG_FLAG_PLANNED) &&
+                has_group(catalog_string(catalog, catalog->groups[p]), group)) {
+                fprintf(fp, "%s\n", package_name(catalog, p));
+            }
+        }
+    }
+    catalog_destroy(previous);
+    
+    int written = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    written = (fclose(fp) == 0) && written;
+    if (!written || rename(temp_path, SELECTION_BASELINE_FILE) != 0) {
+        unlink(temp_path);
+        log_message("Failed to record selection baseline", "warning");
+    }
+}
+
+/* Replaces each planned group name by its members, as the package manager
+ * would when asked to install the group */
+void expand_planned_groups(Catalog* catalog) {
+    uint32_t count = catalog->count;
+    for (uint32_t id = 0; id < count; id++) {
+        if (!(catalog->flags[id] & PKG_FLAG_PLANNED) || (catalog->flags[id] & PKG_FLAG_QUERIED) ||
+            catalog->providers[id] != 0) {
+            continue;
+        }
+        const char* group = package_name(catalog, id);
+        int members = 0;
+        for (uint32_t p = 0; p < count; p++) {
+            if ((catalog->flags[p] & PKG_FLAG_QUERIED) &&
+                has_group(catalog_string(catalog, catalog->groups[p]), group)) {
+                catalog_plan(catalog, p);
+                members++;
+            }
+        }
+        if (members > 0) {
+            catalog_unplan(catalog, id);
+        }
+    }
+}
+
+int is_in_baseline(const Catalog* baseline, const Catalog* catalog, StringId name) {
+    uint32_t old = catalog_find(baseline, catalog_string(catalog, name));
+    return old != NO_PACKAGE && (baseline->flags[old] & PKG_FLAG_QUERIED);
+}
+
+/* --new-only: narrows the plan to packages that no complete run has
+ * installed yet. Planned group names are expanded first so that new members
+ * of an old group count. A new package that replaces one the baseline had is
+ * a rename; any other is an addition. The summary is printed when show is set. */
+int select_new_packages(Catalog* catalog, int show) {
+    Catalog* baseline = load_selection_baseline();
+    if (!baseline) {
+        log_message("No catalog baseline from a complete run; run once without --new-only", "error");
+        return 0;
+    }
+    
+    expand_planned_groups(catalog);
+    
+    uint32_t added = 0, renamed = 0;
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (!(catalog->flags[id] & PKG_FLAG_PLANNED)) {
+            continue;
+        }
+        if (is_in_baseline(baseline, catalog, catalog->names[id])) {
+            catalog_unplan(catalog, id);
+            continue;
+        }
+        
+        char diff_msg[MAX_LINE_LENGTH];
+        if (catalog->replaces[id] != 0 && is_in_baseline(baseline, catalog, catalog->replaces[id])) {
+            renamed++;
+            snprintf(diff_msg, sizeof(diff_msg), "Renamed: %.100s -> %.100s",
+                    catalog_string(catalog, catalog->replaces[id]), package_name(catalog, id));
+        } else {
+            added++;
+            snprintf(diff_msg, sizeof(diff_msg), "Added: %.200s", package_name(catalog, id));
+        }
+        log_message(diff_msg, "info");
+    }
+    
+    struct stat st;
+    char since[32] = "the last complete run";
+    if (stat(SELECTION_BASELINE_FILE, &st) == 0) {
+        strftime(since, sizeof(since), "%Y-%m-%d %H:%M", localtime(&st.st_mtime));
+    }
+    char summary[MAX_LINE_LENGTH];
+    snprintf(summary, sizeof(summary), "New since %s: %u added, %u renamed (baseline of %u packages)",
+            since, added, renamed, baseline->count);
+    log_message(summary, "info");
+    if (show) {
+        printf("%s%s %s%s\n", FG_CYAN, SYMBOL_INFO, summary, RESET);
+    }
+    
+    catalog_destroy(baseline);
+    return 1;
+}
+
+/* Disk Admission Functions */
+/* Sums what installing and downloading need on each filesystem they touch.
+ * Paths sharing a filesystem have their requirements summed. Returns the
+ * number of filesystems filled in. */
+int plan_mount_usage(SystemType sys_type, unsigned long long install_bytes,
+                     unsigned long long download_bytes, MountUsage* usage) {
+    const char* paths[MAX_PROBE_MOUNTS] = { "/", package_cache_dir(sys_type), "/var" };
+    unsigned long long needs[MAX_PROBE_MOUNTS] = { install_bytes, download_bytes, 0 };
+    dev_t devices[MAX_PROBE_MOUNTS];
+    int mounts = 0;
+    
+    for (int i = 0; i < MAX_PROBE_MOUNTS; i++) {
+        struct stat st;
+        struct statvfs fs_stats;
+        if (stat(paths[i], &st) != 0 || statvfs(paths[i], &fs_stats) != 0) {
+            continue;
+        }
+        
+        int m = 0;
+        while (m < mounts && devices[m] != st.st_dev) m++;
+        if (m == mounts) {
+            devices[m] = st.st_dev;
+            usage[m].path = paths[i];
+            usage[m].required = 0;
+            usage[m].available = (unsigned long long)fs_stats.f_frsize * fs_stats.f_bavail;
+            mounts++;
+        }
+        usage[m].required += needs[i];
+    }
+    return mounts;
+}
+
+/* Checks that every mount touched by a transaction keeps DISK_RESERVE_BYTES free
+ * after it */
+int check_mount_space(SystemType sys_type, unsigned long long install_bytes,
+                      unsigned long long download_bytes, char* reason, size_t reason_len) {
+    InstallPlan plan = {0};
+    plan.mount_count = plan_mount_usage(sys_type, install_bytes, download_bytes, plan.mounts);
+    return plan_fits(&plan, reason, reason_len);
+}
+
+/* Pushes a package back to the end of the queue once; a second refusal skips it */
+void shed_package(Catalog* catalog, uint32_t id, uint32_t* queue, int* tail) {
+    char shed_msg[MAX_LINE_LENGTH];
+    
+    if (catalog->states[id] != PKG_DEFERRED) {
+        catalog->states[id] = PKG_DEFERRED;
+        queue[(*tail)++] = id;
+        snprintf(shed_msg, sizeof(shed_msg), "Deferred %.200s until space is available",
+                package_name(catalog, id));
+        log_message(shed_msg, "warning");
+    } else {
+        catalog->states[id] = PKG_SKIPPED;
+        g_progress.completed_packages++;
+        snprintf(shed_msg, sizeof(shed_msg), "Skipped %.200s: not enough disk space",
+                package_name(catalog, id));
+        log_message(shed_msg, "error");
+    }
+    journal_record_package(catalog, id);
+}
+
+/* Shrinks the batch until it fits on disk, largest packages first. The first
+ * time the batch does not fit, whatever its size, waits for space to be freed
+ * before shedding anything, so a transient shortfall costs no packages.
+ * Returns the number of packages admitted. */
+int admit_batch(SystemType sys_type, Catalog* catalog, uint32_t* batch, int count,
+                uint32_t* queue, int* tail) {
+    char reason[MAX_LINE_LENGTH];
+    int waited = 0;
+    
+    while (count > 0) {
+        unsigned long long install_bytes = 0, download_bytes = 0;
+        for (int i = 0; i < count; i++) {
+            install_bytes += catalog->size_bytes[batch[i]];
+            download_bytes += catalog->download_bytes[batch[i]];
+        }
+        
+        if (check_mount_space(sys_type, install_bytes, download_bytes, reason, sizeof(reason))) {
+            return count;
+        }
+        log_message(reason, "warning");
+        
+        if (!waited) {
+            waited = 1;
+            time_t deadline = time(NULL) + ADMISSION_WAIT_SECONDS;
+            int fits = 0;
+            while (!fits && keep_running && time(NULL) < deadline) {
+                show_smooth_progress("Waiting for disk space...", progress_percentage());
+                sleep(ADMISSION_POLL_SECONDS);
+                fits = check_mount_space(sys_type, install_bytes, download_bytes,
+                                         reason, sizeof(reason));
+            }
+            if (fits) {
+                return count;
+            }
+        }
+        
+        int largest = 0;
+        for (int i = 1; i < count; i++) {
+            if (catalog->size_bytes[batch[i]] + catalog->download_bytes[batch[i]] >
+                catalog->size_bytes[batch[largest]] + catalog->download_bytes[batch[largest]]) {
+                largest = i;
+            }
+        }
+        
+        shed_package(catalog, batch[largest], queue, tail);
+        batch[largest] = batch[--count];
+    }
+    
+    return 0;
+}
+
+/* Install Planning Functions */
+/* Flags a name as installed. The version is recorded for the package itself
+ * and is NULL for the names it provides. */
+void mark_installed_name(Catalog* catalog, const char* name, size_t length, const char* version) {
+    char buffer[MAX_LINE_LENGTH];
+    if (length == 0 || length >= sizeof(buffer)) {
+        return;
+    }
+    memcpy(buffer, name, length);
+    buffer[length] = '\0';
+    
+    uint32_t id = catalog_find(catalog, buffer);
+    if (id != NO_PACKAGE) {
+        catalog->flags[id] |= PKG_FLAG_INSTALLED;
+        if (version && *version) {
+            catalog->local_versions[id] = intern_string(catalog, version, strlen(version));
+        }
+    }
+}
+
+/* Reads a pacman local desc file: the package name and version, and every
+ * name it provides */
+void mark_pacman_local_package(Catalog* catalog, const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return;
+    }
+    
+    char* line = NULL;
+    size_t line_size = 0;
+    char section[32] = "";
+    char name[MAX_LINE_LENGTH] = "", version[MAX_LINE_LENGTH] = "";
+    while (getline(&line, &line_size, fp) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '%') {
+            snprintf(section, sizeof(section), "%s", line);
+        } else if (line[0] == '\0') {
+            section[0] = '\0';
+        } else if (strcmp(section, "%NAME%") == 0) {
+            snprintf(name, sizeof(name), "%s", line);
+        } else if (strcmp(section, "%VERSION%") == 0) {
+            snprintf(version, sizeof(version), "%s", line);
+        } else if (strcmp(section, "%PROVIDES%") == 0) {
+            mark_installed_name(catalog, line, strcspn(line, "<>="), NULL);
+        }
+    }
+    mark_installed_name(catalog, name, strlen(name), version);
+    
+    free(line);
+    fclose(fp);
+}
+
+/* Forgets the previous local state, so a long-lived catalog sees packages
+ * removed since it was last marked. Outdated only applies to installed
+ * packages and is kept for the ones still installed. */
+void catalog_clear_installed(Catalog* catalog) {
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        catalog->flags[id] &= ~PKG_FLAG_INSTALLED;
+        catalog->local_versions[id] = 0;
+    }
+}
+
+void catalog_drop_stale_outdated(Catalog* catalog) {
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (!(catalog->flags[id] & PKG_FLAG_INSTALLED)) {
+            catalog->flags[id] &= ~PKG_FLAG_OUTDATED;
+        }
+    }
+}
+
+/* Flags every package, and every name they provide, found in the local
+ * database: pacman's local directory or dpkg's status file */
+int catalog_mark_installed(SystemType sys_type, Catalog* catalog) {
+    if (sys_type == SYSTEM_ARCH) {
+        DIR* dir = opendir(PACMAN_LOCAL_DIR);
+        if (!dir) {
+            return 0;
+        }
+        catalog_clear_installed(catalog);
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s/desc", PACMAN_LOCAL_DIR, entry->d_name);
+            mark_pacman_local_package(catalog, path);
+        }
+        closedir(dir);
+        catalog_drop_stale_outdated(catalog);
+        return 1;
+    }
+    
+    FILE* fp = fopen(DPKG_STATUS_FILE, "r");
+    if (!fp) {
+        return 0;
+    }
+    catalog_clear_installed(catalog);
+    
+    char* line = NULL;
+    size_t line_size = 0;
+    char package[MAX_LINE_LENGTH] = "";
+    int installed = 0;
+    while (getline(&line, &line_size, fp) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "Package: ", 9) == 0) {
+            snprintf(package, sizeof(package), "%s", line + 9);
+            installed = 0;
+        } else if (strncmp(line, "Status: ", 8) == 0) {
+            installed = strstr(line, " installed") != NULL;
+            if (installed) {
+                mark_installed_name(catalog, package, strlen(package), NULL);
+            }
+        } else if (strncmp(line, "Version: ", 9) == 0 && installed) {
+            mark_installed_name(catalog, package, strlen(package), line + 9);
+        } else if (strncmp(line, "Provides: ", 10) == 0 && installed) {
+            char* save = NULL;
+            for (char* item = strtok_r(line + 10, ",", &save); item;
+                 item = strtok_r(NULL, ",", &save)) {
+                item += strspn(item, " ");
+                mark_installed_name(catalog, item, strcspn(item, " (:"), NULL);
+            }
+        }
+    }
+    
+    free(line);
+    fclose(fp);
+    catalog_drop_stale_outdated(catalog);
+    return 1;
+}
+
+int compare_strings(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/* Sorted names of the package archives already downloaded */
+void load_cache_listing(const char* dir_path, CacheListing* listing) {
+    memset(listing, 0, sizeof(*listing));
+    DIR* dir = opendir(dir_path);
+    if (!dir) {
+        return;
+    }
+    
+    size_t capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (entry->d_name[0] == '.' || (length > 4 && strcmp(entry->d_name + length - 4, ".sig") == 0)) {
+            continue;
+        }
+        if (listing->count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            char** names = realloc(listing->names, sizeof(char*) * capacity);
+            if (!names) {
+                break;
+            }
+            listing->names = names;
+        }
+        listing->names[listing->count] = strdup(entry->d_name);
+        if (listing->names[listing->count]) {
+            listing->count++;
+        }
+    }
+    closedir(dir);
+    
+    qsort(listing->names, listing->count, sizeof(char*), compare_strings);
+}
+
+void free_cache_listing(CacheListing* listing) {
+    for (size_t i = 0; i < listing->count; i++) {
+        free(listing->names[i]);
+    }
+    free(listing->names);
+    memset(listing, 0, sizeof(*listing));
+}
+
+/* Archives are NAME-VERSION-ARCH.pkg.tar.* for pacman and NAME_VERSION_ARCH.deb
+ * for apt, with the epoch colon written as %3a */
+int is_package_cached(const CacheListing* listing, SystemType sys_type,
+                      const char* name, const char* version) {
+    char prefix[MAX_LINE_LENGTH * 2];
+    if (sys_type == SYSTEM_ARCH) {
+        snprintf(prefix, sizeof(prefix), "%s-%s-", name, version);
+    } else {
+        const char* colon = strchr(version, ':');
+        if (colon) {
+            snprintf(prefix, sizeof(prefix), "%s_%.*s%%3a%s_", name,
+                    (int)(colon - version), version, colon + 1);
+        } else {
+            snprintf(prefix, sizeof(prefix), "%s_%s_", name, version);
+        }
+    }
+    
+    size_t low = 0, high = listing->count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (strcmp(listing->names[middle], prefix) < 0) low = middle + 1;
+        else high = middle;
+    }
+    
+    size_t length = strlen(prefix);
+    for (size_t i = low; i < listing->count && strncmp(listing->names[i], prefix, length) == 0; i++) {
+        const char* rest = listing->names[i] + length;
+        const char* suffix = strstr(rest, sys_type == SYSTEM_ARCH ? ".pkg.tar" : ".deb");
+        // The architecture is all that may sit between the prefix and the suffix
+        if (suffix && memchr(rest, sys_type == SYSTEM_ARCH ? '-' : '_', suffix - rest) == NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Walks the dependency closure of the planned packages still to install.
+ * Names in the local database end the walk, virtual names resolve to their
+ * provider, and a planned name that is a group stands for its members. The
+ * closure is recorded in post-order, so every package follows the packages it
+ * depends on (cycles aside). */
+void plan_install(SystemType sys_type, Catalog* catalog, InstallPlan* plan) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(plan, 0, sizeof(*plan));
+    
+    // 0 unseen, 1 on the walk, 2 finished
+    uint8_t* visited = calloc(catalog->count + 1, 1);
+    size_t capacity = (size_t)catalog->count * 2 + 16;
+    uint32_t* stack = malloc(sizeof(uint32_t) * capacity);
+    plan->order = malloc(sizeof(uint32_t) * (catalog->count + 1));
+    if (!visited || !stack || !plan->order) {
+        free(visited);
+        free(stack);
+        free(plan->order);
+        plan->order = NULL;
+        return;
+    }
+    
+    catalog_mark_installed(sys_type, catalog);
+    CacheListing cache;
+    load_cache_listing(package_cache_dir(sys_type), &cache);
+    
+    // Entries carry PLAN_LEAVE once their dependencies have been pushed above them
+    size_t depth = 0;
+    int overflow = 0;
+#define PLAN_LEAVE 0x80000000u
+#define PLAN_PUSH(entry) do { \
+        if (depth == capacity) { \
+            uint32_t* grown = realloc(stack, sizeof(uint32_t) * capacity * 2); \
+            if (!grown) { overflow = 1; break; } \
+            stack = grown; \
+            capacity *= 2; \
+        } \
+        stack[depth++] = (entry); \
+    } while (0)
+    for (uint32_t id = catalog->count; id-- > 0;) {
+        if ((catalog->flags[id] & PKG_FLAG_PLANNED) && !is_package_done(catalog, id)) {
+            plan->selected++;
+            PLAN_PUSH(id);
+        }
+    }
+    
+    while (depth > 0 && !overflow) {
+        uint32_t entry = stack[--depth];
+        uint32_t id = entry & ~PLAN_LEAVE;
+        if (entry & PLAN_LEAVE) {
+            visited[id] = 2;
+            plan->order[plan->closure++] = id;
+            continue;
+        }
+        if (visited[id]) {
+            continue;
+        }
+        visited[id] = 1;
+        
+        // An upgrade walks the outdated packages like new ones
+        if ((catalog->flags[id] & PKG_FLAG_INSTALLED) && !(catalog->flags[id] & PKG_FLAG_OUTDATED)) {
+            plan->installed++;
+            continue;
+        }
+        if (!(catalog->flags[id] & PKG_FLAG_QUERIED)) {
+            int expanded = 0;
+            if (catalog->providers[id] != 0) {
+                PLAN_PUSH(catalog->providers[id] - 1);
+                expanded = 1;
+            } else if (catalog->flags[id] & PKG_FLAG_PLANNED) {
+                const char* group = package_name(catalog, id);
+                for (uint32_t p = catalog->count; p-- > 0;) {
+                    if ((catalog->flags[p] & PKG_FLAG_QUERIED) &&
+                        has_group(catalog_string(catalog, catalog->groups[p]), group)) {
+                        PLAN_PUSH(p);
+                        expanded = 1;
+                    }
+                }
+            }
+            plan->unresolved += !expanded;
+            continue;
+        }
+        
+        plan->install_bytes += catalog->size_bytes[id];
+        if (is_package_cached(&cache, sys_type, package_name(catalog, id),
+                              catalog_string(catalog, catalog->versions[id]))) {
+            plan->cached++;
+        } else {
+            plan->download_bytes += catalog->download_bytes[id];
+        }
+        
+        PLAN_PUSH(id | PLAN_LEAVE);
+        if (id < catalog->dep_packages) {
+            for (uint32_t d = catalog->dep_offsets[id + 1]; d-- > catalog->dep_offsets[id];) {
+                if (!visited[catalog->dep_ids[d]]) {
+                    PLAN_PUSH(catalog->dep_ids[d]);
+                }
+            }
+        }
+    }
+#undef PLAN_PUSH
+#undef PLAN_LEAVE
+    if (overflow) {
+        log_message("Install plan walk ran out of memory", "error");
+    }
+    
+    int batch_size = g_config.batch_size > 0 ? g_config.batch_size : DEFAULT_BATCH_SIZE;
+    plan->transactions = (plan->selected + batch_size - 1) / batch_size;
+    plan->mount_count = plan_mount_usage(sys_type, plan->install_bytes, plan->download_bytes,
+                                         plan->mounts);
+    
+    free_cache_listing(&cache);
+    free(visited);
+    free(stack);
+    plan->milliseconds = elapsed_ms(&start);
+}
+
+/* Checks the plan against every mount it touches, keeping DISK_RESERVE_BYTES free */
+int plan_fits(const InstallPlan* plan, char* reason, size_t reason_len) {
+    for (int m = 0; m < plan->mount_count; m++) {
+        const MountUsage* usage = &plan->mounts[m];
+        if (usage->available < usage->required + DISK_RESERVE_BYTES) {
+            snprintf(reason, reason_len,
+                    "Insufficient space on %s: need %.2f GB (+%.2f GB reserve), available %.2f GB",
+                    usage->path, (double)usage->required / (1024*1024*1024),
+                    (double)DISK_RESERVE_BYTES / (1024*1024*1024),
+                    (double)usage->available / (1024*1024*1024));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Logs the plan, and prints it as well when show is set */
+void report_install_plan(const InstallPlan* plan, int show) {
+    char report[8 + MAX_PROBE_MOUNTS][MAX_LINE_LENGTH];
+    int lines = 0;
+    int batch_size = g_config.batch_size > 0 ? g_config.batch_size : DEFAULT_BATCH_SIZE;
+    
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Selected packages: %u", plan->selected);
+    snprintf(report[lines++], MAX_LINE_LENGTH, "To install:        %u packages with dependencies (%u already downloaded)",
+            plan->closure, plan->cached);
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Already installed: %u", plan->installed);
+    if (plan->unresolved > 0) {
+        snprintf(report[lines++], MAX_LINE_LENGTH, "Unresolved names:  %u", plan->unresolved);
+    }
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Download size:     %.2f MB",
+            plan->download_bytes / (1024.0*1024.0));
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Installed size:    %.2f MB",
+            plan->install_bytes / (1024.0*1024.0));
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Transactions:      %d (batches of %d)",
+            plan->transactions, batch_size);
+    for (int m = 0; m < plan->mount_count; m++) {
+        snprintf(report[lines++], MAX_LINE_LENGTH, "Space on %-9.100s %.2f GB needed, %.2f GB free",
+                plan->mounts[m].path, plan->mounts[m].required / (1024.0*1024.0*1024.0),
+                plan->mounts[m].available / (1024.0*1024.0*1024.0));
+    }
+    
+    if (show) {
+        printf("\n%s%s Install Plan%s (resolved in %.1f ms)\n", FG_CYAN, SYMBOL_INFO, RESET,
+               plan->milliseconds);
+    }
+    for (int i = 0; i < lines; i++) {
+        if (show) {
+            printf("  %s%s%s\n", FG_WHITE, report[i], RESET);
+        }
+        log_message(report[i], "info");
+    }
+    fflush(stdout);
+}
+
+/* Plans what a run would select from the current databases without changing
+ * anything: the profiles when given, otherwise every member of a security
+ * group on Arch or the Kali categories on Debian */
+int plan_selection(SystemType sys_type, Catalog* catalog) {
+    if (g_config.profile_count > 0) {
+        uint64_t* selection = profile_selection_bits(catalog);
+        if (!selection) {
+            return 0;
+        }
+        for (uint32_t p = 0; p < catalog->count; p++) {
+            if (selection[p / 64] & (1ULL << (p % 64))) {
+                catalog_plan(catalog, p);
+            }
+        }
+        free(selection);
+        return 1;
+    }
+    
+    if (sys_type == SYSTEM_ARCH) {
+        for (uint32_t p = 0; p < catalog->count; p++) {
+            if (strcasestr(catalog_string(catalog, catalog->groups[p]), "security")) {
+                catalog_plan(catalog, p);
+            }
+        }
+        return 1;
+    }
+    
+    for (int i = 0; KALI_TOOL_CATEGORIES[i] != NULL; i++) {
+        uint32_t* ids;
+        int count = select_category(catalog, KALI_TOOL_CATEGORIES[i], &ids);
+        for (int j = 0; j < count; j++) {
+            catalog_plan(catalog, ids[j]);
+        }
+        free(ids);
+    }
+    return 1;
+}
+
+/* Pinned Plan Functions */
+/* Plan fields end up in shell commands on the applying host, so only the
+ * characters package names, versions, archive names and mirror URLs use pass */
+int is_plan_field_safe(const char* field) {
+    if (!field[0]) {
+        return 0;
+    }
+    for (const char* c = field; *c; c++) {
+        if (!isalnum((unsigned char)*c) && !strchr("@._+-:%~/=?&,", *c)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Archive names become paths under the package cache, so they get the
+ * narrower set: no separators, no quoting characters, no leading dot. The
+ * percent sign stays for the %3a apt writes in place of an epoch colon. */
+int is_plan_filename_safe(const char* filename) {
+    if (!filename[0] || filename[0] == '.') {
+        return 0;
+    }
+    for (const char* c = filename; *c; c++) {
+        if (!isalnum((unsigned char)*c) && !strchr("@._+:-%", *c)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int is_sha256_digest(const char* digest) {
+    return strlen(digest) == 64 && strspn(digest, "0123456789abcdef") == 64;
+}
+
+int is_plan_entry_valid(const PlanEntry* entry) {
+    return is_valid_package_name(entry->name) && is_plan_field_safe(entry->version) &&
+           is_plan_filename_safe(entry->filename) && is_sha256_digest(entry->sha256) &&
+           is_plan_field_safe(entry->url) &&
+           (strncmp(entry->url, "https://", 8) == 0 || strncmp(entry->url, "http://", 7) == 0 ||
+            strncmp(entry->url, "file://", 7) == 0);
+}
+
+/* Takes the archive of a sync record when the record is the package and
+ * version the plan resolved. The first repository to carry it wins. */
+void pin_sync_record(const Catalog* catalog, const int32_t* slots, PlanEntry* entries,
+                     const char* name, const char* version, const char* filename,
+                     const char* sha256, const char* base_url) {
+    uint32_t id = catalog_find(catalog, name);
+    if (id == NO_PACKAGE || slots[id] < 0) {
+        return;
+    }
+    PlanEntry* entry = &entries[slots[id]];
+    if (entry->filename[0] || strcmp(entry->version, version) != 0) {
+        return;
+    }
+    snprintf(entry->filename, sizeof(entry->filename), "%s", filename);
+    snprintf(entry->sha256, sizeof(entry->sha256), "%s", sha256);
+    snprintf(entry->url, sizeof(entry->url), "%s/%s", base_url, filename);
+}
+
+/* Reads the desc entries of a pacman sync database as bsdtar streams them
+ * back to back; each entry opens with its %FILENAME% section */
+void pin_sync_database(const Catalog* catalog, const int32_t* slots, PlanEntry* entries,
+                       const PacmanRepo* repo) {
+    char command[MAX_CMD_LENGTH];
+    snprintf(command, sizeof(command), "bsdtar -xOf '%s/%s.db' '*/desc' 2>/dev/null",
+            PACMAN_SYNC_DIR, repo->name);
+    
+    pid_t pid;
+    struct timespec start;
+    FILE* output = open_command_output(command, &pid, &start);
+    if (!output) {
+        return;
+    }
+    
+    char* line = NULL;
+    size_t line_size = 0;
+    char section[32] = "";
+    char name[MAX_LINE_LENGTH] = "", version[128] = "", filename[MAX_LINE_LENGTH] = "", sha256[65] = "";
+    while (getline(&line, &line_size, output) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '%') {
+            if (strcmp(line, "%FILENAME%") == 0 && name[0]) {
+                pin_sync_record(catalog, slots, entries, name, version, filename, sha256, repo->server);
+                name[0] = version[0] = filename[0] = sha256[0] = '\0';
+            }
+            snprintf(section, sizeof(section), "%s", line);
+        } else if (line[0] == '\0') {
+            section[0] = '\0';
+        } else if (strcmp(section, "%FILENAME%") == 0) {
+            snprintf(filename, sizeof(filename), "%s", line);
+        } else if (strcmp(section, "%NAME%") == 0) {
+            snprintf(name, sizeof(name), "%s", line);
+        } else if (strcmp(section, "%VERSION%") == 0) {
+            snprintf(version, sizeof(version), "%s", line);
+        } else if (strcmp(section, "%SHA256SUM%") == 0) {
+            snprintf(sha256, sizeof(sha256), "%s", line);
+        }
+    }
+    if (name[0]) {
+        pin_sync_record(catalog, slots, entries, name, version, filename, sha256, repo->server);
+    }
+    
+    free(line);
+    close_command_output(output, pid, &start, command);
+}
+
+/* Asks apt for the archive of each NAME=VERSION; --print-uris lines read
+ * 'URL' FILENAME SIZE SHA256:HEX and download nothing */
+void pin_apt_archives(const Catalog* catalog, const int32_t* slots, PlanEntry* entries,
+                      const PlanEntry* chunk, int count) {
+    const char* prefix = "LC_ALL=C apt-get download --print-uris --";
+    size_t length = strlen(prefix) + 16;
+    for (int i = 0; i < count; i++) {
+        length += strlen(chunk[i].name) + strlen(chunk[i].version) + 2;
+    }
+    char* command = malloc(length);
+    if (!command) {
+        return;
+    }
+    char* cursor = command + sprintf(command, "%s", prefix);
+    for (int i = 0; i < count; i++) {
+        cursor += sprintf(cursor, " %s=%s", chunk[i].name, chunk[i].version);
+    }
+    sprintf(cursor, " 2>/dev/null");
+    
+    pid_t pid;
+    struct timespec start;
+    FILE* output = open_command_output(command, &pid, &start);
+    if (output) {
+        char line[MAX_LINE_LENGTH * 8];
+        char url[MAX_LINE_LENGTH * 4], filename[MAX_LINE_LENGTH], hash[96];
+        unsigned long long size;
+        while (fgets(line, sizeof(line), output)) {
+            if (sscanf(line, "'%1023[^']' %255s %llu %95s", url, filename, &size, hash) != 4 ||
+                strncmp(hash, "SHA256:", 7) != 0 || !is_sha256_digest(hash + 7)) {
+                continue;
+            }
+            char name[MAX_LINE_LENGTH];
+            snprintf(name, sizeof(name), "%.*s", (int)strcspn(filename, "_"), filename);
+            uint32_t id = catalog_find(catalog, name);
+            if (id == NO_PACKAGE || slots[id] < 0 || entries[slots[id]].filename[0]) {
+                continue;
+            }
+            PlanEntry* entry = &entries[slots[id]];
+            snprintf(entry->filename, sizeof(entry->filename), "%s", filename);
+            memcpy(entry->sha256, hash + 7, sizeof(entry->sha256));
+            snprintf(entry->url, sizeof(entry->url), "%s", url);
+        }
+        close_command_output(output, pid, &start, command);
+    }
+    free(command);
+}
+
+/* Turns the closure into plan entries, batch by batch in dependency order,
+ * and pins each to its archive. Returns how many could not be pinned, or -1. */
+int pin_plan_entries(SystemType sys_type, const Catalog* catalog, const InstallPlan* plan,
+                     PlanEntry** entries_out) {
+    *entries_out = NULL;
+    PlanEntry* entries = calloc(plan->closure + 1, sizeof(PlanEntry));
+    int32_t* slots = malloc(sizeof(int32_t) * (catalog->count + 1));
+    if (!entries || !slots || !plan->order) {
+        free(entries);
+        free(slots);
+        return -1;
+    }
+    
+    int batch_size = g_config.batch_size > 0 ? g_config.batch_size : DEFAULT_BATCH_SIZE;
+    memset(slots, 0xff, sizeof(int32_t) * (catalog->count + 1));
+    for (uint32_t i = 0; i < plan->closure; i++) {
+        uint32_t id = plan->order[i];
+        PlanEntry* entry = &entries[i];
+        entry->batch = (int)(i / batch_size) + 1;
+        snprintf(entry->name, sizeof(entry->name), "%s", package_name(catalog, id));
+        snprintf(entry->version, sizeof(entry->version), "%s",
+                catalog_string(catalog, catalog->versions[id]));
+        entry->download_bytes = catalog->download_bytes[id];
+        entry->install_bytes = catalog->size_bytes[id];
+        slots[id] = (int32_t)i;
+    }
+    
+    if (sys_type == SYSTEM_ARCH) {
+        PacmanConfig* config = load_pacman_config();
+        for (int r = 0; config && r < config->repo_count; r++) {
+            pin_sync_database(catalog, slots, entries, &config->repos[r]);
+        }
+        free(config);
+    } else {
+        for (uint32_t i = 0; i < plan->closure; i += METADATA_QUERY_CHUNK) {
+            uint32_t count = plan->closure - i;
+            if (count > METADATA_QUERY_CHUNK) count = METADATA_QUERY_CHUNK;
+            pin_apt_archives(catalog, slots, entries, entries + i, (int)count);
+        }
+    }
+    free(slots);
+    
+    int unpinned = 0;
+    for (uint32_t i = 0; i < plan->closure; i++) {
+        if (!is_plan_entry_valid(&entries[i])) {
+            char warn_msg[MAX_LINE_LENGTH];
+            snprintf(warn_msg, sizeof(warn_msg), "No pinnable archive for %.100s %.100s",
+                    entries[i].name, entries[i].version);
+            log_message(warn_msg, "warning");
+            fprintf(stderr, "%s%s%s\n", FG_RED, warn_msg, RESET);
+            unpinned++;
+        }
+    }
+    
+    *entries_out = entries;
+    return unpinned;
+}
+
+/* Plan files are line based: a header of "key value" lines, then one
+ * "package BATCH NAME VERSION FILENAME SHA256 DOWNLOAD INSTALL URL" per
+ * archive in install order. Written aside and renamed into place. */
+int write_plan_file(const char* path, SystemType sys_type, const Catalog* catalog,
+                    const PlanEntry* entries, uint32_t count) {
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.part", path);
+    FILE* fp = fopen(temp_path, "w");
+    if (!fp) {
+        return 0;
+    }
+    
+    fprintf(fp, "%s\n", PLAN_FILE_HEADER);
+    fprintf(fp, "format %d\n", PLAN_FILE_FORMAT);
+    fprintf(fp, "system %s\n", sys_type == SYSTEM_ARCH ? "arch" : "debian");
+    fprintf(fp, "created %lld\n", (long long)time(NULL));
+    fprintf(fp, "catalog %016llx\n", (unsigned long long)catalog->source_stamp);
+    fprintf(fp, "batches %d\n", count > 0 ? entries[count - 1].batch : 0);
+    for (uint32_t i = 0; i < count; i++) {
+        const PlanEntry* entry = &entries[i];
+        fprintf(fp, "package %d %s %s %s %s %llu %llu %s\n", entry->batch, entry->name,
+                entry->version, entry->filename, entry->sha256, entry->download_bytes,
+                entry->install_bytes, entry->url);
+    }
+    
+    if (fclose(fp) != 0 || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return 0;
+    }
+    return 1;
+}
+
+/* Loads a plan written for this kind of system. Every entry is validated
+ * before anything runs; batches must be numbered from 1 without going back. */
+int read_plan_file(const char* path, SystemType sys_type, PlanEntry** entries_out,
+                   uint32_t* count_out, char* reason, size_t reason_len) {
+    *entries_out = NULL;
+    *count_out = 0;
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        snprintf(reason, reason_len, "Cannot open plan %.200s", path);
+        return 0;
+    }
+    
+    PlanEntry* entries = NULL;
+    uint32_t count = 0, capacity = 0;
+    int format = 0, ok = 1, last_batch = 1;
+    char system_name[32] = "";
+    char* line = NULL;
+    size_t line_size = 0;
+    int line_number = 0;
+    while (ok && getline(&line, &line_size, fp) != -1) {
+        line_number++;
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        if (strncmp(line, "package ", 8) != 0) {
+            sscanf(line, "format %d", &format);
+            sscanf(line, "system %31s", system_name);
+            continue;
+        }
+        
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            PlanEntry* grown = realloc(entries, sizeof(PlanEntry) * capacity);
+            if (!grown) {
+                snprintf(reason, reason_len, "Out of memory reading plan");
+                ok = 0;
+                break;
+            }
+            entries = grown;
+        }
+        PlanEntry* entry = &entries[count];
+        memset(entry, 0, sizeof(*entry));
+        ok = sscanf(line, "package %d %255s %127s %255s %64s %llu %llu %1023s", &entry->batch,
+                    entry->name, entry->version, entry->filename, entry->sha256,
+                    &entry->download_bytes, &entry->install_bytes, entry->url) == 8 &&
+             is_plan_entry_valid(entry) && entry->batch >= last_batch &&
+             entry->batch <= last_batch + 1;
+        if (!ok) {
+            snprintf(reason, reason_len, "Invalid plan entry on line %d", line_number);
+            break;
+        }
+        last_batch = entry->batch;
+        count++;
+    }
+    free(line);
+    fclose(fp);
+    
+    const char* expected = sys_type == SYSTEM_ARCH ? "arch" : "debian";
+    if (ok && format != PLAN_FILE_FORMAT) {
+        snprintf(reason, reason_len, "Unsupported plan format %d", format);
+        ok = 0;
+    } else if (ok && strcmp(system_name, expected) != 0) {
+        snprintf(reason, reason_len, "Plan was made for %.20s, this is %s", system_name, expected);
+        ok = 0;
+    }
+    if (!ok) {
+        free(entries);
+        return 0;
+    }
+    
+    *entries_out = entries;
+    *count_out = count;
+    return 1;
+}
+
+/* Makes sure every archive of a batch sits in the package cache with its
+ * pinned checksum, fetching the missing ones in one parallel curl run */
+int fetch_plan_batch(SystemType sys_type, const PlanEntry* batch, int count) {
+    const char* cache_dir = package_cache_dir(sys_type);
+    char path[PATH_MAX];
+    char actual[65];
+    
+    size_t length = MAX_CMD_LENGTH;
+    for (int i = 0; i < count; i++) {
+        length += strlen(cache_dir) + strlen(batch[i].filename) + strlen(batch[i].url) + 24;
+    }
+    char* command = malloc(length);
+    if (!command) {
+        return 0;
+    }
+    char* cursor = command + sprintf(command, "curl -fsL --max-time %d -Z --parallel-max %d",
+                                     PLAN_FETCH_TIMEOUT, current_download_jobs());
+    int missing = 0;
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, batch[i].filename);
+        if (sha256_file(path, actual) && strcmp(actual, batch[i].sha256) == 0) {
+            continue;
+        }
+        cursor += sprintf(cursor, " -o '%s.part' '%s'", path, batch[i].url);
+        missing++;
+    }
+    
+    sprintf(cursor, " 2>/dev/null");
+    g_throttle.stoppable = 1;
+    int fetched = missing == 0 || execute_command(command);
+    g_throttle.stoppable = 0;
+    free(command);
+    
+    for (int i = 0; i < count && missing > 0; i++) {
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, batch[i].filename);
+        char temp_path[PATH_MAX + 8];
+        snprintf(temp_path, sizeof(temp_path), "%s.part", path);
+        if (access(temp_path, F_OK) != 0) {
+            continue;
+        }
+        if (!fetched) {
+            unlink(temp_path);
+        } else if (!sha256_file(temp_path, actual) || strcmp(actual, batch[i].sha256) != 0 ||
+                   rename(temp_path, path) != 0) {
+            char error_msg[MAX_LINE_LENGTH];
+            snprintf(error_msg, sizeof(error_msg), "Checksum mismatch for %.200s", batch[i].filename);
+            log_message(error_msg, "error");
+            unlink(temp_path);
+            fetched = 0;
+        }
+    }
+    return fetched;
+}
+
+/* Installs the archives of a batch as they are, in one transaction */
+int install_plan_batch(SystemType sys_type, const PlanEntry* batch, int count) {
+    const char* prefix = (sys_type == SYSTEM_ARCH)
+        ? "LC_ALL=C pacman -U --noconfirm --needed --overwrite=\"*\""
+        : "DEBIAN_FRONTEND=noninteractive apt-get install -y --allow-downgrades";
+    const char* cache_dir = package_cache_dir(sys_type);
+    
+    size_t length = strlen(prefix) + 64;
+    for (int i = 0; i < count; i++) {
+        length += strlen(cache_dir) + strlen(batch[i].filename) + 6;
+    }
+    char* command = malloc(length);
+    if (!command) {
+        return 0;
+    }
+    char* cursor = command + sprintf(command, "%s", prefix);
+    for (int i = 0; i < count; i++) {
+        cursor += sprintf(cursor, " '%s/%s'", cache_dir, batch[i].filename);
+    }
+    sprintf(cursor, " >/dev/null 2>%s", PACMAN_OUTPUT_FILE);
+    
+    int installed = execute_command(command);
+    free(command);
+    return installed;
+}
+
+/* apply subcommand: executes a pinned plan batch by batch without resolving
+ * anything. Stops at the first batch that cannot be fetched or installed. */
+int run_apply_command(void) {
+    const char* path = g_config.command_args[0];
+    SystemType sys_type = detect_system_type();
+    if (sys_type == SYSTEM_UNKNOWN) {
+        fprintf(stderr, "%sUnsupported system type%s\n", FG_RED, RESET);
+        return 1;
+    }
+    
+    PlanEntry* entries;
+    uint32_t count;
+    char reason[MAX_LINE_LENGTH];
+    if (!read_plan_file(path, sys_type, &entries, &count, reason, sizeof(reason))) {
+        fprintf(stderr, "%s%s%s\n", FG_RED, reason, RESET);
+        return 1;
+    }
+    if (!check_root_privileges()) {
+        fprintf(stderr, "%sApplying a plan requires root privileges%s\n", FG_RED, RESET);
+        free(entries);
+        return 1;
+    }
+    if (!create_lock_file()) {
+        free(entries);
+        return 1;
+    }
+    initialize_logging();
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    atexit(cleanup_resources);
+    size_concurrency();
+    
+    InstallPlan sizing;
+    memset(&sizing, 0, sizeof(sizing));
+    for (uint32_t i = 0; i < count; i++) {
+        sizing.install_bytes += entries[i].install_bytes;
+        sizing.download_bytes += entries[i].download_bytes;
+    }
+    sizing.mount_count = plan_mount_usage(sys_type, sizing.install_bytes, sizing.download_bytes,
+                                          sizing.mounts);
+    if (!plan_fits(&sizing, reason, sizeof(reason))) {
+        log_message(reason, "error");
+        printf("%s%s %s%s\n", FG_RED, SYMBOL_ERROR, reason, RESET);
+        free(entries);
+        return 1;
+    }
+    
+    int batches = count > 0 ? entries[count - 1].batch : 0;
+    char message[MAX_LINE_LENGTH];
+    snprintf(message, sizeof(message), "Applying plan %.150s: %u packages in %d batches",
+            path, count, batches);
+    log_message(message, "info");
+    printf("%s%s %s%s\n", FG_CYAN, SYMBOL_INFO, message, RESET);
+    
+    int failed = 0;
+    uint32_t first = 0;
+    while (first < count && keep_running && !failed) {
+        uint32_t end = first;
+        while (end < count && entries[end].batch == entries[first].batch) end++;
+        int size = (int)(end - first);
+        
+        printf("  %sBatch %d/%d: %d packages%s ", FG_WHITE, entries[first].batch, batches, size, RESET);
+        fflush(stdout);
+        if (!fetch_plan_batch(sys_type, entries + first, size)) {
+            printf("%sdownload failed%s\n", FG_RED, RESET);
+            failed = 1;
+        } else if (!install_plan_batch(sys_type, entries + first, size)) {
+            printf("%sinstall failed%s\n", FG_RED, RESET);
+            failed = 1;
+        } else {
+            printf("%sdone%s\n", FG_GREEN, RESET);
+        }
+        
+        snprintf(message, sizeof(message), "Plan batch %d/%d %s", entries[first].batch, batches,
+                failed ? "failed" : "installed");
+        log_message(message, failed ? "error" : "info");
+        first = end;
+    }
+    
+    free(entries);
+    if (failed || !keep_running) {
+        printf("%s%s Plan not fully applied, see %s%s\n", FG_RED, SYMBOL_ERROR, LOG_FILE, RESET);
+        return 1;
+    }
+    printf("%s%s Plan applied%s\n", FG_GREEN, SYMBOL_SUCCESS, RESET);
+    return 0;
+}
+
+/* plan subcommand and --dry-run: resolves and sizes the install without root
+ * and without touching the system. Exits non-zero when it would not fit.
+ * With --output the closure is also pinned to exact archives for apply. */
+int run_plan_command(void) {
+    SystemType sys_type = detect_system_type();
+    if (sys_type == SYSTEM_UNKNOWN) {
+        fprintf(stderr, "%sUnsupported system type%s\n", FG_RED, RESET);
+        return 1;
+    }
+    size_concurrency();
+    
+    Catalog* catalog = catalog_open(sys_type);
+    if (!catalog || catalog->count == 0 || !plan_selection(sys_type, catalog)) {
+        fprintf(stderr, "%sPackage catalog unavailable%s\n", FG_RED, RESET);
+        catalog_destroy(catalog);
+        return 1;
+    }
+    if (g_config.new_only && !select_new_packages(catalog, 1)) {
+        fprintf(stderr, "%sNo catalog baseline yet: --new-only needs one complete run first%s\n",
+                FG_RED, RESET);
+        catalog_destroy(catalog);
+        return 1;
+    }
+    
+    InstallPlan plan;
+    plan_install(sys_type, catalog, &plan);
+    report_install_plan(&plan, 1);
+    
+    int pinned = 1;
+    if (g_config.plan_output) {
+        PlanEntry* entries;
+        int unpinned = pin_plan_entries(sys_type, catalog, &plan, &entries);
+        if (unpinned != 0) {
+            fprintf(stderr, "%sPlan not written: %s%s\n", FG_RED,
+                    unpinned < 0 ? "out of memory" : "some packages could not be pinned", RESET);
+            pinned = 0;
+        } else if (!write_plan_file(g_config.plan_output, sys_type, catalog, entries, plan.closure)) {
+            fprintf(stderr, "%sFailed to write plan %s%s\n", FG_RED, g_config.plan_output, RESET);
+            pinned = 0;
+        } else {
+            printf("%s%s Pinned %u packages in %d batches to %s%s\n", FG_GREEN, SYMBOL_SUCCESS,
+                   plan.closure, plan.closure > 0 ? entries[plan.closure - 1].batch : 0,
+                   g_config.plan_output, RESET);
+        }
+        free(entries);
+    }
+    free(plan.order);
+    catalog_destroy(catalog);
+    if (!pinned) {
+        return 1;
+    }
+    
+    char reason[MAX_LINE_LENGTH];
+    if (!plan_fits(&plan, reason, sizeof(reason))) {
+        printf("%s%s %s%s\n", FG_RED, SYMBOL_ERROR, reason, RESET);
+        return 1;
+    }
+    return 0;
+}
+
+/* Version Comparison Functions */
+/* pacman's rpmvercmp over one epoch, version or release string: alternating
+ * runs of digits and letters, where separator run lengths matter, numbers
+ * beat letters and a trailing letter run is older than nothing */
+int rpm_segment_compare(const char* a, const char* b) {
+    const char* one = a;
+    const char* two = b;
+    const char* end1 = a;
+    const char* end2 = b;
+    
+    while (*one && *two) {
+        while (*one && !isalnum((unsigned char)*one)) one++;
+        while (*two && !isalnum((unsigned char)*two)) two++;
+        if (!*one || !*two) {
+            break;
+        }
+        if (one - end1 != two - end2) {
+            return (one - end1) < (two - end2) ? -1 : 1;
+        }
+        
+        int numeric = isdigit((unsigned char)*one);
+        end1 = one;
+        end2 = two;
+        if (numeric) {
+            while (isdigit((unsigned char)*end1)) end1++;
+            while (isdigit((unsigned char)*end2)) end2++;
+        } else {
+            while (isalpha((unsigned char)*end1)) end1++;
+            while (isalpha((unsigned char)*end2)) end2++;
+        }
+        if (two == end2) {
+            return numeric ? 1 : -1;
+        }
+        
+        if (numeric) {
+            while (*one == '0' && one < end1) one++;
+            while (*two == '0' && two < end2) two++;
+            if (end1 - one != end2 - two) {
+                return (end1 - one) > (end2 - two) ? 1 : -1;
+            }
+        }
+        size_t length1 = end1 - one, length2 = end2 - two;
+        int order = memcmp(one, two, length1 < length2 ? length1 : length2);
+        if (order == 0 && length1 != length2) {
+            order = length1 < length2 ? -1 : 1;
+        }
+        if (order != 0) {
+            return order < 0 ? -1 : 1;
+        }
+        one = end1;
+        two = end2;
+    }
+    
+    if (!*one && !*two) {
+        return 0;
+    }
+    return ((!*one && !isalpha((unsigned char)*two)) || isalpha((unsigned char)*one)) ? -1 : 1;
+}
+
+/* Splits [epoch:]version[-release] in place; a missing epoch reads as "0" */
+void split_evr(char* evr, const char** epoch, const char** version, const char** release) {
+    char* s = evr;
+    while (isdigit((unsigned char)*s)) s++;
+    char* dash = strrchr(s, '-');
+    
+    if (*s == ':') {
+        *s++ = '\0';
+        *epoch = *evr ? evr : "0";
+        *version = s;
+    } else {
+        *epoch = "0";
+        *version = evr;
+    }
+    if (dash) {
+        *dash = '\0';
+        *release = dash + 1;
+    } else {
+        *release = NULL;
+    }
+}
+
+/* alpm_pkg_vercmp: epoch, then version, then release when both have one */
+int alpm_version_compare(const char* a, const char* b) {
+    if (strcmp(a, b) == 0) {
+        return 0;
+    }
+    char left[MAX_LINE_LENGTH], right[MAX_LINE_LENGTH];
+    snprintf(left, sizeof(left), "%s", a);
+    snprintf(right, sizeof(right), "%s", b);
+    
+    const char *epoch1, *version1, *release1, *epoch2, *version2, *release2;
+    split_evr(left, &epoch1, &version1, &release1);
+    split_evr(right, &epoch2, &version2, &release2);
+    
+    int order = rpm_segment_compare(epoch1, epoch2);
+    if (order == 0) {
+        order = rpm_segment_compare(version1, version2);
+        if (order == 0 && release1 && release2) {
+            order = rpm_segment_compare(release1, release2);
+        }
+    }
+    return order;
+}
+
+/* dpkg's character weight: '~' sorts before everything, even the end of the
+ * string, letters before other symbols */
+int debian_char_order(int c) {
+    if (isdigit(c)) return 0;
+    if (isalpha(c)) return c;
+    if (c == '~') return -1;
+    if (c) return c + 256;
+    return 0;
+}
+
+/* dpkg's verrevcmp over the given lengths of an upstream version or revision */
+int debian_segment_compare(const char* a, const char* a_end, const char* b, const char* b_end) {
+    while (a < a_end || b < b_end) {
+        int first_diff = 0;
+        while ((a < a_end && !isdigit((unsigned char)*a)) || (b < b_end && !isdigit((unsigned char)*b))) {
+            int ac = a < a_end ? debian_char_order((unsigned char)*a) : 0;
+            int bc = b < b_end ? debian_char_order((unsigned char)*b) : 0;
+            if (ac != bc) {
+                return ac < bc ? -1 : 1;
+            }
+            a++;
+            b++;
+        }
+        while (a < a_end && *a == '0') a++;
+        while (b < b_end && *b == '0') b++;
+        while (a < a_end && b < b_end && isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+            if (!first_diff) first_diff = *a - *b;
+            a++;
+            b++;
+        }
+        if (a < a_end && isdigit((unsigned char)*a)) return 1;
+        if (b < b_end && isdigit((unsigned char)*b)) return -1;
+        if (first_diff) return first_diff < 0 ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Debian policy ordering of [epoch:]upstream[-revision] */
+int debian_version_compare(const char* a, const char* b) {
+    if (strcmp(a, b) == 0) {
+        return 0;
+    }
+    const char* colon1 = strchr(a, ':');
+    const char* colon2 = strchr(b, ':');
+    unsigned long epoch1 = colon1 ? strtoul(a, NULL, 10) : 0;
+    unsigned long epoch2 = colon2 ? strtoul(b, NULL, 10) : 0;
+    if (epoch1 != epoch2) {
+        return epoch1 < epoch2 ? -1 : 1;
+    }
+    
+    const char* upstream1 = colon1 ? colon1 + 1 : a;
+    const char* upstream2 = colon2 ? colon2 + 1 : b;
+    const char* dash1 = strrchr(upstream1, '-');
+    const char* dash2 = strrchr(upstream2, '-');
+    const char* end1 = dash1 ? dash1 : upstream1 + strlen(upstream1);
+    const char* end2 = dash2 ? dash2 : upstream2 + strlen(upstream2);
+    
+    int order = debian_segment_compare(upstream1, end1, upstream2, end2);
+    if (order != 0) {
+        return order;
+    }
+    const char* revision1 = dash1 ? dash1 + 1 : "";
+    const char* revision2 = dash2 ? dash2 + 1 : "";
+    return debian_segment_compare(revision1, revision1 + strlen(revision1),
+                                  revision2, revision2 + strlen(revision2));
+}
+
+int version_compare(SystemType sys_type, const char* a, const char* b) {
+    return (sys_type == SYSTEM_ARCH) ? alpm_version_compare(a, b) : debian_version_compare(a, b);
+}
+
+/* Compares the sync version of each package with its installed one in one
+ * pass over the columns: 1 when the sync candidate is newer, 0 when equal, -1
+ * when older. Versions are interned, so the common case of an unchanged
+ * package is a single integer comparison and only differing strings are
+ * parsed. Returns how many were parsed. */
+uint32_t compare_installed_versions(SystemType sys_type, const Catalog* catalog,
+                                    const uint32_t* ids, uint32_t count, int8_t* results) {
+    uint32_t parsed = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        StringId candidate = catalog->versions[ids[i]];
+        StringId local = catalog->local_versions[ids[i]];
+        if (candidate == local) {
+            results[i] = 0;
+            continue;
+        }
+        parsed++;
+        results[i] = (int8_t)version_compare(sys_type, catalog_string(catalog, candidate),
+                                             catalog_string(catalog, local));
+    }
+    return parsed;
+}
+
+/* upgrade: narrows the plan to the selected packages that are installed and
+ * have a newer version in the sync databases, flagged as outdated so the
+ * planner sizes them */
+int select_upgrades(SystemType sys_type, Catalog* catalog) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    expand_planned_groups(catalog);
+    if (!catalog_mark_installed(sys_type, catalog)) {
+        log_message("Local package database unavailable", "error");
+        return 0;
+    }
+    
+    // Zeroed so every slot the comparison reads is defined, whatever the count
+    uint32_t planned = catalog->planned;
+    uint32_t* ids = calloc(planned + 1, sizeof(uint32_t));
+    int8_t* results = calloc(planned + 1, sizeof(int8_t));
+    if (!ids || !results) {
+        log_message("Out of memory selecting upgrades", "error");
+        free(ids);
+        free(results);
+        return 0;
+    }
+    
+    uint32_t count = 0;
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (!(catalog->flags[id] & PKG_FLAG_PLANNED)) {
+            continue;
+        }
+        if ((catalog->flags[id] & PKG_FLAG_QUERIED) && catalog->local_versions[id] != 0 &&
+            count < planned) {
+            ids[count++] = id;
+        } else {
+            catalog_unplan(catalog, id);
+        }
+    }
+    
+    uint32_t parsed = compare_installed_versions(sys_type, catalog, ids, count, results);
+    uint32_t outdated = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (results[i] <= 0) {
+            catalog_unplan(catalog, ids[i]);
+            continue;
+        }
+        catalog->flags[ids[i]] |= PKG_FLAG_OUTDATED;
+        outdated++;
+        char upgrade_msg[MAX_LINE_LENGTH];
+        snprintf(upgrade_msg, sizeof(upgrade_msg), "Upgrade: %.100s %.60s -> %.60s",
+                package_name(catalog, ids[i]),
+                catalog_string(catalog, catalog->local_versions[ids[i]]),
+                catalog_string(catalog, catalog->versions[ids[i]]));
+        log_message(upgrade_msg, "info");
+    }
+    
+    char summary[MAX_LINE_LENGTH];
+    snprintf(summary, sizeof(summary),
+            "%u of %u installed tools have newer versions (%u versions parsed, %.2f ms)",
+            outdated, count, parsed, elapsed_ms(&start));
+    log_message(summary, "info");
+    
+    free(ids);
+    free(results);
+    return 1;
+}
+
+/* Orderings the reference tools are checked against besides the catalog's own */
+static const char* const VERSION_EDGE_CASES[][2] = {
+    {"1.5.0", "1.5"}, {"1.5.0-1", "1.5.0-2"}, {"1.5-1", "1.5"}, {"1.5b", "1.5"},
+    {"1.0a", "1.0alpha"}, {"1.0rc", "1.0"}, {"1.5.a", "1.5"}, {"1.5.1", "1.5.b"},
+    {"2.0", "2_0"}, {"2.0a", "2.0.a"}, {"2___a", "2_a"}, {"1:1.0", "0:1.1"},
+    {"0:1.0", "1.0"}, {"1.0~rc1", "1.0"}, {"1.0~~", "1.0~"}, {"1.0", "1.0-0"},
+    {"1.0+b1", "1.0"}, {"2.30-1", "2.3-1"}, {"0001", "1"}, {"1.0-1~bpo1", "1.0-1"},
+    {"10", "9"}, {"1.0.0.0.1", "1.0.0.1"}, {NULL, NULL}
+};
+
+int is_version_text(const char* version) {
+    return *version && strspn(version, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                        "0123456789.+~:_-") == strlen(version);
+}
+
+/* Differential check: compares every pair with the native code and with the
+ * system's own tool (vercmp or dpkg --compare-versions), run from one script */
+int check_version_pairs(SystemType sys_type, const char** pairs, int count) {
+    char script_path[] = "/tmp/blackutility-vercmp.XXXXXX";
+    int fd = mkstemp(script_path);
+    FILE* script = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!script) {
+        if (fd >= 0) close(fd);
+        fprintf(stderr, "%sCannot write comparison script%s\n", FG_RED, RESET);
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        const char* a = pairs[i * 2];
+        const char* b = pairs[i * 2 + 1];
+        if (sys_type == SYSTEM_ARCH) {
+            fprintf(script, "vercmp '%s' '%s'\n", a, b);
+        } else {
+            fprintf(script, "if dpkg --compare-versions '%s' lt '%s'; then echo -1; "
+                    "elif dpkg --compare-versions '%s' eq '%s'; then echo 0; else echo 1; fi\n",
+                    a, b, a, b);
+        }
+    }
+    fclose(script);
+    
+    char command[MAX_CMD_LENGTH];
+    snprintf(command, sizeof(command), "sh %s 2>/dev/null", script_path);
+    pid_t pid;
+    struct timespec start;
+    FILE* output = open_command_output(command, &pid, &start);
+    int answered = 0, mismatches = 0;
+    if (output) {
+        char line[64];
+        while (answered < count && fgets(line, sizeof(line), output)) {
+            int expected = atoi(line);
+            expected = (expected > 0) - (expected < 0);
+            const char* a = pairs[answered * 2];
+            const char* b = pairs[answered * 2 + 1];
+            int actual = version_compare(sys_type, a, b);
+            if (actual != expected) {
+                printf("%s%s %s vs %s: native %d, reference %d%s\n", FG_RED, SYMBOL_ERROR,
+                       a, b, actual, expected, RESET);
+                mismatches++;
+            }
+            answered++;
+        }
+        close_command_output(output, pid, &start, command);
+    }
+    unlink(script_path);
+    
+    const char* reference = (sys_type == SYSTEM_ARCH) ? "vercmp" : "dpkg --compare-versions";
+    if (answered < count) {
+        fprintf(stderr, "%sReference %s answered %d of %d comparisons%s\n",
+                FG_RED, reference, answered, count, RESET);
+        return 1;
+    }
+    printf("%s%d pairs checked against %s, %d mismatches%s\n",
+           mismatches ? FG_RED : FG_GREEN, count, reference, mismatches, RESET);
+    return mismatches ? 1 : 0;
+}
+
+/* Times the bulk comparison over the given pairs of catalog ids */
+void benchmark_version_compare(SystemType sys_type, const Catalog* catalog, const uint32_t* ids,
+                               uint32_t count, int runs) {
+    double* samples = malloc(sizeof(double) * runs);
+    int8_t* results = malloc(count + 1);
+    if (!samples || !results) {
+        free(samples);
+        free(results);
+        return;
+    }
+    
+    uint32_t parsed = 0;
+    for (int r = 0; r < runs; r++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        parsed = compare_installed_versions(sys_type, catalog, ids, count, results);
+        samples[r] = elapsed_ms(&start);
+    }
+    qsort(samples, runs, sizeof(double), compare_doubles);
+    
+    printf("%sPackages:%s %u compared, %u with differing versions, over %d runs\n",
+           BOLD, RESET, count, parsed, runs);
+    printf("%sLatency:%s min %.3f ms, median %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           BOLD, RESET, samples[0], samples[runs / 2], samples[(runs - 1) * 99 / 100],
+           samples[runs - 1]);
+    if (parsed > 0) {
+        printf("%sPer parsed pair:%s %.1f ns\n", BOLD, RESET, samples[runs / 2] * 1e6 / parsed);
+    }
+    free(samples);
+    free(results);
+}
+
+/* vercmp subcommand. With two versions it prints -1, 0 or 1 as pacman's
+ * vercmp does. Without, it checks the native ordering against the system's
+ * tool over the edge cases and the catalog's installed/sync pairs, or with
+ * --benchmark times the bulk comparison over the catalog. */
+int run_vercmp_command(void) {
+    SystemType sys_type = detect_system_type();
+    if (sys_type == SYSTEM_UNKNOWN) {
+        fprintf(stderr, "%sUnsupported system type%s\n", FG_RED, RESET);
+        return 1;
+    }
+    if (g_config.command_arg_count == 2) {
+        printf("%d\n", version_compare(sys_type, g_config.command_args[0], g_config.command_args[1]));
+        return 0;
+    }
+    
+    // The edge cases need no catalog; the installed/sync pairs do
+    Catalog* catalog = catalog_open(sys_type);
+    if (catalog && (catalog->count == 0 || !catalog_mark_installed(sys_type, catalog))) {
+        catalog_destroy(catalog);
+        catalog = NULL;
+    }
+    if (!catalog && g_config.benchmark_runs > 0) {
+        fprintf(stderr, "%sPackage catalog or local database unavailable%s\n", FG_RED, RESET);
+        return 1;
+    }
+    
+    uint32_t* ids = malloc(sizeof(uint32_t) * ((catalog ? catalog->count : 0) + 1));
+    const char** pairs = malloc(sizeof(char*) * 2 * VERSION_CHECK_PAIRS);
+    if (!ids || !pairs) {
+        free(ids);
+        free(pairs);
+        catalog_destroy(catalog);
+        return 1;
+    }
+    uint32_t installed = 0;
+    for (uint32_t id = 0; catalog && id < catalog->count; id++) {
+        if ((catalog->flags[id] & PKG_FLAG_QUERIED) && catalog->local_versions[id] != 0) {
+            ids[installed++] = id;
+        }
+    }
+    
+    int result = 0;
+    if (g_config.benchmark_runs > 0) {
+        benchmark_version_compare(sys_type, catalog, ids, installed, g_config.benchmark_runs);
+    } else {
+        int count = 0;
+        for (int i = 0; VERSION_EDGE_CASES[i][0] != NULL; i++) {
+            pairs[count * 2] = VERSION_EDGE_CASES[i][0];
+            pairs[count * 2 + 1] = VERSION_EDGE_CASES[i][1];
+            count++;
+        }
+        // Installed packages against their sync versions, then neighbouring
+        // sync versions to widen the sample where little is installed
+        for (uint32_t i = 0; i < installed && count < VERSION_CHECK_PAIRS; i++) {
+            const char* candidate = catalog_string(catalog, catalog->versions[ids[i]]);
+            const char* local = catalog_string(catalog, catalog->local_versions[ids[i]]);
+            if (is_version_text(candidate) && is_version_text(local)) {
+                pairs[count * 2] = candidate;
+                pairs[count * 2 + 1] = local;
+                count++;
+            }
+        }
+        for (uint32_t id = 1; catalog && id < catalog->count && count < VERSION_CHECK_PAIRS; id++) {
+            const char* a = catalog_string(catalog, catalog->versions[id - 1]);
+            const char* b = catalog_string(catalog, catalog->versions[id]);
+            if (is_version_text(a) && is_version_text(b)) {
+                pairs[count * 2] = a;
+                pairs[count * 2 + 1] = b;
+                count++;
+            }
+        }
+        result = check_version_pairs(sys_type, pairs, count);
+    }
+    
+    free(ids);
+    free(pairs);
+    catalog_destroy(catalog);
+    return result;
+}
+
+/* Removal Functions */
+/* apt lists automatically installed packages in extended_states; every other
+ * installed package was asked for */
+void mark_apt_manual_packages(Catalog* catalog) {
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if ((catalog->flags[id] & PKG_FLAG_QUERIED) && (catalog->flags[id] & PKG_FLAG_INSTALLED)) {
+            catalog->flags[id] |= PKG_FLAG_EXPLICIT;
+        }
+    }
+    
+    FILE* fp = fopen(APT_EXTENDED_STATES, "r");
+    if (!fp) {
+        return;
+    }
+    char* line = NULL;
+    size_t line_size = 0;
+    uint32_t current = NO_PACKAGE;
+    while (getline(&line, &line_size, fp) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "Package: ", 9) == 0) {
+            current = catalog_find(catalog, line + 9);
+        } else if (strcmp(line, "Auto-Installed: 1") == 0 && current != NO_PACKAGE) {
+            catalog->flags[current] &= ~PKG_FLAG_EXPLICIT;
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+/* Reads the local package database into a catalog of its own: pacman -Qi on
+ * Arch, the dpkg status file on Debian. Every alternative of a dependency is
+ * an edge, since any of them may be the one in use. */
+Catalog* catalog_load_local(SystemType sys_type) {
+    Catalog* catalog = catalog_create();
+    if (!catalog) {
+        return NULL;
+    }
+    catalog->all_alternatives = 1;
+    catalog->recommends = 1;
+    
+    int listed = 0;
+    if (sys_type == SYSTEM_ARCH) {
+        const char* command = "LC_ALL=C pacman -Qi 2>/dev/null";
+        pid_t pid;
+        struct timespec start;
+        FILE* output = open_command_output(command, &pid, &start);
+        if (output) {
+            read_package_records(output, catalog, 1);
+            listed = close_command_output(output, pid, &start, command);
+        }
+    } else {
+        FILE* fp = fopen(DPKG_STATUS_FILE, "r");
+        if (fp) {
+            read_package_records(fp, catalog, 1);
+            fclose(fp);
+            listed = 1;
+        }
+    }
+    
+    if (!listed || !catalog_build_dependencies(catalog) || !catalog_mark_installed(sys_type, catalog)) {
+        catalog_destroy(catalog);
+        return NULL;
+    }
+    if (sys_type != SYSTEM_ARCH) {
+        mark_apt_manual_packages(catalog);
+    }
+    return catalog;
+}
+
+/* The installed package a dependency lands on: the package itself or the
+ * installed provider of a virtual name */
+uint32_t installed_target(const Catalog* catalog, uint32_t id) {
+    if (catalog->flags[id] & PKG_FLAG_QUERIED) {
+        return (catalog->flags[id] & PKG_FLAG_INSTALLED) ? id : NO_PACKAGE;
+    }
+    if (catalog->providers[id] != 0 && (catalog->flags[catalog->providers[id] - 1] & PKG_FLAG_INSTALLED)) {
+        return catalog->providers[id] - 1;
+    }
+    return NO_PACKAGE;
+}
+
+/* Sets mark on everything installed the stacked packages depend on, directly
+ * or not. The stack holds each package at most once, so it needs room for the
+ * whole catalog. When given, parents records which package pulled each in. */
+void mark_dependencies(const Catalog* catalog, uint8_t* marks, uint8_t mark,
+                       uint32_t* stack, uint32_t depth, uint32_t* parents) {
+    while (depth > 0) {
+        uint32_t id = stack[--depth];
+        if (id >= catalog->dep_packages) {
+            continue;
+        }
+        for (uint32_t d = catalog->dep_offsets[id]; d < catalog->dep_offsets[id + 1]; d++) {
+            uint32_t dep = installed_target(catalog, catalog->dep_ids[d]);
+            if (dep != NO_PACKAGE && !(marks[dep] & mark)) {
+                marks[dep] |= mark;
+                if (parents) {
+                    parents[dep] = id;
+                }
+                stack[depth++] = dep;
+            }
+        }
+    }
+}
+
+/* Works out what removing the planned tools takes with it. Whatever the tools
+ * depend on goes too, unless a package that stays still reaches it. Packages
+ * that stay are every installed one the tools do not reach, plus every
+ * explicitly installed or essential one. Walking from those, rather than
+ * counting dependents, also frees dependency cycles among the orphans. A
+ * selected tool that something staying needs is kept and reported. The
+ * removal order puts dependents before their dependencies, split into as few
+ * transactions as REMOVE_COMMAND_LIMIT allows. */
+int plan_removal(Catalog* catalog, RemovalPlan* plan, int show) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(plan, 0, sizeof(*plan));
+    
+    uint8_t* marks = calloc(catalog->count + 1, 1);
+    uint32_t* stack = malloc(sizeof(uint32_t) * (catalog->count + 1));
+    uint32_t* parents = malloc(sizeof(uint32_t) * (catalog->count + 1));
+    uint32_t* dependents = calloc(catalog->count + 1, sizeof(uint32_t));
+    plan->order = malloc(sizeof(uint32_t) * (catalog->count + 1));
+    if (!marks || !stack || !parents || !dependents || !plan->order) {
+        free(marks);
+        free(stack);
+        free(parents);
+        free(dependents);
+        free(plan->order);
+        plan->order = NULL;
+        return 0;
+    }
+    
+#define REMOVE_REACHED 0x01
+#define REMOVE_KEPT 0x02
+#define REMOVE_GOES(id) ((marks[id] & (REMOVE_REACHED | REMOVE_KEPT)) == REMOVE_REACHED)
+    uint32_t depth = 0;
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (!(catalog->flags[id] & PKG_FLAG_PLANNED)) {
+            continue;
+        }
+        if (installed_target(catalog, id) != id) {
+            plan->missing++;
+            char missing_msg[MAX_LINE_LENGTH];
+            snprintf(missing_msg, sizeof(missing_msg), "Not installed: %.200s", package_name(catalog, id));
+            log_message(missing_msg, "warning");
+            if (show) {
+                printf("%s%s %s%s\n", FG_YELLOW, SYMBOL_WARNING, missing_msg, RESET);
+            }
+            continue;
+        }
+        marks[id] = REMOVE_REACHED;
+        stack[depth++] = id;
+    }
+    mark_dependencies(catalog, marks, REMOVE_REACHED, stack, depth, NULL);
+    
+    depth = 0;
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        uint8_t flags = catalog->flags[id];
+        if (installed_target(catalog, id) != id) {
+            continue;
+        }
+        if ((flags & PKG_FLAG_ESSENTIAL) ||
+            (!(flags & PKG_FLAG_PLANNED) && ((flags & PKG_FLAG_EXPLICIT) || !(marks[id] & REMOVE_REACHED)))) {
+            marks[id] |= REMOVE_KEPT;
+            parents[id] = id;
+            stack[depth++] = id;
+        }
+    }
+    mark_dependencies(catalog, marks, REMOVE_KEPT, stack, depth, parents);
+    
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (!(catalog->flags[id] & PKG_FLAG_PLANNED) || !(marks[id] & REMOVE_KEPT) ||
+            installed_target(catalog, id) != id) {
+            continue;
+        }
+        plan->kept++;
+        char kept_msg[MAX_LINE_LENGTH];
+        if (parents[id] == id) {
+            snprintf(kept_msg, sizeof(kept_msg), "Keeping %.200s: essential to the system",
+                    package_name(catalog, id));
+        } else {
+            snprintf(kept_msg, sizeof(kept_msg), "Keeping %.100s: required by %.100s",
+                    package_name(catalog, id), package_name(catalog, parents[id]));
+        }
+        log_message(kept_msg, "warning");
+        if (show) {
+            printf("%s%s %s%s\n", FG_YELLOW, SYMBOL_WARNING, kept_msg, RESET);
+        }
+    }
+    
+    // Dependents first: a package is ready once everything it is removed with
+    // that depends on it has been ordered. Cycles are left for the end.
+    for (uint32_t id = 0; id < catalog->count && id < catalog->dep_packages; id++) {
+        if (!REMOVE_GOES(id)) {
+            continue;
+        }
+        for (uint32_t d = catalog->dep_offsets[id]; d < catalog->dep_offsets[id + 1]; d++) {
+            uint32_t dep = installed_target(catalog, catalog->dep_ids[d]);
+            if (dep != NO_PACKAGE && dep != id && REMOVE_GOES(dep)) {
+                dependents[dep]++;
+            }
+        }
+    }
+    uint32_t head = 0;
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (REMOVE_GOES(id) && dependents[id] == 0) {
+            plan->order[plan->count++] = id;
+        }
+    }
+    while (head < plan->count) {
+        uint32_t id = plan->order[head++];
+        for (uint32_t d = id < catalog->dep_packages ? catalog->dep_offsets[id] : 0;
+             id < catalog->dep_packages && d < catalog->dep_offsets[id + 1]; d++) {
+            uint32_t dep = installed_target(catalog, catalog->dep_ids[d]);
+            if (dep != NO_PACKAGE && dep != id && REMOVE_GOES(dep) && --dependents[dep] == 0) {
+                plan->order[plan->count++] = dep;
+            }
+        }
+    }
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (REMOVE_GOES(id) && dependents[id] != 0) {
+            plan->order[plan->count++] = id;
+        }
+    }
+#undef REMOVE_GOES
+#undef REMOVE_KEPT
+#undef REMOVE_REACHED
+    
+    size_t line_length = 0;
+    for (uint32_t i = 0; i < plan->count; i++) {
+        uint32_t id = plan->order[i];
+        size_t length = strlen(package_name(catalog, id)) + 1;
+        if (plan->transactions == 0 || line_length + length > REMOVE_COMMAND_LIMIT) {
+            plan->transactions++;
+            line_length = 0;
+        }
+        line_length += length;
+        plan->bytes += catalog->size_bytes[id];
+        if (catalog->flags[id] & PKG_FLAG_PLANNED) {
+            plan->targets++;
+        } else {
+            plan->orphans++;
+        }
+    }
+    
+    free(marks);
+    free(stack);
+    free(parents);
+    free(dependents);
+    plan->milliseconds = elapsed_ms(&start);
+    return 1;
+}
+
+void report_removal_plan(const RemovalPlan* plan, int show) {
+    char report[6][MAX_LINE_LENGTH];
+    int lines = 0;
+    
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Selected tools:    %u (%u kept, %u not installed)",
+            plan->targets + plan->kept, plan->kept, plan->missing);
+    snprintf(report[lines++], MAX_LINE_LENGTH, "To remove:         %u packages (%u orphaned dependencies)",
+            plan->count, plan->orphans);
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Installed size:    %.2f MB",
+            plan->bytes / (1024.0*1024.0));
+    snprintf(report[lines++], MAX_LINE_LENGTH, "Transactions:      %d", plan->transactions);
+    
+    if (show) {
+        printf("\n%s%s Removal Plan%s (resolved in %.1f ms)\n", FG_CYAN, SYMBOL_INFO, RESET,
+               plan->milliseconds);
+    }
+    for (int i = 0; i < lines; i++) {
+        if (show) {
+            printf("  %s%s%s\n", FG_WHITE, report[i], RESET);
+        }
+        log_message(report[i], "info");
+    }
+    fflush(stdout);
+}
+
+/* Free space on the filesystems removed packages live on, each counted once */
+unsigned long long system_free_bytes(void) {
+    const char* paths[] = { "/", "/usr", "/opt", "/var" };
+    dev_t devices[4];
+    int seen = 0;
+    unsigned long long total = 0;
+    for (int i = 0; i < 4; i++) {
+        struct stat st;
+        struct statvfs fs_stats;
+        if (stat(paths[i], &st) != 0 || statvfs(paths[i], &fs_stats) != 0) {
+            continue;
+        }
+        int m = 0;
+        while (m < seen && devices[m] != st.st_dev) m++;
+        if (m == seen) {
+            devices[seen++] = st.st_dev;
+            total += (unsigned long long)fs_stats.f_frsize * fs_stats.f_bavail;
+        }
+    }
+    return total;
+}
+
+/* apt removes the dependents of what it is told to remove instead of
+ * refusing, so on Debian the transaction is simulated first and refused when
+ * apt would remove anything else. A simulation reports each package as
+ * "Remv name [version]", or "Purg name [version]" under --purge. One that
+ * reports none of ids is taken as output this check cannot read, and refused
+ * too. Returns 1 when it only removes ids. */
+int check_apt_removal(const Catalog* catalog, const uint32_t* ids, int count) {
+    char* command = build_package_command("LC_ALL=C apt-get -s remove --purge", catalog, ids, count,
+                                          " 2>/dev/null");
+    if (!command) {
+        return 0;
+    }
+    pid_t pid;
+    struct timespec start;
+    FILE* output = open_command_output(command, &pid, &start);
+    if (!output) {
+        free(command);
+        return 0;
+    }
+    
+    char line[MAX_LINE_LENGTH];
+    int extra = 0, matched = 0;
+    while (fgets(line, sizeof(line), output)) {
+        if (strncmp(line, "Remv ", 5) != 0 && strncmp(line, "Purg ", 5) != 0) {
+            continue;
+        }
+        char* name = line + 5;
+        name[strcspn(name, " :\n")] = '\0';
+        int listed = 0;
+        for (int i = 0; i < count && !listed; i++) {
+            listed = strcmp(package_name(catalog, ids[i]), name) == 0;
+        }
+        if (listed) {
+            matched++;
+        } else {
+            char extra_msg[MAX_LINE_LENGTH];
+            snprintf(extra_msg, sizeof(extra_msg), "apt would also remove %.200s", name);
+            log_message(extra_msg, "error");
+            extra++;
+        }
+    }
+    int simulated = close_command_output(output, pid, &start, command);
+    free(command);
+    if (simulated && matched == 0 && count > 0) {
+        log_message("apt simulation listed none of the packages to remove", "error");
+    }
+    return simulated && extra == 0 && (matched > 0 || count == 0);
+}
+
+int remove_package_batch(SystemType sys_type, const Catalog* catalog, const uint32_t* ids, int count) {
+    if (sys_type != SYSTEM_ARCH && !check_apt_removal(catalog, ids, count)) {
+        return 0;
+    }
+    const char* prefix = (sys_type == SYSTEM_ARCH)
+        ? "LC_ALL=C pacman -Rn --noconfirm"
+        : "DEBIAN_FRONTEND=noninteractive apt-get remove --purge -y";
+    char* command = build_package_command(prefix, catalog, ids, count,
+                                          " >/dev/null 2>" PACMAN_OUTPUT_FILE);
+    int removed = command && execute_command(command);
+    free(command);
+    return removed;
+}
+
+/* Runs a removal plan under the lock, one transaction at a time, stopping at
+ * the first that fails. Returns the exit status. */
+int execute_removal(SystemType sys_type, const Catalog* catalog, const RemovalPlan* plan) {
+    if (!create_lock_file()) {
+        return 1;
+    }
+    initialize_logging();
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    atexit(cleanup_resources);
+    
+    unsigned long long free_before = system_free_bytes();
+    uint32_t first = 0, removed = 0;
+    int failed = 0;
+    for (int t = 1; first < plan->count && keep_running && !failed; t++) {
+        uint32_t end = first;
+        size_t line_length = 0;
+        while (end < plan->count) {
+            size_t length = strlen(package_name(catalog, plan->order[end])) + 1;
+            if (end > first && line_length + length > REMOVE_COMMAND_LIMIT) {
+                break;
+            }
+            line_length += length;
+            end++;
+        }
+        
+        int size = (int)(end - first);
+        printf("  %sTransaction %d/%d: %d packages%s ", FG_WHITE, t, plan->transactions, size, RESET);
+        fflush(stdout);
+        failed = !remove_package_batch(sys_type, catalog, plan->order + first, size);
+        printf("%s%s%s\n", failed ? FG_RED : FG_GREEN, failed ? "failed" : "done", RESET);
+        
+        char message[MAX_LINE_LENGTH];
+        snprintf(message, sizeof(message), "Removal transaction %d/%d of %d packages %s",
+                t, plan->transactions, size, failed ? "failed" : "done");
+        log_message(message, failed ? "error" : "info");
+        if (!failed) {
+            removed += size;
+        }
+        first = end;
+    }
+    
+    unsigned long long free_after = system_free_bytes();
+    unsigned long long freed = free_after > free_before ? free_after - free_before : 0;
+    char summary[MAX_LINE_LENGTH];
+    snprintf(summary, sizeof(summary), "Removed %u of %u packages, freed %.2f MB (%.2f MB installed size)",
+            removed, plan->count, freed / (1024.0*1024.0), plan->bytes / (1024.0*1024.0));
+    log_message(summary, failed ? "error" : "info");
+    printf("%s%s %s%s\n", failed ? FG_RED : FG_GREEN, failed ? SYMBOL_ERROR : SYMBOL_SUCCESS,
+           summary, RESET);
+    
+    return (failed || !keep_running) ? 1 : 0;
+}
+
+/* remove subcommand: takes the named tools or groups, or what --profile
+ * selects from the installed packages, off the host together with the
+ * dependencies only they needed, and reports the space freed. With --dry-run
+ * it only prints the plan. */
+int run_remove_command(void) {
+    SystemType sys_type = detect_system_type();
+    if (sys_type == SYSTEM_UNKNOWN) {
+        fprintf(stderr, "%sUnsupported system type%s\n", FG_RED, RESET);
+        return 1;
+    }
+    if (!g_config.dry_run && !check_root_privileges()) {
+        fprintf(stderr, "%sRemoving packages requires root privileges%s\n", FG_RED, RESET);
+        return 1;
+    }
+    
+    Catalog* catalog = catalog_load_local(sys_type);
+    if (!catalog) {
+        fprintf(stderr, "%sLocal package database unavailable%s\n", FG_RED, RESET);
+        return 1;
+    }
+    if (g_config.profile_count > 0 && !plan_selection(sys_type, catalog)) {
+        fprintf(stderr, "%sCannot read the selected profiles%s\n", FG_RED, RESET);
+        catalog_destroy(catalog);
+        return 1;
+    }
+    for (int i = 0; i < g_config.command_arg_count; i++) {
+        const char* name = g_config.command_args[i];
+        if (!is_valid_package_name(name)) {
+            fprintf(stderr, "%sInvalid package name: %s%s\n", FG_RED, name, RESET);
+            catalog_destroy(catalog);
+            return 1;
+        }
+        catalog_plan(catalog, catalog_add(catalog, name, strlen(name)));
+    }
+    expand_planned_groups(catalog);
+    
+    RemovalPlan plan;
+    if (!plan_removal(catalog, &plan, 1)) {
+        fprintf(stderr, "%sOut of memory planning the removal%s\n", FG_RED, RESET);
+        catalog_destroy(catalog);
+        return 1;
+    }
+    report_removal_plan(&plan, 1);
+    if (g_config.dry_run || plan.count == 0) {
+        free(plan.order);
+        catalog_destroy(catalog);
+        return 0;
+    }
+    
+    int result = execute_removal(sys_type, catalog, &plan);
+    free(plan.order);
+    catalog_destroy(catalog);
+    return result;
+}
+
+/* Footprint Functions */
+/* The footprint graph has a virtual root, node 0, above every package that
+ * stays on its own; package id is node id + 1. Returns the node's next
+ * successor from its cursor, or NO_PACKAGE when it has no more. */
+uint32_t footprint_successor(const Catalog* catalog, const uint8_t* roots, uint32_t node, uint32_t* cursor) {
+    if (node == 0) {
+        while (*cursor < catalog->count) {
+            uint32_t id = (*cursor)++;
+            if (roots[id]) {
+                return id + 1;
+            }
+        }
+        return NO_PACKAGE;
+    }
+    
+    uint32_t id = node - 1;
+    if (id >= catalog->dep_packages) {
+        return NO_PACKAGE;
+    }
+    uint32_t first = catalog->dep_offsets[id];
+    while (first + *cursor < catalog->dep_offsets[id + 1]) {
+        uint32_t dep = installed_target(catalog, catalog->dep_ids[first + (*cursor)++]);
+        if (dep != NO_PACKAGE && dep != id) {
+            return dep + 1;
+        }
+    }
+    return NO_PACKAGE;
+}
+
+/* Computes each installed package's exclusive footprint: the installed size
+ * of everything it dominates in the dependency graph, itself included. The
+ * root sits above every explicitly installed or essential package, every
+ * package nothing depends on, and one member of each orphaned cycle, so a
+ * package dominates exactly what removing it would take along. Dominators
+ * come from the iterative Cooper-Harvey-Kennedy algorithm over reverse
+ * postorder. exclusive and dominated are indexed by package id. */
+int compute_footprints(const Catalog* catalog, unsigned long long* exclusive, uint32_t* dominated) {
+    uint32_t nodes = catalog->count + 1;
+    uint8_t* roots = calloc(nodes, 1);
+    uint8_t* marks = calloc(nodes, 1);
+    uint32_t* stack = malloc(sizeof(uint32_t) * nodes);
+    uint32_t* cursors = calloc(nodes, sizeof(uint32_t));
+    uint32_t* postorder = malloc(sizeof(uint32_t) * nodes);
+    uint32_t* rpo = malloc(sizeof(uint32_t) * nodes);
+    uint32_t* idom = malloc(sizeof(uint32_t) * nodes);
+    uint32_t* pred_offsets = calloc(nodes + 1, sizeof(uint32_t));
+    unsigned long long* sizes = calloc(nodes, sizeof(unsigned long long));
+    uint32_t* counts = calloc(nodes, sizeof(uint32_t));
+    // Every edge is a dependency or a root edge
+    uint32_t* preds = malloc(sizeof(uint32_t) * (catalog->dep_total + nodes));
+    if (!roots || !marks || !stack || !cursors || !postorder || !rpo || !idom || !pred_offsets ||
+        !sizes || !counts || !preds) {
+        free(roots);
+        free(marks);
+        free(stack);
+        free(cursors);
+        free(postorder);
+        free(rpo);
+        free(idom);
+        free(pred_offsets);
+        free(preds);
+        free(sizes);
+        free(counts);
+        return 0;
+    }
+    
+    // Packages something installed depends on
+    for (uint32_t id = 0; id < catalog->count && id < catalog->dep_packages; id++) {
+        if (installed_target(catalog, id) != id) {
+            continue;
+        }
+        for (uint32_t d = catalog->dep_offsets[id]; d < catalog->dep_offsets[id + 1]; d++) {
+            uint32_t dep = installed_target(catalog, catalog->dep_ids[d]);
+            if (dep != NO_PACKAGE && dep != id) {
+                marks[dep] = 1;
+            }
+        }
+    }
+    uint32_t depth = 0;
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (installed_target(catalog, id) == id &&
+            ((catalog->flags[id] & (PKG_FLAG_EXPLICIT | PKG_FLAG_ESSENTIAL)) || !marks[id])) {
+            roots[id] = 1;
+        }
+    }
+    
+    // Anything still unreached sits on a cycle nothing outside needs
+    memset(marks, 0, nodes);
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (roots[id]) {
+            marks[id] = 1;
+            stack[depth++] = id;
+        }
+    }
+    mark_dependencies(catalog, marks, 1, stack, depth, NULL);
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (!marks[id] && installed_target(catalog, id) == id) {
+            roots[id] = marks[id] = 1;
+            stack[0] = id;
+            mark_dependencies(catalog, marks, 1, stack, 1, NULL);
+        }
+    }
+    
+    // Predecessor lists in node numbering
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t node = 0; node < nodes; node++) {
+            if (node > 0 && installed_target(catalog, node - 1) != node - 1) {
+                continue;
+            }
+            uint32_t cursor = 0, next;
+            while ((next = footprint_successor(catalog, roots, node, &cursor)) != NO_PACKAGE) {
+                if (pass == 0) {
+                    pred_offsets[next + 1]++;
+                } else {
+                    preds[cursors[next]++] = node;
+                }
+            }
+        }
+        if (pass == 0) {
+            for (uint32_t node = 0; node < nodes; node++) {
+                pred_offsets[node + 1] += pred_offsets[node];
+            }
+            memcpy(cursors, pred_offsets, sizeof(uint32_t) * nodes);
+        }
+    }
+    
+    // Postorder from the root; each node enters the stack once
+    memset(marks, 0, nodes);
+    memset(cursors, 0, sizeof(uint32_t) * nodes);
+    uint32_t visited = 0;
+    depth = 0;
+    stack[depth++] = 0;
+    marks[0] = 1;
+    while (depth > 0) {
+        uint32_t node = stack[depth - 1];
+        uint32_t next = footprint_successor(catalog, roots, node, &cursors[node]);
+        if (next == NO_PACKAGE) {
+            postorder[visited++] = node;
+            depth--;
+        } else if (!marks[next]) {
+            marks[next] = 1;
+            stack[depth++] = next;
+        }
+    }
+    for (uint32_t i = 0; i < visited; i++) {
+        rpo[postorder[i]] = visited - 1 - i;
+    }
+    
+#define NO_IDOM UINT32_MAX
+    for (uint32_t node = 0; node < nodes; node++) {
+        idom[node] = NO_IDOM;
+    }
+    idom[0] = 0;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (uint32_t i = visited - 1; i-- > 0;) {
+            uint32_t node = postorder[i];
+            uint32_t candidate = NO_IDOM;
+            for (uint32_t p = pred_offsets[node]; p < pred_offsets[node + 1]; p++) {
+                uint32_t pred = preds[p];
+                if (idom[pred] == NO_IDOM) {
+                    continue;
+                }
+                if (candidate == NO_IDOM) {
+                    candidate = pred;
+                    continue;
+                }
+                uint32_t a = pred, b = candidate;
+                while (a != b) {
+                    while (rpo[a] > rpo[b]) a = idom[a];
+                    while (rpo[b] > rpo[a]) b = idom[b];
+                }
+                candidate = a;
+            }
+            if (idom[node] != candidate) {
+                idom[node] = candidate;
+                changed = 1;
+            }
+        }
+    }
+#undef NO_IDOM
+    
+    // Dominators precede what they dominate in reverse postorder, so one
+    // pass in postorder sums each subtree into its parent
+    for (uint32_t i = 0; i + 1 < visited; i++) {
+        uint32_t node = postorder[i];
+        sizes[node] += catalog->size_bytes[node - 1];
+        counts[node]++;
+        sizes[idom[node]] += sizes[node];
+        counts[idom[node]] += counts[node];
+    }
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        exclusive[id] = sizes[id + 1];
+        dominated[id] = counts[id + 1];
+    }
+    
+    free(roots);
+    free(marks);
+    free(stack);
+    free(cursors);
+    free(postorder);
+    free(rpo);
+    free(idom);
+    free(pred_offsets);
+    free(preds);
+    free(sizes);
+    free(counts);
+    return 1;
+}
+
+/* Largest exclusive footprint first; arg is the footprint array */
+int compare_footprints(const void* a, const void* b, void* arg) {
+    const unsigned long long* exclusive = arg;
+    unsigned long long left = exclusive[*(const uint32_t*)a];
+    unsigned long long right = exclusive[*(const uint32_t*)b];
+    if (left != right) {
+        return left < right ? 1 : -1;
+    }
+    return (*(const uint32_t*)a > *(const uint32_t*)b) - (*(const uint32_t*)a < *(const uint32_t*)b);
+}
+
+/* footprint subcommand: ranks the named tools, or what --profile selects, or
+ * else every explicitly installed package, by the space removing each alone
+ * would free. With --json the report is a JSON document instead. */
+int run_footprint_command(void) {
+    SystemType sys_type = detect_system_type();
+    if (sys_type == SYSTEM_UNKNOWN) {
+        fprintf(stderr, "%sUnsupported system type%s\n", FG_RED, RESET);
+        return 1;
+    }
+    
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Catalog* catalog = catalog_load_local(sys_type);
+    if (!catalog) {
+        fprintf(stderr, "%sLocal package database unavailable%s\n", FG_RED, RESET);
+        return 1;
+    }
+    double load_ms = elapsed_ms(&start);
+    
+    if (g_config.profile_count > 0 && !plan_selection(sys_type, catalog)) {
+        fprintf(stderr, "%sCannot read the selected profiles%s\n", FG_RED, RESET);
+        catalog_destroy(catalog);
+        return 1;
+    }
+    for (int i = 0; i < g_config.command_arg_count; i++) {
+        uint32_t id = catalog_find(catalog, g_config.command_args[i]);
+        if (id == NO_PACKAGE) {
+            id = catalog_add(catalog, g_config.command_args[i], strlen(g_config.command_args[i]));
+        }
+        catalog_plan(catalog, id);
+    }
+    expand_planned_groups(catalog);
+    int selected = g_config.profile_count > 0 || g_config.command_arg_count > 0;
+    
+    unsigned long long* exclusive = malloc(sizeof(unsigned long long) * (catalog->count + 1));
+    uint32_t* dominated = malloc(sizeof(uint32_t) * (catalog->count + 1));
+    uint32_t* tools = malloc(sizeof(uint32_t) * (catalog->count + 1));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!exclusive || !dominated || !tools || !compute_footprints(catalog, exclusive, dominated)) {
+        fprintf(stderr, "%sOut of memory analysing the dependency graph%s\n", FG_RED, RESET);
+        free(exclusive);
+        free(dominated);
+        free(tools);
+        catalog_destroy(catalog);
+        return 1;
+    }
+    double analyse_ms = elapsed_ms(&start);
+    
+    uint32_t count = 0, installed = 0;
+    unsigned long long installed_bytes = 0;
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (installed_target(catalog, id) != id) {
+            continue;
+        }
+        installed++;
+        installed_bytes += catalog->size_bytes[id];
+        int wanted = selected ? (catalog->flags[id] & PKG_FLAG_PLANNED) != 0
+                              : (catalog->flags[id] & PKG_FLAG_EXPLICIT) &&
+                                !(catalog->flags[id] & PKG_FLAG_ESSENTIAL);
+        if (wanted) {
+            tools[count++] = id;
+        }
+    }
+    qsort_r(tools, count, sizeof(uint32_t), compare_footprints, exclusive);
+    
+    if (g_config.json_output) {
+        printf("{\"packages\": %u, \"installed_bytes\": %llu, \"milliseconds\": %.2f, \"tools\": [",
+               installed, installed_bytes, load_ms + analyse_ms);
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t id = tools[i];
+            printf("%s\n  {\"name\": \"%s\", \"version\": \"%s\", \"exclusive_bytes\": %llu, "
+                   "\"installed_bytes\": %llu, \"exclusive_packages\": %u}",
+                   i ? "," : "", package_name(catalog, id),
+                   catalog_string(catalog, catalog->local_versions[id]), exclusive[id],
+                   (unsigned long long)catalog->size_bytes[id], dominated[id]);
+        }
+        printf("\n]}\n");
+    } else {
+        printf("\n%s%s Exclusive Footprint%s (%u packages, read in %.1f ms, analysed in %.1f ms)\n",
+               FG_CYAN, SYMBOL_INFO, RESET, installed, load_ms, analyse_ms);
+        printf("  %s%12s %12s %9s  %s%s\n", BOLD, "Exclusive", "Own size", "Packages", "Tool", RESET);
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t id = tools[i];
+            printf("  %s%9.2f MB %9.2f MB %9u  %s%s\n", FG_WHITE, exclusive[id] / (1024.0*1024.0),
+                   catalog->size_bytes[id] / (1024.0*1024.0), dominated[id], package_name(catalog, id), RESET);
+        }
+        printf("  %s%u tools of %u installed packages (%.2f MB)%s\n", BOLD, count, installed,
+               installed_bytes / (1024.0*1024.0), RESET);
+    }
+    
+    free(exclusive);
+    free(dominated);
+    free(tools);
+    catalog_destroy(catalog);
+    return 0;
+}
+
+/* Usage Tracking Functions */
+/* Executables worth tracking are packaged paths in a bin or sbin directory,
+ * or anywhere under /opt, that resolve to a regular file with an execute bit.
+ * Links are followed and merged-/usr aliases such as /bin/ls become
+ * /usr/bin/ls. Returns 1 with the real path for an executable, 0 for anything
+ * that is no entry point, and -1 for an entry point that cannot be resolved. */
+int resolve_tracked_executable(const char* path, char* resolved) {
+    if (!strstr(path, "/bin/") && !strstr(path, "/sbin/") && strncmp(path, "/opt/", 5) != 0) {
+        return 0;
+    }
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode)) {
+        return 0;
+    }
+    if (!realpath(path, resolved) || stat(resolved, &st) != 0) {
+        return -1;
+    }
+    return S_ISREG(st.st_mode) && (st.st_mode & 0111) ? 1 : 0;
+}
+
+void index_add_executable(Catalog* catalog, ExecutableIndex* index, uint32_t package, const char* path) {
+    if (index->count == index->capacity) {
+        uint32_t capacity = index->capacity ? index->capacity * 2 : CATALOG_INITIAL_PACKAGES;
+        StringId* paths = realloc(index->paths, sizeof(StringId) * capacity);
+        if (!paths) {
+            return;
+        }
+        index->paths = paths;
+        uint32_t* packages = realloc(index->packages, sizeof(uint32_t) * capacity);
+        if (!packages) {
+            return;
+        }
+        index->packages = packages;
+        index->capacity = capacity;
+    }
+    StringId id = intern_string(catalog, path, strlen(path));
+    if (id != 0) {
+        index->paths[index->count] = id;
+        index->packages[index->count++] = package;
+    }
+}
+
+void index_add_entry_point(Catalog* catalog, ExecutableIndex* index, uint32_t package, const char* path) {
+    char resolved[PATH_MAX];
+    int tracked = resolve_tracked_executable(path, resolved);
+    if (tracked > 0) {
+        index_add_executable(catalog, index, package, resolved);
+    } else if (tracked < 0 && index->unresolved) {
+        index->unresolved[package] = 1;
+    }
+}
+
+/* Open addressing over the path hashes, at most half full */
+int index_build_slots(const Catalog* catalog, ExecutableIndex* index) {
+    index->slot_count = 16;
+    while (index->slot_count < index->count * 2) index->slot_count *= 2;
+    index->slots = calloc(index->slot_count, sizeof(uint32_t));
+    if (!index->slots) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < index->count; i++) {
+        const char* path = catalog_string(catalog, index->paths[i]);
+        uint32_t slot = hash_string(path, strlen(path)) & (index->slot_count - 1);
+        while (index->slots[slot] != 0) slot = (slot + 1) & (index->slot_count - 1);
+        index->slots[slot] = i + 1;
+    }
+    return 1;
+}
+
+uint32_t index_find_package(const Catalog* catalog, const ExecutableIndex* index, const char* path) {
+    if (!index->slots) {
+        return NO_PACKAGE;
+    }
+    uint32_t slot = hash_string(path, strlen(path)) & (index->slot_count - 1);
+    while (index->slots[slot] != 0) {
+        uint32_t i = index->slots[slot] - 1;
+        if (strcmp(catalog_string(catalog, index->paths[i]), path) == 0) {
+            return index->packages[i];
+        }
+        slot = (slot + 1) & (index->slot_count - 1);
+    }
+    return NO_PACKAGE;
+}
+
+void free_executable_index(ExecutableIndex* index) {
+    free(index->paths);
+    free(index->packages);
+    free(index->unresolved);
+    free(index->slots);
+    memset(index, 0, sizeof(*index));
+}
+
+/* Indexes the executables of every planned installed package: from pacman -Ql
+ * on Arch, from dpkg's file lists on Debian, whose modification time also
+ * gives the install or upgrade time */
+int list_tool_executables(SystemType sys_type, Catalog* catalog, ExecutableIndex* index) {
+    memset(index, 0, sizeof(*index));
+    index->unresolved = calloc(catalog->count + 1, 1);
+    if (!index->unresolved) {
+        return 0;
+    }
+    char* line = NULL;
+    size_t line_size = 0;
+    
+    if (sys_type == SYSTEM_ARCH) {
+        const char* command = "LC_ALL=C pacman -Ql 2>/dev/null";
+        pid_t pid;
+        struct timespec start;
+        FILE* output = open_command_output(command, &pid, &start);
+        if (!output) {
+            return 0;
+        }
+        while (getline(&line, &line_size, output) != -1) {
+            line[strcspn(line, "\n")] = '\0';
+            char* path = strchr(line, ' ');
+            if (!path) {
+                continue;
+            }
+            *path++ = '\0';
+            uint32_t id = catalog_find(catalog, line);
+            if (id != NO_PACKAGE && (catalog->flags[id] & PKG_FLAG_PLANNED)) {
+                index_add_entry_point(catalog, index, id, path);
+            }
+        }
+        close_command_output(output, pid, &start, command);
+    } else {
+        DIR* dir = opendir(DPKG_INFO_DIR);
+        if (!dir) {
+            return 0;
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t length = strlen(entry->d_name);
+            if (length < 6 || strcmp(entry->d_name + length - 5, ".list") != 0) {
+                continue;
+            }
+            // Multiarch lists are named package:arch.list
+            char name[MAX_LINE_LENGTH];
+            size_t name_length = strchr(entry->d_name, ':') ? strcspn(entry->d_name, ":") : length - 5;
+            snprintf(name, sizeof(name), "%.*s", (int)name_length, entry->d_name);
+            uint32_t id = catalog_find(catalog, name);
+            if (id == NO_PACKAGE || !(catalog->flags[id] & PKG_FLAG_PLANNED)) {
+                continue;
+            }
+            
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", DPKG_INFO_DIR, entry->d_name);
+            FILE* fp = fopen(path, "r");
+            struct stat st;
+            if (!fp) {
+                continue;
+            }
+            if (fstat(fileno(fp), &st) == 0 && st.st_mtime > catalog->install_times[id]) {
+                catalog->install_times[id] = st.st_mtime;
+            }
+            while (getline(&line, &line_size, fp) != -1) {
+                line[strcspn(line, "\n")] = '\0';
+                index_add_entry_point(catalog, index, id, line);
+            }
+            fclose(fp);
+        }
+        closedir(dir);
+    }
+    
+    free(line);
+    return index_build_slots(catalog, index);
+}
+
+/* The usage file holds "package epoch" lines from the exec watch */
+void load_usage_file(const Catalog* catalog, time_t* last_use, uint8_t* sources) {
+    FILE* fp = fopen(USAGE_FILE, "r");
+    if (!fp) {
+        return;
+    }
+    char line[MAX_LINE_LENGTH];
+    char name[MAX_LINE_LENGTH];
+    long long when;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%255s %lld", name, &when) != 2) {
+            continue;
+        }
+        uint32_t id = catalog_find(catalog, name);
+        if (id != NO_PACKAGE && (time_t)when > last_use[id]) {
+            last_use[id] = (time_t)when;
+            sources[id] = USAGE_FROM_EXEC;
+        }
+    }
+    fclose(fp);
+}
+
+/* Writes every package with an exec watch record, merged with what the file
+ * already holds, then renames it into place */
+int save_usage_file(const Catalog* catalog, const time_t* last_use, const uint8_t* sources) {
+    if (!make_directories(STATE_DIR, 0755)) {
+        return 0;
+    }
+    FILE* fp = fopen(USAGE_FILE ".part", "w");
+    if (!fp) {
+        return 0;
+    }
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (sources[id] == USAGE_FROM_EXEC) {
+            fprintf(fp, "%s %lld\n", package_name(catalog, id), (long long)last_use[id]);
+        }
+    }
+    
+    // Packages this run does not track keep their old records
+    FILE* old = fopen(USAGE_FILE, "r");
+    if (old) {
+        char line[MAX_LINE_LENGTH];
+        char name[MAX_LINE_LENGTH];
+        long long when;
+        while (fgets(line, sizeof(line), old)) {
+            if (sscanf(line, "%255s %lld", name, &when) != 2) {
+                continue;
+            }
+            uint32_t id = catalog_find(catalog, name);
+            if (id == NO_PACKAGE || sources[id] != USAGE_FROM_EXEC) {
+                fprintf(fp, "%s %lld\n", name, when);
+            }
+        }
+        fclose(old);
+    }
+    
+    int written = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    written = (fclose(fp) == 0) && written;
+    return written && rename(USAGE_FILE ".part", USAGE_FILE) == 0;
+}
+
+/* Folds in the access times of the indexed executables. relatime refreshes an
+ * atime at most daily, so it is trusted at day granularity, which is plenty
+ * for windows of weeks; mounts with noatime are skipped entirely. */
+void collect_atime_usage(const Catalog* catalog, const ExecutableIndex* index,
+                         time_t* last_use, uint8_t* sources) {
+    dev_t devices[MAX_PROBE_MOUNTS * 4];
+    int noatime[MAX_PROBE_MOUNTS * 4];
+    int mounts = 0;
+    
+    for (uint32_t i = 0; i < index->count; i++) {
+        const char* path = catalog_string(catalog, index->paths[i]);
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        int m = 0;
+        while (m < mounts && devices[m] != st.st_dev) m++;
+        if (m == mounts) {
+            struct statvfs fs_stats;
+            if (mounts == (int)(sizeof(devices) / sizeof(devices[0])) || statvfs(path, &fs_stats) != 0) {
+                continue;
+            }
+            devices[m] = st.st_dev;
+            noatime[m] = (fs_stats.f_flag & ST_NOATIME) != 0;
+            mounts++;
+        }
+        uint32_t package = index->packages[i];
+        if (!noatime[m] && st.st_atime > last_use[package]) {
+            last_use[package] = st.st_atime;
+            sources[package] = USAGE_FROM_ATIME;
+        }
+    }
+}
+
+/* Last use of every planned installed package: the latest of its install or
+ * upgrade time, its executables' access times and the exec watch records.
+ * Returns the number of packages that have executables to judge by. */
+uint32_t collect_tool_usage(SystemType sys_type, Catalog* catalog, ExecutableIndex* index,
+                            time_t* last_use, uint8_t* sources) {
+    if (!list_tool_executables(sys_type, catalog, index)) {
+        return 0;
+    }
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        last_use[id] = catalog->install_times[id];
+        sources[id] = USAGE_FROM_INSTALL;
+    }
+    collect_atime_usage(catalog, index, last_use, sources);
+    load_usage_file(catalog, last_use, sources);
+    
+    uint32_t tracked = 0;
+    uint8_t* has_executables = calloc(catalog->count + 1, 1);
+    if (has_executables) {
+        for (uint32_t i = 0; i < index->count; i++) {
+            has_executables[index->packages[i]] = 1;
+        }
+        // A tool that may still run through a path the index cannot follow
+        // is never judged unused
+        for (uint32_t id = 0; id < catalog->count; id++) {
+            if (!has_executables[id] || index->unresolved[id]) {
+                sources[id] = USAGE_UNTRACKED;
+            } else {
+                tracked++;
+            }
+        }
+        free(has_executables);
+    }
+    return tracked;
+}
+
+/* The installed packages usage and prune look at: the profiles when given,
+ * otherwise what a default install selects */
+Catalog* load_installed_tools(SystemType sys_type) {
+    Catalog* catalog = catalog_load_local(sys_type);
+    if (!catalog) {
+        fprintf(stderr, "%sLocal package database unavailable%s\n", FG_RED, RESET);
+        return NULL;
+    }
+    if (!catalog_build_trigrams(catalog) || !plan_selection(sys_type, catalog)) {
+        fprintf(stderr, "%sCannot select the installed tools%s\n", FG_RED, RESET);
+        catalog_destroy(catalog);
+        return NULL;
+    }
+    expand_planned_groups(catalog);
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if ((catalog->flags[id] & PKG_FLAG_PLANNED) && installed_target(catalog, id) != id) {
+            catalog_unplan(catalog, id);
+        }
+    }
+    return catalog;
+}
+
+time_t local_database_mtime(SystemType sys_type) {
+    struct stat st;
+    const char* path = (sys_type == SYSTEM_ARCH) ? PACMAN_LOCAL_DIR : DPKG_STATUS_FILE;
+    return stat(path, &st) == 0 ? st.st_mtime : 0;
+}
+
+/* usage --watch: records the last exec of every tracked executable through
+ * a fanotify FAN_OPEN_EXEC mark on each mount they live on. Records are
+ * written every USAGE_FLUSH_INTERVAL seconds and on exit, and the index is
+ * rebuilt when the local package database changes. */
+int watch_tool_usage(SystemType sys_type) {
+    int fan_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    if (fan_fd < 0) {
+        fprintf(stderr, "%sfanotify unavailable: %s%s\n", FG_RED, strerror(errno), RESET);
+        return 1;
+    }
+    const char* mounts[] = { "/", "/usr", "/opt" };
+    int marked = 0;
+    for (int i = 0; i < 3; i++) {
+        if (access(mounts[i], F_OK) == 0 &&
+            fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN_EXEC, AT_FDCWD, mounts[i]) == 0) {
+            marked++;
+        }
+    }
+    if (marked == 0) {
+        fprintf(stderr, "%sCannot watch executions: %s%s\n", FG_RED, strerror(errno), RESET);
+        close(fan_fd);
+        return 1;
+    }
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    
+    int result = 0;
+    while (keep_running) {
+        Catalog* catalog = load_installed_tools(sys_type);
+        time_t* last_use = catalog ? calloc(catalog->count + 1, sizeof(time_t)) : NULL;
+        uint8_t* sources = catalog ? calloc(catalog->count + 1, 1) : NULL;
+        ExecutableIndex index;
+        memset(&index, 0, sizeof(index));
+        if (!catalog || !last_use || !sources || !list_tool_executables(sys_type, catalog, &index)) {
+            free(last_use);
+            free(sources);
+            free_executable_index(&index);
+            catalog_destroy(catalog);
+            result = 1;
+            break;
+        }
+        for (uint32_t id = 0; id < catalog->count; id++) {
+            sources[id] = USAGE_UNTRACKED;
+        }
+        
+        char message[MAX_LINE_LENGTH];
+        snprintf(message, sizeof(message), "Watching %u executables of %u tools",
+                index.count, catalog->planned);
+        log_message(message, "info");
+        printf("%s%s %s%s\n", FG_CYAN, SYMBOL_INFO, message, RESET);
+        fflush(stdout);
+        
+        time_t database_mtime = local_database_mtime(sys_type);
+        time_t flushed = time(NULL);
+        int dirty = 0, rebuild = 0;
+        while (keep_running && !rebuild) {
+            struct pollfd pfd = { .fd = fan_fd, .events = POLLIN };
+            if (poll(&pfd, 1, 1000) > 0) {
+                char buffer[4096] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+                ssize_t length = read(fan_fd, buffer, sizeof(buffer));
+                struct fanotify_event_metadata* event = (struct fanotify_event_metadata*)buffer;
+                for (; length > 0 && FAN_EVENT_OK(event, length); event = FAN_EVENT_NEXT(event, length)) {
+                    if (event->fd < 0) {
+                        continue;
+                    }
+                    char link[64], path[PATH_MAX];
+                    snprintf(link, sizeof(link), "/proc/self/fd/%d", event->fd);
+                    ssize_t path_length = readlink(link, path, sizeof(path) - 1);
+                    close(event->fd);
+                    if (path_length <= 0) {
+                        continue;
+                    }
+                    path[path_length] = '\0';
+                    uint32_t id = index_find_package(catalog, &index, path);
+                    if (id != NO_PACKAGE) {
+                        last_use[id] = time(NULL);
+                        sources[id] = USAGE_FROM_EXEC;
+                        dirty = 1;
+                    }
+                }
+            }
+            
+            time_t now = time(NULL);
+            if (now - flushed >= USAGE_FLUSH_INTERVAL) {
+                flushed = now;
+                rebuild = local_database_mtime(sys_type) != database_mtime;
+                if (dirty && save_usage_file(catalog, last_use, sources)) {
+                    dirty = 0;
+                }
+            }
+        }
+        if (dirty && !save_usage_file(catalog, last_use, sources)) {
+            log_message("Failed to write " USAGE_FILE, "error");
+            result = 1;
+        }
+        
+        free(last_use);
+        free(sources);
+        free_executable_index(&index);
+        catalog_destroy(catalog);
+    }
+    
+    close(fan_fd);
+    return result;
+}
+
+/* Least recently used first; arg is the last use array */
+int compare_last_use(const void* a, const void* b, void* arg) {
+    const time_t* last_use = arg;
+    time_t left = last_use[*(const uint32_t*)a];
+    time_t right = last_use[*(const uint32_t*)b];
+    return (left > right) - (left < right);
+}
+
+static const char* const USAGE_SOURCE_NAMES[] = { "installed", "atime", "exec", "untracked" };
+
+/* usage subcommand: lists the installed tools by last use, least recent
+ * first, or with --watch records executions until stopped */
+int run_usage_command(void) {
+    SystemType sys_type = detect_system_type();
+    if (sys_type == SYSTEM_UNKNOWN) {
+        fprintf(stderr, "%sUnsupported system type%s\n", FG_RED, RESET);
+        return 1;
+    }
+    if (g_config.watch_usage) {
+        if (!check_root_privileges()) {
+            fprintf(stderr, "%sWatching executions requires root privileges%s\n", FG_RED, RESET);
+            return 1;
+        }
+        initialize_logging();
+        return watch_tool_usage(sys_type);
+    }
+    
+    Catalog* catalog = load_installed_tools(sys_type);
+    if (!catalog) {
+        return 1;
+    }
+    time_t* last_use = calloc(catalog->count + 1, sizeof(time_t));
+    uint8_t* sources = calloc(catalog->count + 1, 1);
+    uint32_t* tools = malloc(sizeof(uint32_t) * (catalog->count + 1));
+    ExecutableIndex index;
+    memset(&index, 0, sizeof(index));
+    if (!last_use || !sources || !tools) {
+        free(last_use);
+        free(sources);
+        free(tools);
+        catalog_destroy(catalog);
+        return 1;
+    }
+    
+    uint32_t tracked = collect_tool_usage(sys_type, catalog, &index, last_use, sources);
+    uint32_t count = 0;
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if ((catalog->flags[id] & PKG_FLAG_PLANNED) && sources[id] != USAGE_UNTRACKED) {
+            tools[count++] = id;
+        }
+    }
+    qsort_r(tools, count, sizeof(uint32_t), compare_last_use, last_use);
+    
+    time_t now = time(NULL);
+    printf("\n%s%s Tool Usage%s (%u tools, %u executables, %u without executables)\n", FG_CYAN,
+           SYMBOL_INFO, RESET, tracked, index.count, catalog->planned - tracked);
+    printf("  %s%-17s %6s  %-9s  %s%s\n", BOLD, "Last used", "Days", "Source", "Tool", RESET);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t id = tools[i];
+        char when[32] = "unknown";
+        if (last_use[id] > 0) {
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&last_use[id]));
+        }
+        printf("  %s%-17s %6lld  %-9s  %s%s\n", FG_WHITE, when,
+               last_use[id] > 0 ? (long long)(now - last_use[id]) / 86400 : -1LL,
+               USAGE_SOURCE_NAMES[sources[id]], package_name(catalog, id), RESET);
+    }
+    
+    free(last_use);
+    free(sources);
+    free(tools);
+    free_executable_index(&index);
+    catalog_destroy(catalog);
+    return 0;
+}
+
+/* prune subcommand: removes the installed tools not used within
+ * --unused-for, through the same planning and transactions as remove.
+ * Tools without executables are never pruned, since nothing records their use. */
+int run_prune_command(void) {
+    SystemType sys_type = detect_system_type();
+    if (sys_type == SYSTEM_UNKNOWN) {
+        fprintf(stderr, "%sUnsupported system type%s\n", FG_RED, RESET);
+        return 1;
+    }
+    if (!g_config.dry_run && !check_root_privileges()) {
+        fprintf(stderr, "%sRemoving packages requires root privileges%s\n", FG_RED, RESET);
+        return 1;
+    }
+    
+    Catalog* catalog = load_installed_tools(sys_type);
+    if (!catalog) {
+        return 1;
+    }
+    time_t* last_use = calloc(catalog->count + 1, sizeof(time_t));
+    uint8_t* sources = calloc(catalog->count + 1, 1);
+    ExecutableIndex index;
+    memset(&index, 0, sizeof(index));
+    if (!last_use || !sources) {
+        free(last_use);
+        free(sources);
+        catalog_destroy(catalog);
+        return 1;
+    }
+    
+    uint32_t tracked = collect_tool_usage(sys_type, catalog, &index, last_use, sources);
+    time_t cutoff = time(NULL) - g_config.unused_for;
+    uint32_t stale = 0;
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (!(catalog->flags[id] & PKG_FLAG_PLANNED)) {
+            continue;
+        }
+        if (sources[id] == USAGE_UNTRACKED || last_use[id] == 0 || last_use[id] >= cutoff) {
+            catalog_unplan(catalog, id);
+            continue;
+        }
+        stale++;
+        char stale_msg[MAX_LINE_LENGTH];
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d", localtime(&last_use[id]));
+        snprintf(stale_msg, sizeof(stale_msg), "Unused since %s (%s): %.150s", when,
+                USAGE_SOURCE_NAMES[sources[id]], package_name(catalog, id));
+        log_message(stale_msg, "info");
+        printf("  %s%s%s\n", FG_WHITE, stale_msg, RESET);
+    }
+    int period = g_config.unused_for;
+    const char* unit = (period >= 86400) ? "days" : (period >= 3600) ? "hours" : "seconds";
+    period /= (period >= 86400) ? 86400 : (period >= 3600) ? 3600 : 1;
+    printf("%s%s %u of %u tracked tools unused for %d %s%s\n", FG_CYAN, SYMBOL_INFO, stale, tracked,
+           period, unit, RESET);
+    free(last_use);
+    free(sources);
+    free_executable_index(&index);
+    
+    RemovalPlan plan;
+    if (!plan_removal(catalog, &plan, 1)) {
+        fprintf(stderr, "%sOut of memory planning the removal%s\n", FG_RED, RESET);
+        catalog_destroy(catalog);
+        return 1;
+    }
+    report_removal_plan(&plan, 1);
+    int result = (g_config.dry_run || plan.count == 0) ? 0 : execute_removal(sys_type, catalog, &plan);
+    free(plan.order);
+    catalog_destroy(catalog);
+    return result;
+}
+
+/* Install History Functions */
+/* Bytes a package moves through a run: its archive plus what it unpacks */
+unsigned long long package_work_bytes(const Catalog* catalog, uint32_t id) {
+    unsigned long long bytes = catalog->download_bytes[id] + catalog->size_bytes[id];
+    return bytes > 0 ? bytes : DEFAULT_PACKAGE_SIZE;
+}
+
+int load_install_history(const Catalog* catalog, InstallHistory* history) {
+    history->throughput = 0;
+    history->seconds = calloc(catalog->count + 1, sizeof(double));
+    if (!history->seconds) {
+        return 0;
+    }
+    FILE* fp = fopen(HISTORY_FILE, "r");
+    if (!fp) {
+        return 1;
+    }
+    char line[MAX_LINE_LENGTH];
+    char name[MAX_LINE_LENGTH];
+    double value;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%255s %lf", name, &value) != 2 || !(value > 0)) {
+            continue;
+        }
+        if (strcmp(name, "*") == 0) {
+            history->throughput = value;
+            continue;
+        }
+        uint32_t id = catalog_find(catalog, name);
+        if (id != NO_PACKAGE) {
+            history->seconds[id] = value;
+        }
+    }
+    fclose(fp);
+    return 1;
+}
+
+/* Records of packages this catalog lacks are carried over, so a narrower
+ * profile does not forget what other runs learned */
+int save_install_history(const Catalog* catalog, const InstallHistory* history) {
+    if (!history->seconds || !make_directories(STATE_DIR, 0755)) {
+        return 0;
+    }
+    FILE* fp = fopen(HISTORY_FILE ".part", "w");
+    if (!fp) {
+        return 0;
+    }
+    if (history->throughput > 0) {
+        fprintf(fp, "* %.0f\n", history->throughput);
+    }
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (history->seconds[id] > 0) {
+            fprintf(fp, "%s %.3f\n", package_name(catalog, id), history->seconds[id]);
+        }
+    }
+    
+    FILE* old = fopen(HISTORY_FILE, "r");
+    if (old) {
+        char line[MAX_LINE_LENGTH];
+        char name[MAX_LINE_LENGTH];
+        double value;
+        while (fgets(line, sizeof(line), old)) {
+            if (sscanf(line, "%255s %lf", name, &value) == 2 && strcmp(name, "*") != 0 &&
+                catalog_find(catalog, name) == NO_PACKAGE) {
+                fprintf(fp, "%s %.3f\n", name, value);
+            }
+        }
+        fclose(old);
+    }
+    if (fclose(fp) != 0 || rename(HISTORY_FILE ".part", HISTORY_FILE) != 0) {
+        unlink(HISTORY_FILE ".part");
+        return 0;
+    }
+    return 1;
+}
+
+void free_install_history(InstallHistory* history) {
+    free(history->seconds);
+    history->seconds = NULL;
+}
+
+/* The package's own history when it was installed before, otherwise its
+ * bytes at the throughput earlier batches achieved */
+double estimate_install_seconds(const Catalog* catalog, const InstallHistory* history, uint32_t id) {
+    if (history->seconds && history->seconds[id] > 0) {
+        return history->seconds[id];
+    }
+    double throughput = history->throughput > 0 ? history->throughput : HISTORY_DEFAULT_THROUGHPUT;
+    return HISTORY_PACKAGE_SECONDS + package_work_bytes(catalog, id) / throughput;
+}
+
+/* Folds one timed batch into the history. A transaction has fixed and
+ * size-bound costs, so half its time is split evenly between the packages
+ * and half by their bytes. */
+void record_batch_duration(const Catalog* catalog, InstallHistory* history,
+                           const uint32_t* batch, int count, double seconds) {
+    unsigned long long total = 0;
+    for (int i = 0; i < count; i++) {
+        total += package_work_bytes(catalog, batch[i]);
+    }
+    if (!history->seconds || seconds <= 0 || total == 0) {
+        return;
+    }
+    
+    double throughput = total / seconds;
+    history->throughput = history->throughput > 0
+        ? history->throughput + HISTORY_WEIGHT * (throughput - history->throughput) : throughput;
+    for (int i = 0; i < count; i++) {
+        if (catalog->states[batch[i]] != PKG_INSTALLED) {
+            continue;
+        }
+        double share = seconds * (0.5 / count + 0.5 * package_work_bytes(catalog, batch[i]) / total);
+        double* average = &history->seconds[batch[i]];
+        *average = *average > 0 ? *average + HISTORY_WEIGHT * (share - *average) : share;
+    }
+}
+
+double estimate_queue_seconds(const Catalog* catalog, const InstallHistory* history,
+                              const uint32_t* queue, int head, int tail) {
+    double seconds = 0;
+    for (int i = head; i < tail; i++) {
+        seconds += estimate_install_seconds(catalog, history, queue[i]);
+    }
+    return seconds;
+}
+
+/* Keeps the queued packages whose estimates fit in the remaining budget,
+ * taking them in queue order. Smaller packages of a tier fill what larger
+ * ones leave, but once a package is deferred no lower tier is admitted, so a
+ * higher tier always finishes first. Returns the new queue length; the rest
+ * stay pending in the journal for the next window. */
+int fit_time_budget(const Catalog* catalog, const InstallHistory* history, const uint8_t* tiers,
+                    uint32_t* queue, int count, double budget_seconds) {
+    double planned = 0, deferred_seconds = 0;
+    int kept = 0, last_tier = TIER_COUNT;
+    for (int i = 0; i < count; i++) {
+        double estimate = estimate_install_seconds(catalog, history, queue[i]);
+        if (tiers[queue[i]] <= last_tier && planned + estimate <= budget_seconds) {
+            planned += estimate;
+            queue[kept++] = queue[i];
+        } else {
+            deferred_seconds += estimate;
+            if (tiers[queue[i]] < last_tier) {
+                last_tier = tiers[queue[i]];
+            }
+        }
+    }
+    
+    char budget_msg[MAX_LINE_LENGTH];
+    snprintf(budget_msg, sizeof(budget_msg),
+            "Time budget %.0f min: %d packages fit (est. %.0f min), %d deferred (est. %.0f min)",
+            budget_seconds / 60, kept, planned / 60, count - kept, deferred_seconds / 60);
+    log_message(budget_msg, "info");
+    return kept;
+}
+
+void remove_download_config(void) {
+    if (download_config_path[0]) {
+        unlink(download_config_path);
+        download_config_path[0] = '\0';
+    }
+}
+
+/* Copies pacman.conf with ParallelDownloads pinned to the given job count
+ * into a fresh file under STATE_DIR, recorded in download_config_path */
+int write_pacman_download_config(int jobs) {
+    PacmanConfig* config = load_pacman_config();
+    if (!config || !make_directories(STATE_DIR, 0755)) {
+        free(config);
+        return 0;
+    }
+    snprintf(download_config_path, sizeof(download_config_path), "%s", PACMAN_DOWNLOAD_CONFIG);
+    int fd = mkstemp(download_config_path);
+    FILE* out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    int written = out && write_pacman_config(out, config, jobs);
+    if (!out && fd >= 0) {
+        close(fd);
+    }
+    if (!written) {
+        remove_download_config();
+    }
+    free(config);
+    return written;
+}
+
+/* Fetches and verifies a batch into the package cache ahead of the install
+ * transaction. Concurrency follows the pressure throttle. */
+int download_batch(SystemType sys_type, const Catalog* catalog, const uint32_t* batch, int count) {
+    int jobs = current_download_jobs();
+    char prefix[MAX_CMD_LENGTH];
+    
+    if (sys_type == SYSTEM_ARCH) {
+        if (!write_pacman_download_config(jobs)) {
+            log_message("Failed to write download configuration", "warning");
+            return 0;
+        }
+        snprintf(prefix, sizeof(prefix),
+                "LC_ALL=C pacman -Sw --noconfirm --needed --config %s", download_config_path);
+    } else {
+        snprintf(prefix, sizeof(prefix),
+                "DEBIAN_FRONTEND=noninteractive apt-get install -d -y "
+                "-o Acquire::Queue-Mode=%s -o Acquire::http::Pipeline-Depth=%d",
+                jobs > 1 ? "host" : "access", jobs);
+    }
+    
+    char* command = build_package_command(prefix, catalog, batch, count, " >/dev/null 2>" PACMAN_OUTPUT_FILE);
+    g_throttle.stoppable = 1;
+    int downloaded = command && execute_command(command);
+    g_throttle.stoppable = 0;
+    free(command);
+    remove_download_config();
+    
+    if (!downloaded) {
+        log_message("Batch download failed, leaving it to the install transaction", "warning");
+    }
+    return downloaded;
+}
+
+/* Installs a batch in one transaction, falling back to per-package retries */
+void install_batch(SystemType sys_type, Catalog* catalog, const uint32_t* batch, int count) {
+    const char* prefix = (sys_type == SYSTEM_ARCH)
+        ? "LC_ALL=C pacman -S --noconfirm --needed --overwrite=\"*\""
+        : "DEBIAN_FRONTEND=noninteractive apt-get install -y";
+    const char* suffix = " >/dev/null 2>" PACMAN_OUTPUT_FILE;
+    
+    char* command = build_package_command(prefix, catalog, batch, count, suffix);
+    int installed = command && execute_command(command);
+    free(command);
+    
+    if (installed) {
+        for (int i = 0; i < count; i++) {
+            catalog->states[batch[i]] = PKG_INSTALLED;
+            catalog->install_times[batch[i]] = time(NULL);
+            catalog->retries[batch[i]]++;
+        }
+        return;
+    }
+    
+    if (count > 1) {
+        log_message("Batch transaction failed, retrying packages individually", "warning");
+    } else {
+        catalog->retries[batch[0]]++;
+    }
+    
+    for (int i = 0; i < count && keep_running; i++) {
+        uint32_t id = batch[i];
+        installed = 0;
+        
+        while (!installed && catalog->retries[id] < MAX_RETRIES && keep_running) {
+            catalog->retries[id]++;
+            command = build_package_command(prefix, catalog, &id, 1, suffix);
+            installed = command && execute_command(command);
+            free(command);
+        }
+        
+        if (installed) {
+            catalog->states[id] = PKG_INSTALLED;
+            catalog->install_times[id] = time(NULL);
+        } else {
+            catalog->states[id] = PKG_FAILED;
+            char error_msg[MAX_LINE_LENGTH];
+            snprintf(error_msg, sizeof(error_msg), "Failed to install: %.200s", package_name(catalog, id));
+            log_message(error_msg, "error");
+        }
+    }
+}
+
+/* Installs the resumed plan when one is given, otherwise the generated tool list.
+ * Takes ownership of the catalog. */
+void install_tools(Catalog* catalog) {
+    SystemType sys_type = detect_system_type();
+    if (sys_type == SYSTEM_UNKNOWN) {
+        log_message("Unsupported system type", "error");
+        catalog_destroy(catalog);
+        return;
+    }
+
+    g_progress.completed_packages = 0;
+    g_progress.show_details = 0;
+    
+    if (!catalog) {
+        catalog = catalog_open(sys_type);
+        if (!catalog || !load_package_list(TEMP_FILE, catalog)) {
+            log_message("Failed to open tool list", "error");
+            catalog_destroy(catalog);
+            return;
+        }
+        if (g_config.new_only && !select_new_packages(catalog, 0)) {
+            catalog_destroy(catalog);
+            return;
+        }
+        if (g_config.command == COMMAND_UPGRADE && !select_upgrades(sys_type, catalog)) {
+            catalog_destroy(catalog);
+            return;
+        }
+        journal_begin(sys_type, catalog);
+    }
+    
+    g_progress.total_packages = catalog->planned;
+    if (catalog->planned == 0) {
+        log_message("No packages found to install", "warning");
+        catalog_destroy(catalog);
+        return;
+    }
+    
+    // Every package can be deferred once, so the queue never exceeds twice the plan
+    uint32_t* queue = malloc(sizeof(uint32_t) * catalog->planned * 2);
+    uint32_t* batch = malloc(sizeof(uint32_t) * g_config.batch_size);
+    if (!queue || !batch) {
+        log_message("Failed to allocate install queue", "error");
+        free(queue);
+        free(batch);
+        catalog_destroy(catalog);
+        return;
+    }
+    
+    int head = 0, tail = 0;
+    int installed_packages = 0;
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        if (!(catalog->flags[id] & PKG_FLAG_PLANNED)) {
+            continue;
+        }
+        if (!is_package_done(catalog, id)) {
+            queue[tail++] = id;
+        } else {
+            g_progress.completed_packages++;
+            if (catalog->states[id] == PKG_INSTALLED) {
+                installed_packages++;
+            }
+        }
+    }
+    
+    redirect_output();
+    
+    printf("\033[2J\033[H");  // Clear screen
+    printf("%s", BANNER);
+    show_smooth_progress("Preparing...", 0.0);
+    
+    if (!catalog_load_metadata(sys_type, catalog)) {
+        log_message("Failed to build package dependency index", "warning");
+    }
+    
+    InstallPlan plan;
+    char reason[MAX_LINE_LENGTH];
+    plan_install(sys_type, catalog, &plan);
+    report_install_plan(&plan, 0);
+    free(plan.order);
+    uint8_t* tiers = plan_tiers(catalog);
+    if (!plan_fits(&plan, reason, sizeof(reason)) || !tiers) {
+        restore_output();
+        log_message(tiers ? reason : "Failed to allocate priority tiers", "error");
+        print_modern_box(tiers ? "INSUFFICIENT DISK SPACE" : "OUT OF MEMORY", FG_RED, SYMBOL_ERROR);
+        journal_close(0);
+        free(tiers);
+        free(batch);
+        free(queue);
+        catalog_destroy(catalog);
+        return;
+    }
+    
+    // Tier 0 goes first, and a batch never spans two tiers, so the tools
+    // needed most are usable before the bulk arrives
+    qsort_r(queue, tail, sizeof(uint32_t), compare_tiers, tiers);
+    for (int t = 0; t < TIER_COUNT; t++) {
+        g_report.tier_packages[t] = 0;
+        g_report.tier_finished[t] = -1;
+    }
+    
+    InstallHistory history;
+    if (!load_install_history(catalog, &history)) {
+        log_message("Failed to allocate install history", "warning");
+    }
+    time_t deadline = 0;
+    int deferred = 0;
+    if (g_config.time_budget > 0) {
+        deadline = g_report.start_time + g_config.time_budget;
+        int fitting = fit_time_budget(catalog, &history, tiers, queue, tail,
+                                      (double)(deadline - time(NULL)));
+        deferred = tail - fitting;
+        tail = fitting;
+        g_progress.total_packages -= deferred;
+    }
+    
+    ProgressBar* bar = &g_progress.bar;
+    bar->start_time = time(NULL);
+    bar->total_bytes = 0;
+    bar->done_bytes = 0;
+    bar->throughput = 0;
+    for (int i = 0; i < tail; i++) {
+        g_report.tier_packages[tiers[queue[i]]]++;
+        bar->total_bytes += package_work_bytes(catalog, queue[i]);
+    }
+    double initial_estimate = estimate_queue_seconds(catalog, &history, queue, head, tail);
+    bar->estimated_completion = bar->start_time + (time_t)initial_estimate;
+    
+    // Actual over estimated time of the batches so far, to calibrate the
+    // budget check and the ETA
+    double estimated_done = 0, actual_done = 0;
+    while (head < tail && keep_running) {
+        int batch_count = 0;
+        double batch_estimate = 0;
+        while (batch_count < g_config.batch_size && head < tail &&
+               (batch_count == 0 || tiers[queue[head]] == tiers[batch[0]])) {
+            batch_estimate += estimate_install_seconds(catalog, &history, queue[head]);
+            batch[batch_count++] = queue[head++];
+        }
+        
+        // Stop between transactions rather than run past the window
+        double scale = estimated_done > 0 ? actual_done / estimated_done : 1.0;
+        if (deadline && time(NULL) + batch_estimate * scale > deadline) {
+            head -= batch_count;
+            deferred += tail - head;
+            log_message("Time budget reached, stopping at a batch boundary", "info");
+            break;
+        }
+        
+        wait_for_pressure_relief();
+        batch_count = admit_batch(sys_type, catalog, batch, batch_count, queue, &tail);
+        if (batch_count == 0) {
+            record_finished_tiers(tiers, queue, head, tail);
+            continue;
+        }
+        
+        const char* first_name = package_name(catalog, batch[0]);
+        if (batch_count > 1) {
+            snprintf(g_progress.current_package, MAX_LINE_LENGTH, "%.200s (+%d)", first_name, batch_count - 1);
+        } else {
+            snprintf(g_progress.current_package, MAX_LINE_LENGTH, "%.200s", first_name);
+        }
+        
+        // Admission may have shrunk the batch, so size it again
+        g_progress.batch_bytes = 0;
+        batch_estimate = 0;
+        for (int i = 0; i < batch_count; i++) {
+            g_progress.batch_bytes += package_work_bytes(catalog, batch[i]);
+            batch_estimate += estimate_install_seconds(catalog, &history, batch[i]);
+        }
+        g_progress.batch_estimate = batch_estimate * scale;
+        bar->estimated_completion = time(NULL) +
+            (time_t)((batch_estimate + estimate_queue_seconds(catalog, &history, queue, head, tail)) * scale);
+        clock_gettime(CLOCK_MONOTONIC, &g_progress.batch_start);
+        g_progress.live = 1;
+        show_smooth_progress(g_progress.current_package, progress_percentage());
+        
+        download_batch(sys_type, catalog, batch, batch_count);
+        install_batch(sys_type, catalog, batch, batch_count);
+        double batch_seconds = elapsed_ms(&g_progress.batch_start) / 1000.0;
+        g_progress.live = 0;
+        estimated_done += batch_estimate;
+        actual_done += batch_seconds;
+        bar->done_bytes += g_progress.batch_bytes;
+        if (batch_seconds > 0) {
+            double throughput = g_progress.batch_bytes / batch_seconds;
+            bar->throughput = bar->throughput > 0
+                ? bar->throughput + HISTORY_WEIGHT * (throughput - bar->throughput) : throughput;
+        }
+        record_batch_duration(catalog, &history, batch, batch_count, batch_seconds);
+        
+        for (int i = 0; i < batch_count; i++) {
+            if (catalog->states[batch[i]] == PKG_INSTALLED) {
+                installed_packages++;
+            }
+            journal_record_package(catalog, batch[i]);
+        }
+        journal_sync();
+        g_progress.completed_packages += batch_count;
+        record_finished_tiers(tiers, queue, head, tail);
+        usleep(LOADER_UPDATE_INTERVAL);
+    }
+    
+    show_smooth_progress("Installation Complete", 100.0);
+    printf("\n");
+    
+    restore_output();
+    
+    char estimate_msg[MAX_LINE_LENGTH];
+    snprintf(estimate_msg, sizeof(estimate_msg), "Install estimated at %.0fs, took %.0fs (%.1f MB)",
+            initial_estimate, actual_done, bar->done_bytes / (1024.0*1024.0));
+    log_message(estimate_msg, "info");
+    bar->estimated_completion = 0;
+    if (!save_install_history(catalog, &history)) {
+        log_message("Failed to save install history", "warning");
+    }
+    free_install_history(&history);
+    if (deferred > 0) {
+        char deferred_msg[MAX_LINE_LENGTH];
+        snprintf(deferred_msg, sizeof(deferred_msg),
+                "Time budget reached: %d packages left for the next window", deferred);
+        log_message(deferred_msg, "info");
+        printf("%s%s %s%s\n", FG_YELLOW, SYMBOL_WARNING, deferred_msg, RESET);
+    }
+    
+    // An interrupted run, or one its time budget cut short, keeps its journal for --resume
+    journal_close(keep_running && deferred == 0);
+    
+    // An upgrade leaves missing tools missing, so it never counts as complete
+    int complete = keep_running && g_config.command != COMMAND_UPGRADE;
+    for (uint32_t id = 0; id < catalog->count && complete; id++) {
+        if ((catalog->flags[id] & PKG_FLAG_PLANNED) && catalog->states[id] != PKG_INSTALLED) {
+            complete = 0;
+        }
+    }
+    if (complete) {
+        record_run_fingerprint(sys_type);
+        record_selection_baseline(catalog);
+    }
+    
+    char completion_msg[MAX_LINE_LENGTH];
+    snprintf(completion_msg, sizeof(completion_msg),
+            "Completed installation of %d/%d packages",
+            installed_packages, g_progress.total_packages);
+    log_message(completion_msg, "info");
+    
+    free(tiers);
+    free(batch);
+    free(queue);
+    catalog_destroy(catalog);
+}
+
+/* Command Lookup Functions */
+/* Seeded FNV-1a with a final avalanche, so every seed scatters the names of a
+ * bucket independently of the others */
+uint32_t hash_command(const char* text, size_t length, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/* The executable name when a file list path is in a bin or sbin directory */
+const char* command_name(const char* path, size_t length, size_t* name_length) {
+    static const char* const dirs[] = { "usr/bin/", "usr/sbin/", "bin/", "sbin/", "usr/local/bin/", NULL };
+    if (length > 0 && path[0] == '/') {
+        path++;
+        length--;
+    }
+    for (int i = 0; dirs[i] != NULL; i++) {
+        size_t dir_length = strlen(dirs[i]);
+        if (length > dir_length && strncmp(path, dirs[i], dir_length) == 0 &&
+            !memchr(path + dir_length, '/', length - dir_length)) {
+            *name_length = length - dir_length;
+            return path + dir_length;
+        }
+    }
+    return NULL;
+}
+
+uint32_t command_list_string(CommandList* list, const char* text, size_t length) {
+    if (list->string_size + length + 1 > UINT32_MAX - 1) {
+        return UINT32_MAX;
+    }
+    if (list->string_size + length + 1 > list->string_capacity) {
+        size_t capacity = list->string_capacity ? list->string_capacity * 2 : ARENA_BLOCK_SIZE;
+        while (capacity < list->string_size + length + 1) {
+            capacity *= 2;
+        }
+        char* strings = realloc(list->strings, capacity);
+        if (!strings) {
+            return UINT32_MAX;
+        }
+        list->strings = strings;
+        list->string_capacity = capacity;
+    }
+    uint32_t offset = (uint32_t)list->string_size;
+    memcpy(list->strings + offset, text, length);
+    list->strings[offset + length] = '\0';
+    list->string_size += length + 1;
+    return offset;
+}
+
+int command_list_grow(CommandList* list) {
+    uint32_t capacity = list->capacity ? list->capacity * 2 : CATALOG_INITIAL_PACKAGES;
+    uint32_t* names = realloc(list->names, sizeof(uint32_t) * capacity);
+    if (names) {
+        list->names = names;
+    }
+    uint32_t* packages = names ? realloc(list->packages, sizeof(uint32_t) * capacity) : NULL;
+    if (packages) {
+        list->packages = packages;
+    }
+    uint32_t* seen = packages ? calloc((size_t)capacity * 2, sizeof(uint32_t)) : NULL;
+    if (!seen) {
+        return 0;
+    }
+    
+    // The seen table stays at most half full
+    free(list->seen);
+    list->seen = seen;
+    list->seen_mask = capacity * 2 - 1;
+    list->capacity = capacity;
+    for (uint32_t i = 0; i < list->count; i++) {
+        const char* name = list->strings + list->names[i];
+        uint32_t slot = hash_command(name, strlen(name), 0) & list->seen_mask;
+        while (list->seen[slot] != 0) {
+            slot = (slot + 1) & list->seen_mask;
+        }
+        list->seen[slot] = i + 1;
+    }
+    return 1;
+}
+
+/* Appends a package to the providers of an already listed command, unless
+ * it is there already or the list would outgrow a request line */
+int command_list_add_provider(CommandList* list, uint32_t command,
+                              const char* package, size_t package_length) {
+    const char* providers = list->strings + list->packages[command];
+    size_t providers_length = strlen(providers);
+    for (const char* p = providers; *p; p += strcspn(p, " "), p += (*p == ' ')) {
+        if (strcspn(p, " ") == package_length && strncmp(p, package, package_length) == 0) {
+            return 1;
+        }
+    }
+    if (providers_length + package_length + 2 >= MAX_LINE_LENGTH) {
+        return 1;
+    }
+    
+    char combined[MAX_LINE_LENGTH];
+    snprintf(combined, sizeof(combined), "%s %.*s", providers, (int)package_length, package);
+    uint32_t offset = command_list_string(list, combined, strlen(combined));
+    if (offset == UINT32_MAX) {
+        return 0;
+    }
+    list->packages[command] = offset;
+    return 1;
+}
+
+/* Adds a command, or another provider of one an earlier file list named.
+ * Providers stay in the order the lists name them; the install service picks
+ * the first one the configured selection allows. */
+int command_list_add(CommandList* list, const char* name, size_t name_length,
+                     const char* package, size_t package_length) {
+    if (list->count == list->capacity && !command_list_grow(list)) {
+        return 0;
+    }
+    uint32_t slot = hash_command(name, name_length, 0) & list->seen_mask;
+    while (list->seen[slot] != 0) {
+        const char* known = list->strings + list->names[list->seen[slot] - 1];
+        if (strncmp(known, name, name_length) == 0 && known[name_length] == '\0') {
+            return command_list_add_provider(list, list->seen[slot] - 1, package, package_length);
+        }
+        slot = (slot + 1) & list->seen_mask;
+    }
+    
+    uint32_t package_offset = list->last_package;
+    if (list->count == 0 || strncmp(list->strings + package_offset, package, package_length) != 0 ||
+        list->strings[package_offset + package_length] != '\0') {
+        package_offset = command_list_string(list, package, package_length);
+    }
+    uint32_t name_offset = command_list_string(list, name, name_length);
+    if (package_offset == UINT32_MAX || name_offset == UINT32_MAX) {
+        return 0;
+    }
+    list->last_package = package_offset;
+    list->names[list->count] = name_offset;
+    list->packages[list->count] = package_offset;
+    list->seen[slot] = ++list->count;
+    return 1;
+}
+
+void free_command_list(CommandList* list) {
+    free(list->strings);
+    free(list->names);
+    free(list->packages);
+    free(list->seen);
+    memset(list, 0, sizeof(*list));
+}
+
+/* Reads "PACKAGE PATH" lines from pacman -Fl, or "PATH SECTION/PACKAGE,..."
+ * lines from apt Contents files, keeping the executables */
+int read_command_lines(FILE* input, CommandList* list, int contents_format) {
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    int added = 1;
+    while (added && (length = getline(&line, &line_capacity, input)) > 0) {
+        while (length > 0 && isspace((unsigned char)line[length - 1])) {
+            line[--length] = '\0';
+        }
+        char* split = line + length;
+        if (contents_format) {
+            while (split > line && !isspace((unsigned char)split[-1])) split--;
+        } else {
+            split = strchr(line, ' ');
+        }
+        if (!split || split == line) {
+            continue;
+        }
+        
+        const char* path = contents_format ? line : split + 1;
+        const char* package = contents_format ? split : line;
+        size_t path_length = contents_format ? (size_t)(split - line) : strlen(path);
+        while (path_length > 0 && isspace((unsigned char)path[path_length - 1])) {
+            path_length--;
+        }
+        size_t name_length;
+        const char* name = command_name(path, path_length, &name_length);
+        
+        // Contents lists every package shipping the path, comma separated
+        while (name && added && *package) {
+            size_t package_length = contents_format ? strcspn(package, ",") : (size_t)(split - line);
+            const char* next = package + package_length + (package[package_length] == ',');
+            // Contents names the package after its section
+            const char* slash = memrchr(package, '/', package_length);
+            if (slash) {
+                package_length -= slash + 1 - package;
+                package = slash + 1;
+            }
+            if (package_length > 0) {
+                added = command_list_add(list, name, name_length, package, package_length);
+            }
+            if (!contents_format) {
+                break;
+            }
+            package = next;
+        }
+    }
+    free(line);
+    return added;
+}
+
+/* Collects executables from the pacman file databases or the apt Contents
+ * indexes, whichever the system has fetched */
+int collect_commands(SystemType sys_type, CommandList* list) {
+    pid_t pid;
+    struct timespec started;
+    if (sys_type == SYSTEM_ARCH) {
+        FILE* output = open_command_output("LC_ALL=C pacman -Fl 2>/dev/null", &pid, &started);
+        if (!output) {
+            return 0;
+        }
+        int read = read_command_lines(output, list, 0);
+        close_command_output(output, pid, &started, "pacman -Fl");
+        return read;
+    }
+    
+    glob_t found;
+    if (glob(APT_LISTS_DIR "/*Contents-*", 0, NULL, &found) != 0) {
+        return 1;
+    }
+    int read = 1;
+    for (size_t i = 0; i < found.gl_pathc && read; i++) {
+        const char* path = found.gl_pathv[i];
+        if (strstr(path, ".diff") || strchr(path, '\'')) {
+            continue;
+        }
+        // apt-helper undoes whatever compression the lists were stored with
+        char command[MAX_CMD_LENGTH];
+        snprintf(command, sizeof(command), "/usr/lib/apt/apt-helper cat-file '%s' 2>/dev/null", path);
+        FILE* output = open_command_output(command, &pid, &started);
+        if (!output) {
+            read = 0;
+            break;
+        }
+        read = read_command_lines(output, list, 1);
+        close_command_output(output, pid, &started, "apt-helper cat-file");
+    }
+    globfree(&found);
+    return read;
+}
+
+int compare_bucket_sizes(const void* a, const void* b, void* arg) {
+    const uint32_t* starts = arg;
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    uint32_t size_x = starts[x + 1] - starts[x];
+    uint32_t size_y = starts[y + 1] - starts[y];
+    return (size_x < size_y) - (size_x > size_y);
+}
+
+/* Hash and displace: buckets are placed largest first, each trying seeds
+ * until all its names land in free, distinct slots. Returns 0 when some
+ * bucket exhausts COMMAND_MAX_SEED, after which the caller grows the table. */
+int assign_command_slots(const CommandList* list, uint32_t bucket_count, uint32_t slot_count,
+                         uint32_t* seeds, CommandSlot* slots) {
+    uint32_t* starts = calloc((size_t)bucket_count + 2, sizeof(uint32_t));
+    uint32_t* members = malloc(sizeof(uint32_t) * (list->count + 1));
+    uint32_t* buckets = malloc(sizeof(uint32_t) * bucket_count);
+    uint32_t* trial = malloc(sizeof(uint32_t) * (list->count + 1));
+    uint8_t* taken = calloc(slot_count, 1);
+    if (!starts || !members || !buckets || !trial || !taken) {
+        free(starts);
+        free(members);
+        free(buckets);
+        free(trial);
+        free(taken);
+        return 0;
+    }
+    
+    for (uint32_t i = 0; i < list->count; i++) {
+        const char* name = list->strings + list->names[i];
+        starts[hash_command(name, strlen(name), 0) % bucket_count + 2]++;
+    }
+    for (uint32_t b = 0; b < bucket_count; b++) {
+        starts[b + 2] += starts[b + 1];
+        buckets[b] = b;
+    }
+    for (uint32_t i = 0; i < list->count; i++) {
+        const char* name = list->strings + list->names[i];
+        members[starts[hash_command(name, strlen(name), 0) % bucket_count + 1]++] = i;
+    }
+    qsort_r(buckets, bucket_count, sizeof(uint32_t), compare_bucket_sizes, starts);
+    
+    memset(seeds, 0, sizeof(uint32_t) * bucket_count);
+    for (uint32_t s = 0; s < slot_count; s++) {
+        slots[s].name = UINT32_MAX;
+        slots[s].package = UINT32_MAX;
+    }
+    
+    int placed = 1;
+    for (uint32_t i = 0; i < bucket_count && placed; i++) {
+        uint32_t b = buckets[i];
+        uint32_t first = starts[b], size = starts[b + 1] - starts[b];
+        if (size == 0) {
+            break;
+        }
+        uint32_t seed = 1;
+        for (; seed <= COMMAND_MAX_SEED; seed++) {
+            uint32_t k = 0;
+            for (; k < size; k++) {
+                const char* name = list->strings + list->names[members[first + k]];
+                uint32_t slot = hash_command(name, strlen(name), seed) % slot_count;
+                uint32_t j = 0;
+                while (j < k && trial[j] != slot) j++;
+                if (taken[slot] || j < k) {
+                    break;
+                }
+                trial[k] = slot;
+            }
+            if (k == size) {
+                break;
+            }
+        }
+        if (seed > COMMAND_MAX_SEED) {
+            placed = 0;
+            break;
+        }
+        seeds[b] = seed;
+        for (uint32_t k = 0; k < size; k++) {
+            uint32_t member = members[first + k];
+            taken[trial[k]] = 1;
+            slots[trial[k]].name = list->names[member];
+            slots[trial[k]].package = list->packages[member];
+        }
+    }
+    
+    free(starts);
+    free(members);
+    free(buckets);
+    free(trial);
+    free(taken);
+    return placed;
+}
+
+/* Builds the command index from the file lists and writes it next to the
+ * catalog snapshot, through a temporary file so lookups never see half of it */
+int build_command_index(SystemType sys_type, uint64_t stamp, uint32_t* count_out) {
+    CommandList list;
+    memset(&list, 0, sizeof(list));
+    if (!collect_commands(sys_type, &list) || list.count == 0) {
+        free_command_list(&list);
+        return 0;
+    }
+    
+    uint32_t bucket_count = list.count / COMMAND_BUCKET_KEYS + 1;
+    uint32_t slot_count = list.count + list.count / 4 + 1;
+    uint32_t* seeds = malloc(sizeof(uint32_t) * bucket_count);
+    CommandSlot* slots = NULL;
+    int placed = 0;
+    for (int attempt = 0; attempt < 4 && seeds && !placed; attempt++) {
+        CommandSlot* grown = realloc(slots, sizeof(CommandSlot) * slot_count);
+        if (!grown) {
+            break;
+        }
+        slots = grown;
+        placed = assign_command_slots(&list, bucket_count, slot_count, seeds, slots);
+        if (!placed) {
+            slot_count += list.count / 8 + 1;
+        }
+    }
+    
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", COMMAND_INDEX_FILE, (int)getpid());
+    FILE* fp = (placed && make_directories(CACHE_DIR, 0755)) ? fopen(temp_path, "w") : NULL;
+    int written = 0;
+    if (fp) {
+        CommandIndexHeader header = {0};
+        memcpy(header.magic, COMMAND_INDEX_MAGIC, sizeof(COMMAND_INDEX_MAGIC));
+        header.version = COMMAND_INDEX_VERSION;
+        header.sys_type = (uint32_t)sys_type;
+        header.source_stamp = stamp;
+        header.command_count = list.count;
+        header.bucket_count = bucket_count;
+        header.slot_count = slot_count;
+        header.string_size = (uint32_t)list.string_size;
+        header.file_size = sizeof(header) + sizeof(uint32_t) * (uint64_t)bucket_count +
+                           sizeof(CommandSlot) * (uint64_t)slot_count + list.string_size;
+        written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                  fwrite(seeds, sizeof(uint32_t), bucket_count, fp) == bucket_count &&
+                  fwrite(slots, sizeof(CommandSlot), slot_count, fp) == slot_count &&
+                  fwrite(list.strings, 1, list.string_size, fp) == list.string_size;
+        written = fclose(fp) == 0 && written && rename(temp_path, COMMAND_INDEX_FILE) == 0;
+        if (!written) {
+            unlink(temp_path);
+        }
+    }
+    if (!written) {
+        log_message("Failed to write command index", "warning");
+    }
+    
+    *count_out = list.count;
+    free(seeds);
+    free(slots);
+    free_command_list(&list);
+    return written;
+}
+
+/* Maps the command index when it exists and is whole */
+int command_index_open(CommandIndex* index, SystemType sys_type) {
+    memset(index, 0, sizeof(*index));
+    int fd = open(COMMAND_INDEX_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    
+    CommandIndexHeader header;
+    struct stat st;
+    int valid = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+        fstat(fd, &st) == 0 &&
+        memcmp(header.magic, COMMAND_INDEX_MAGIC, sizeof(COMMAND_INDEX_MAGIC)) == 0 &&
+        header.version == COMMAND_INDEX_VERSION && header.sys_type == (uint32_t)sys_type &&
+        header.file_size == (uint64_t)st.st_size && header.bucket_count > 0 &&
+        header.slot_count > 0 && header.string_size > 0 &&
+        header.file_size == sizeof(header) + sizeof(uint32_t) * (uint64_t)header.bucket_count +
+                            sizeof(CommandSlot) * (uint64_t)header.slot_count + header.string_size;
+    void* mapping = valid ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return 0;
     }
     
-    rewind(tool_list);
-    redirect_output();
+    index->mapping = mapping;
+    index->size = st.st_size;
+    index->header = mapping;
+    index->seeds = (const uint32_t*)((const char*)mapping + sizeof(header));
+    index->slots = (const CommandSlot*)(index->seeds + header.bucket_count);
+    index->strings = (const char*)(index->slots + header.slot_count);
+    if (index->strings[header.string_size - 1] != '\0') {
+        munmap(mapping, st.st_size);
+        memset(index, 0, sizeof(*index));
+        return 0;
+    }
+    return 1;
+}
+
+void command_index_close(CommandIndex* index) {
+    if (index->mapping) {
+        munmap(index->mapping, index->size);
+    }
+    memset(index, 0, sizeof(*index));
+}
+
+/* Two hashes and one string compare: the packages providing a command,
+ * space separated, or NULL */
+const char* command_index_lookup(const CommandIndex* index, const char* name) {
+    const CommandIndexHeader* header = index->header;
+    size_t length = strlen(name);
+    uint32_t seed = index->seeds[hash_command(name, length, 0) % header->bucket_count];
+    if (seed == 0) {
+        return NULL;
+    }
+    const CommandSlot* slot = &index->slots[hash_command(name, length, seed) % header->slot_count];
+    if (slot->name >= header->string_size || slot->package >= header->string_size ||
+        strcmp(index->strings + slot->name, name) != 0) {
+        return NULL;
+    }
+    return index->strings + slot->package;
+}
+
+void benchmark_command_lookup(const CommandIndex* index, const char* name, int runs, double open_ms) {
+    double* samples = malloc(sizeof(double) * runs);
+    if (!samples) {
+        return;
+    }
+    const char* package = NULL;
+    for (int r = 0; r < runs; r++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        package = command_index_lookup(index, name);
+        samples[r] = elapsed_ms(&start) * 1000.0;
+    }
+    qsort(samples, runs, sizeof(double), compare_doubles);
+    printf("%s%s Lookup of %s%s: %s (%u commands, opened in %.3f ms)\n", FG_CYAN, SYMBOL_INFO, name, RESET,
+           package ? package : "not found", index->header->command_count, open_ms);
+    printf("  %s%d runs: min %.3f us, median %.3f us, p99 %.3f us%s\n", FG_WHITE, runs, samples[0],
+           samples[runs / 2], samples[(runs * 99) / 100], RESET);
+    free(samples);
+}
+
+/* command-index subcommand: rebuilds the index from the fetched file lists */
+int run_command_index_command(void) {
+    SystemType sys_type = detect_system_type();
+    if (sys_type == SYSTEM_UNKNOWN) {
+        fprintf(stderr, "%sUnsupported system type%s\n", FG_RED, RESET);
+        return 1;
+    }
+    if (!check_root_privileges()) {
+        fprintf(stderr, "%sWriting the command index requires root privileges%s\n", FG_RED, RESET);
+        return 1;
+    }
     
-    printf("\033[2J\033[H");  // Clear screen
-    printf("%s", BANNER);
-    show_smooth_progress("Preparing...", 0.0);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t count = 0;
+    if (!build_command_index(sys_type, sync_db_stamp(sys_type), &count)) {
+        fprintf(stderr, "%sNo command index built: %s%s\n", FG_RED, count > 0 ? "cannot write " COMMAND_INDEX_FILE
+                : (sys_type == SYSTEM_ARCH) ? "fetch the file databases with pacman -Fy"
+                : "fetch the Contents indexes with apt-file update", RESET);
+        return 1;
+    }
+    printf("%s%s Indexed %u commands in %.1f ms%s\n", FG_GREEN, SYMBOL_SUCCESS, count, elapsed_ms(&start), RESET);
+    return 0;
+}
+
+/* Hands the providers of a command to the install service and relays its
+ * progress. Replies are lines of "info", "ok" or "error" followed by a message. */
+int request_tool_install(const char* providers) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, COMMAND_SOCKET, sizeof(address.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "%sInstall service not running; start it with: blackutility serve%s\n", FG_YELLOW, RESET);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
     
-    while (fgets(line, sizeof(line), tool_list) && keep_running) {
-        line[strcspn(line, "\n")] = 0;
-        
-        if (strlen(line) > 0) {
-            strncpy(g_progress.current_package, line, MAX_LINE_LENGTH - 1);
-            g_progress.current_package[MAX_LINE_LENGTH - 1] = '\0';
-            
-            float progress = ((float)g_progress.completed_packages / g_progress.total_packages) * 100.0;
-            show_smooth_progress(line, progress);
-            
-    char install_cmd[MAX_CMD_LENGTH];
-    if (sys_type == SYSTEM_ARCH) {
-        snprintf(install_cmd, sizeof(install_cmd),
-                "pacman -S --noconfirm --needed --overwrite=\"*\" %s >/dev/null 2>%s",
-                line, PACMAN_OUTPUT_FILE);
-    } else {
-        snprintf(install_cmd, sizeof(install_cmd),
-                "DEBIAN_FRONTEND=noninteractive apt-get install -y %s >/dev/null 2>%s",
-                line, PACMAN_OUTPUT_FILE);
+    FILE* replies = fdopen(fd, "r+");
+    if (!replies) {
+        close(fd);
+        return 0;
     }
-            
-            if (!execute_command(install_cmd)) {
-                char error_msg[MAX_LINE_LENGTH];
-                snprintf(error_msg, sizeof(error_msg), "Failed to install: %s", line);
-                log_message(error_msg, "error");
-            }
-            
-            g_progress.completed_packages++;
-            usleep(LOADER_UPDATE_INTERVAL);
+    fprintf(replies, "%s\n", providers);
+    fflush(replies);
+    
+    int installed = 0;
+    char line[MAX_LINE_LENGTH];
+    while (fgets(line, sizeof(line), replies)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "info ", 5) == 0) {
+            fprintf(stderr, "%s%s %s%s\n", FG_WHITE, SYMBOL_INFO, line + 5, RESET);
+        } else if (strncmp(line, "ok ", 3) == 0) {
+            fprintf(stderr, "%s%s %s%s\n", FG_GREEN, SYMBOL_SUCCESS, line + 3, RESET);
+            installed = 1;
+            break;
+        } else if (strncmp(line, "error ", 6) == 0) {
+            fprintf(stderr, "%s%s %s%s\n", FG_RED, SYMBOL_ERROR, line + 6, RESET);
+            break;
         }
     }
+    fclose(replies);
+    return installed;
+}
+
+/* command-not-found subcommand, for the shell hook: exits 127 like the shell
+ * would unless the tool providing the command gets installed */
+int run_command_not_found(void) {
+    const char* name = g_config.command_args[0];
+    SystemType sys_type = detect_system_type();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CommandIndex index;
+    if (sys_type == SYSTEM_UNKNOWN || !command_index_open(&index, sys_type)) {
+        fprintf(stderr, "%s: command not found\n", name);
+        return 127;
+    }
+    if (g_config.benchmark_runs > 0) {
+        benchmark_command_lookup(&index, name, g_config.benchmark_runs, elapsed_ms(&start));
+        command_index_close(&index);
+        return 0;
+    }
     
-    show_smooth_progress("Installation Complete", 100.0);
-    printf("\n");
+    const char* providers = command_index_lookup(&index, name);
+    if (!providers) {
+        command_index_close(&index);
+        fprintf(stderr, "%s: command not found\n", name);
+        return 127;
+    }
+    fprintf(stderr, "%s%s %s is provided by %s, installing it%s\n", FG_CYAN, SYMBOL_INFO, name, providers, RESET);
+    int installed = request_tool_install(providers);
+    command_index_close(&index);
+    return installed ? 0 : 127;
+}
+
+void free_serve_state(ServeState* state) {
+    catalog_destroy(state->catalog);
+    free(state->allowed);
+    memset(state, 0, sizeof(*state));
+}
+
+/* Reopens the catalog and rebuilds the command index whenever the sync
+ * databases changed since the last request */
+int refresh_serve_state(SystemType sys_type, ServeState* state) {
+    uint64_t stamp = sync_db_stamp(sys_type);
+    if (state->catalog && stamp == state->stamp) {
+        return 1;
+    }
+    free_serve_state(state);
     
-    fclose(tool_list);
-    restore_output();
+    Catalog* catalog = catalog_open(sys_type);
+    if (!catalog || catalog->count == 0 || !plan_selection(sys_type, catalog)) {
+        catalog_destroy(catalog);
+        log_message("Package catalog unavailable", "error");
+        return 0;
+    }
+    expand_planned_groups(catalog);
+    state->allowed = calloc(catalog->count + 1, 1);
+    if (!state->allowed) {
+        catalog_destroy(catalog);
+        return 0;
+    }
+    for (uint32_t id = 0; id < catalog->count; id++) {
+        state->allowed[id] = (catalog->flags[id] & PKG_FLAG_PLANNED) != 0;
+        state->allowed_count += state->allowed[id];
+        catalog_unplan(catalog, id);
+    }
+    state->catalog = catalog;
+    state->stamp = stamp;
     
-    char completion_msg[MAX_LINE_LENGTH];
-    snprintf(completion_msg, sizeof(completion_msg),
-            "Completed installation of %d/%d packages",
-            g_progress.completed_packages, g_progress.total_packages);
-    log_message(completion_msg, "info");
+    CommandIndex index;
+    int current = command_index_open(&index, sys_type) && index.header->source_stamp == stamp;
+    command_index_close(&index);
+    uint32_t count;
+    if (!current && !build_command_index(sys_type, stamp, &count)) {
+        log_message("No file lists to build the command index from", "warning");
+    }
+    return 1;
+}
+
+/* Reads one request line. The client has COMMAND_REQUEST_TIMEOUT for the
+ * whole line, however it trickles in, so it cannot hold the service. */
+int read_request_line(int fd, char* line, size_t size) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t length = 0;
+    while (length + 1 < size) {
+        int remaining = COMMAND_REQUEST_TIMEOUT - (int)elapsed_ms(&start);
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (remaining <= 0 || poll(&pfd, 1, remaining) <= 0) {
+            return 0;
+        }
+        ssize_t got = read(fd, line + length, size - length - 1);
+        if (got <= 0) {
+            return 0;
+        }
+        length += got;
+        line[length] = '\0';
+        char* newline = strchr(line, '\n');
+        if (newline) {
+            *newline = '\0';
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Installs one requested tool and its dependency closure. The request names
+ * every provider of a command; the first that the configured selection
+ * covers is installed, whoever asks, and the others are never considered. */
+void serve_install_request(SystemType sys_type, ServeState* state, int client) {
+    char request[MAX_LINE_LENGTH];
+    if (!read_request_line(client, request, sizeof(request))) {
+        return;
+    }
+    struct ucred peer = { .pid = 0, .uid = (uid_t)-1, .gid = (gid_t)-1 };
+    socklen_t peer_length = sizeof(peer);
+    getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length);
+    
+    char request_msg[MAX_LINE_LENGTH];
+    snprintf(request_msg, sizeof(request_msg), "Install requested by uid %d: %.200s", (int)peer.uid, request);
+    log_message(request_msg, "info");
+    
+    if (!refresh_serve_state(sys_type, state)) {
+        dprintf(client, "error package catalog unavailable\n");
+        return;
+    }
+    Catalog* catalog = state->catalog;
+    uint32_t id = NO_PACKAGE;
+    for (char* save = NULL, *provider = strtok_r(request, " ", &save); provider && id == NO_PACKAGE;
+         provider = strtok_r(NULL, " ", &save)) {
+        uint32_t candidate = is_valid_package_name(provider) ? catalog_find(catalog, provider) : NO_PACKAGE;
+        if (candidate != NO_PACKAGE && state->allowed[candidate]) {
+            id = candidate;
+        }
+    }
+    if (id == NO_PACKAGE) {
+        dprintf(client, "error no provider is a tool the configured selection installs\n");
+        return;
+    }
+    const char* name = package_name(catalog, id);
+    if (!create_lock_file()) {
+        dprintf(client, "error another blackutility run is in progress\n");
+        return;
+    }
+    
+    catalog->states[id] = PKG_PENDING;
+    catalog->retries[id] = 0;
+    catalog_plan(catalog, id);
+    InstallPlan plan;
+    plan_install(sys_type, catalog, &plan);
+    char reason[MAX_LINE_LENGTH];
+    if (!plan.order) {
+        dprintf(client, "error out of memory planning the install\n");
+    } else if (plan.closure == 0) {
+        dprintf(client, "ok %s is already installed\n", name);
+    } else if (!plan_fits(&plan, reason, sizeof(reason))) {
+        dprintf(client, "error %s\n", reason);
+    } else {
+        dprintf(client, "info installing %u packages (%.2f MB to download, %.2f MB installed)\n",
+                plan.closure, plan.download_bytes / (1024.0*1024.0), plan.install_bytes / (1024.0*1024.0));
+        install_batch(sys_type, catalog, &id, 1);
+        if (catalog->states[id] == PKG_INSTALLED) {
+            dprintf(client, "ok installed %s\n", name);
+        } else {
+            dprintf(client, "error installing %s failed, see " LOG_FILE "\n", name);
+        }
+    }
+    free(plan.order);
+    catalog_unplan(catalog, id);
+    release_lock_file();
+}
+
+/* serve subcommand: the resident side of command-not-found. Holds the
+ * catalog open and installs requested tools one at a time, taking the run
+ * lock for each so it never overlaps a full run. */
+int run_serve_command(void) {
+    SystemType sys_type = detect_system_type();
+    if (sys_type == SYSTEM_UNKNOWN) {
+        fprintf(stderr, "%sUnsupported system type%s\n", FG_RED, RESET);
+        return 1;
+    }
+    if (!check_root_privileges()) {
+        fprintf(stderr, "%sThe install service requires root privileges%s\n", FG_RED, RESET);
+        return 1;
+    }
+    size_concurrency();
+    initialize_logging();
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+    atexit(cleanup_resources);
+    
+    ServeState state;
+    memset(&state, 0, sizeof(state));
+    if (!refresh_serve_state(sys_type, &state)) {
+        fprintf(stderr, "%sPackage catalog unavailable%s\n", FG_RED, RESET);
+        return 1;
+    }
+    
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, COMMAND_SOCKET, sizeof(address.sun_path) - 1);
+    unlink(COMMAND_SOCKET);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        chmod(COMMAND_SOCKET, 0666) != 0 || listen(listen_fd, 16) != 0) {
+        fprintf(stderr, "%sCannot listen on %s: %s%s\n", FG_RED, COMMAND_SOCKET, strerror(errno), RESET);
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+        free_serve_state(&state);
+        return 1;
+    }
+    printf("%s%s Serving installs on %s (%u tools selectable)%s\n", FG_GREEN, SYMBOL_SUCCESS,
+           COMMAND_SOCKET, state.allowed_count, RESET);
+    fflush(stdout);
+    log_message("Install service started", "info");
+    
+    while (keep_running) {
+        struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client >= 0) {
+            serve_install_request(sys_type, &state, client);
+            close(client);
+        }
+    }
+    
+    close(listen_fd);
+    unlink(COMMAND_SOCKET);
+    free_serve_state(&state);
+    log_message("Install service stopped", "info");
+    return 0;
 }
 
 /* Cleanup Function */
 void cleanup_resources(void) {
+    journal_close(0);
     if (access(TEMP_FILE, F_OK) != -1) {
         remove(TEMP_FILE);
     }
-    if (access(TEMP_KEYRING_DEB, F_OK) != -1) {
-        remove(TEMP_KEYRING_DEB);
-    }
+    remove_download_config();
     cleanup_logging();
     printf("%s", RESET);
     fflush(stdout);
     release_lock_file();
 }
 
+/* Command Line Handling */
+void print_usage(const char* prog) {
+    printf("Usage: %s [options]\n"
+           "       %s [options] plan [--output FILE]\n"
+           "       %s [options] apply FILE\n"
+           "       %s [options] upgrade\n"
+           "       %s [options] remove [TOOL...]\n"
+           "       %s [options] footprint [TOOL...]\n"
+           "       %s [options] usage [--watch]\n"
+           "       %s [options] prune --unused-for DURATION\n"
+           "       %s [options] command-index | serve\n"
+           "       %s [--benchmark N] command-not-found COMMAND\n"
+           "       %s vercmp [VERSION VERSION]\n"
+           "       %s [options] search QUERY...\n\n"
+           "Commands:\n"
+           "  plan                   Resolve and size the install without changing anything\n"
+           "  apply FILE             Install exactly what a plan written with --output pins\n"
+           "  upgrade                Install only newer versions of selected tools already installed\n"
+           "  remove [TOOL...]       Remove tools, groups or --profile selections with the\n"
+           "                         dependencies only they needed\n"
+           "  footprint [TOOL...]    Rank tools by the space removing each would free\n"
+           "  usage                  List installed tools by last use; --watch records executions\n"
+           "  prune                  Remove installed tools unused for the --unused-for period\n"
+           "  command-index          Index which package provides each command, from the file lists\n"
+           "  serve                  Install selected tools on request from command-not-found\n"
+           "  command-not-found CMD  Shell hook: have the service install the tool providing CMD\n"
+           "  vercmp [A B]           Compare two versions (-1, 0, 1), or without arguments check the\n"
+           "                         native ordering against vercmp or dpkg\n"
+           "  search QUERY...        Rank catalog packages by name, group and description\n\n"
+           "Options:\n"
+           "  --nice N               Nice level for package manager children (default %d)\n"
+           "  --ionice CLASS[:LEVEL] I/O class for children: idle, best-effort, realtime, none\n"
+           "                         (default best-effort:%d)\n"
+           "  --sched-idle           Run children under SCHED_IDLE\n"
+           "  --download-jobs N      Parallel downloads before throttling (default: by link speed)\n"
+           "  --psi-cpu PCT          CPU pressure (some avg10) that pauses work (default %.0f)\n"
+           "  --psi-io PCT           I/O pressure that pauses work (default %.0f)\n"
+           "  --psi-memory PCT       Memory pressure that pauses work (default %.0f)\n"
+           "  --psi-max-pause SECS   Longest single pause under pressure (default %d)\n"
+           "  --no-psi               Disable pressure-based throttling\n"
+           "  --resume               Continue an interrupted run from its journal\n"
+           "  --sync-max-age SECS    Trust verified package databases this long (default %d)\n"
+           "  --force-sync           Always refresh package databases, even on an unchanged host\n"
+           "  --setup-jobs N         Preparation steps run in parallel (default: by CPU count)\n"
+           "  --batch-size N         Packages per install transaction (default: by RAM)\n"
+           "  --profile NAME[,NAME]  Install only what the named tool profiles select\n"
+           "                         (from " PROFILE_DIR ", or a path)\n"
+           "  --new-only             Install only selected packages added or renamed since the\n"
+           "                         last complete run\n"
+           "  --dry-run              Same as the plan command; with remove, only print the plan\n"
+           "  --output FILE          Pin the planned archives, checksums and batches to FILE\n"
+           "  --json                 Print the footprint report as JSON\n"
+           "  --unused-for DURATION  Idle time before prune removes a tool: N plus s, m, h, d or w\n"
+           "  --time-budget DURATION Install what fits in DURATION by priority and past durations,\n"
+           "                         leaving the rest for the next budgeted run\n"
+           "  --benchmark N          Repeat a search, vercmp or command lookup N times and report\n"
+           "                         its latency\n"
+           "  -h, --help             Show this help\n",
+           prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, DEFAULT_NICE_LEVEL, DEFAULT_IOPRIO_LEVEL,
+           PSI_CPU_THRESHOLD, PSI_IO_THRESHOLD, PSI_MEMORY_THRESHOLD, PSI_MAX_PAUSE_SECONDS,
+           DEFAULT_SYNC_MAX_AGE);
+}
+
+int parse_int_option(const char* value, long min, long max, int* out) {
+    char* end;
+    long parsed = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || parsed < min || parsed > max) {
+        return 0;
+    }
+    *out = (int)parsed;
+    return 1;
+}
+
+/* Durations such as 90d or 12h; a bare number is days */
+int parse_duration(const char* value, int* seconds) {
+    char* end;
+    long amount = strtol(value, &end, 10);
+    long unit = 86400;
+    if (*end == 's') unit = 1;
+    else if (*end == 'm') unit = 60;
+    else if (*end == 'h') unit = 3600;
+    else if (*end == 'w') unit = 7 * 86400;
+    else if (*end != 'd' && *end != '\0') return 0;
+    if (*end != '\0' && end[1] != '\0') return 0;
+    if (end == value || amount < 0 || amount > INT_MAX / unit) return 0;
+    *seconds = (int)(amount * unit);
+    return 1;
+}
+
+int parse_ionice(const char* value) {
+    char class_name[32] = {0};
+    int level = g_config.ioprio_level;
+    
+    const char* colon = strchr(value, ':');
+    size_t len = colon ? (size_t)(colon - value) : strlen(value);
+    if (len >= sizeof(class_name)) {
+        return 0;
+    }
+    memcpy(class_name, value, len);
+    
+    if (colon) {
+        char* end;
+        level = (int)strtol(colon + 1, &end, 10);
+        if (*end != '\0' || level < 0 || level > 7) {
+            return 0;
+        }
+    }
+    
+    if (strcmp(class_name, "idle") == 0) {
+        g_config.ioprio_class = IOPRIO_CLASS_IDLE;
+        level = 0;
+    } else if (strcmp(class_name, "best-effort") == 0) {
+        g_config.ioprio_class = IOPRIO_CLASS_BE;
+    } else if (strcmp(class_name, "realtime") == 0) {
+        g_config.ioprio_class = IOPRIO_CLASS_RT;
+    } else if (strcmp(class_name, "none") == 0) {
+        g_config.ioprio_class = IOPRIO_CLASS_NONE;
+        level = 0;
+    } else {
+        return 0;
+    }
+    
+    g_config.ioprio_level = level;
+    return 1;
+}
+
+/* Returns 1 to continue, 0 on a usage error and -1 when the program should exit cleanly */
+int parse_arguments(int argc, char** argv) {
+    static const struct option long_options[] = {
+        {"nice",       required_argument, NULL, 'n'},
+        {"ionice",     required_argument, NULL, 'i'},
+        {"sched-idle", no_argument,       NULL, 'I'},
+        {"download-jobs", required_argument, NULL, 'j'},
+        {"psi-cpu",    required_argument, NULL, 'C'},
+        {"psi-io",     required_argument, NULL, 'O'},
+        {"psi-memory", required_argument, NULL, 'M'},
+        {"psi-max-pause", required_argument, NULL, 'P'},
+        {"no-psi",     no_argument,       NULL, 'N'},
+        {"resume",     no_argument,       NULL, 'R'},
+        {"sync-max-age", required_argument, NULL, 'A'},
+        {"force-sync", no_argument,       NULL, 'F'},
+        {"setup-jobs", required_argument, NULL, 'S'},
+        {"batch-size", required_argument, NULL, 'B'},
+        {"benchmark",  required_argument, NULL, 'b'},
+        {"profile",    required_argument, NULL, 'p'},
+        {"dry-run",    no_argument,       NULL, 'D'},
+        {"output",     required_argument, NULL, 'o'},
+        {"new-only",   no_argument,       NULL, 'w'},
+        {"json",       no_argument,       NULL, 'J'},
+        {"watch",      no_argument,       NULL, 'W'},
+        {"unused-for", required_argument, NULL, 'U'},
+        {"time-budget", required_argument, NULL, 'T'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                if (!parse_int_option(optarg, -20, 19, &g_config.nice_level)) {
+                    fprintf(stderr, "%sInvalid nice level: %s%s\n", FG_RED, optarg, RESET);
+                    return 0;
+                }
+                break;
+            case 'i':
+                if (!parse_ionice(optarg)) {
+                    fprintf(stderr, "%sInvalid I/O priority: %s%s\n", FG_RED, optarg, RESET);
+                    return 0;
+                }
+                break;
+            case 'I':
+                g_config.sched_idle = 1;
+                break;
+            case 'j':
+                if (!parse_int_option(optarg, 1, MAX_DOWNLOAD_JOBS, &g_config.download_jobs)) {
+                    fprintf(stderr, "%sInvalid download job count: %s%s\n", FG_RED, optarg, RESET);
+                    return 0;
+                }
+                break;
+            case 'C':
+            case 'O':
+            case 'M': {
+                char* end;
+                double threshold = strtod(optarg, &end);
+                if (*end != '\0' || threshold < 0 || threshold > 100) {
+                    fprintf(stderr, "%sInvalid pressure threshold: %s%s\n", FG_RED, optarg, RESET);
+                    return 0;
+                }
+                if (opt == 'C') g_config.psi_cpu_threshold = threshold;
+                else if (opt == 'O') g_config.psi_io_threshold = threshold;
+                else g_config.psi_memory_threshold = threshold;
+                break;
+            }
+            case 'P':
+                if (!parse_int_option(optarg, 0, INT_MAX, &g_config.psi_max_pause)) {
+                    fprintf(stderr, "%sInvalid pause limit: %s%s\n", FG_RED, optarg, RESET);
+                    return 0;
+                }
+                break;
+            case 'N':
+                g_config.psi_enabled = 0;
+                break;
+            case 'R':
+                g_config.resume = 1;
+                break;
+            case 'A':
+                if (!parse_int_option(optarg, 0, INT_MAX, &g_config.sync_max_age)) {
+                    fprintf(stderr, "%sInvalid database age: %s%s\n", FG_RED, optarg, RESET);
+                    return 0;
+                }
+                break;
+            case 'F':
+                g_config.force_sync = 1;
+                break;
+            case 'S':
+                if (!parse_int_option(optarg, 1, MAX_SETUP_JOBS, &g_config.setup_jobs)) {
+                    fprintf(stderr, "%sInvalid setup job count: %s%s\n", FG_RED, optarg, RESET);
+                    return 0;
+                }
+                break;
+            case 'B':
+                if (!parse_int_option(optarg, 1, MAX_BATCH_SIZE, &g_config.batch_size)) {
+                    fprintf(stderr, "%sInvalid batch size: %s%s\n", FG_RED, optarg, RESET);
+                    return 0;
+                }
+                break;
+            case 'b':
+                if (!parse_int_option(optarg, 1, 1000000, &g_config.benchmark_runs)) {
+                    fprintf(stderr, "%sInvalid benchmark run count: %s%s\n", FG_RED, optarg, RESET);
+                    return 0;
+                }
+                break;
+            case 'p': {
+                char* save = NULL;
+                for (char* name = strtok_r(optarg, ",", &save); name;
+                     name = strtok_r(NULL, ",", &save)) {
+                    if (g_config.profile_count == MAX_PROFILES) {
+                        fprintf(stderr, "%sAt most %d profiles can be combined%s\n",
+                                FG_RED, MAX_PROFILES, RESET);
+                        return 0;
+                    }
+                    g_config.profiles[g_config.profile_count++] = name;
+                }
+                break;
+            }
+            case 'D':
+                g_config.dry_run = 1;
+                break;
+            case 'o':
+                g_config.plan_output = optarg;
+                break;
+            case 'w':
+                g_config.new_only = 1;
+                break;
+            case 'J':
+                g_config.json_output = 1;
+                break;
+            case 'W':
+                g_config.watch_usage = 1;
+                break;
+            case 'U':
+                if (!parse_duration(optarg, &g_config.unused_for) || g_config.unused_for == 0) {
+                    fprintf(stderr, "%sInvalid duration: %s%s\n", FG_RED, optarg, RESET);
+                    return 0;
+                }
+                break;
+            case 'T':
+                if (!parse_duration(optarg, &g_config.time_budget) || g_config.time_budget == 0) {
+                    fprintf(stderr, "%sInvalid time budget: %s%s\n", FG_RED, optarg, RESET);
+                    return 0;
+                }
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return -1;
+            default:
+                print_usage(argv[0]);
+                return 0;
+        }
+    }
+    
+    if (optind < argc && strcmp(argv[optind], "plan") == 0) {
+        if (optind + 1 < argc) {
+            fprintf(stderr, "%sUnexpected argument: %s%s\n", FG_RED, argv[optind + 1], RESET);
+            return 0;
+        }
+        g_config.command = COMMAND_PLAN;
+    } else if (optind < argc && strcmp(argv[optind], "apply") == 0) {
+        if (optind + 2 != argc) {
+            fprintf(stderr, "%sApply needs exactly one plan file%s\n", FG_RED, RESET);
+            return 0;
+        }
+        g_config.command = COMMAND_APPLY;
+        g_config.command_args = argv + optind + 1;
+        g_config.command_arg_count = 1;
+    } else if (optind < argc && strcmp(argv[optind], "upgrade") == 0) {
+        if (optind + 1 < argc) {
+            fprintf(stderr, "%sUnexpected argument: %s%s\n", FG_RED, argv[optind + 1], RESET);
+            return 0;
+        }
+        if (g_config.new_only) {
+            fprintf(stderr, "%s--new-only and upgrade select different packages%s\n", FG_RED, RESET);
+            return 0;
+        }
+        g_config.command = COMMAND_UPGRADE;
+    } else if (optind < argc && strcmp(argv[optind], "vercmp") == 0) {
+        if (argc - optind - 1 != 0 && argc - optind - 1 != 2) {
+            fprintf(stderr, "%sVercmp takes two versions, or none to self-check%s\n", FG_RED, RESET);
+            return 0;
+        }
+        g_config.command = COMMAND_VERCMP;
+        g_config.command_args = argv + optind + 1;
+        g_config.command_arg_count = argc - optind - 1;
+    } else if (optind < argc && strcmp(argv[optind], "remove") == 0) {
+        if (optind + 1 == argc && g_config.profile_count == 0) {
+            fprintf(stderr, "%sRemove needs tool names or --profile%s\n", FG_RED, RESET);
+            return 0;
+        }
+        g_config.command = COMMAND_REMOVE;
+        g_config.command_args = argv + optind + 1;
+        g_config.command_arg_count = argc - optind - 1;
+    } else if (optind < argc && (strcmp(argv[optind], "usage") == 0 || strcmp(argv[optind], "prune") == 0)) {
+        if (optind + 1 < argc) {
+            fprintf(stderr, "%sUnexpected argument: %s%s\n", FG_RED, argv[optind + 1], RESET);
+            return 0;
+        }
+        g_config.command = (argv[optind][0] == 'u') ? COMMAND_USAGE : COMMAND_PRUNE;
+        if (g_config.command == COMMAND_PRUNE && g_config.unused_for == 0) {
+            fprintf(stderr, "%sPrune needs --unused-for%s\n", FG_RED, RESET);
+            return 0;
+        }
+    } else if (optind < argc && (strcmp(argv[optind], "command-index") == 0 || strcmp(argv[optind], "serve") == 0)) {
+        if (optind + 1 < argc) {
+            fprintf(stderr, "%sUnexpected argument: %s%s\n", FG_RED, argv[optind + 1], RESET);
+            return 0;
+        }
+        g_config.command = (argv[optind][0] == 'c') ? COMMAND_INDEX : COMMAND_SERVE;
+    } else if (optind < argc && strcmp(argv[optind], "command-not-found") == 0) {
+        if (optind + 2 != argc) {
+            fprintf(stderr, "%sCommand-not-found needs exactly one command name%s\n", FG_RED, RESET);
+            return 0;
+        }
+        g_config.command = COMMAND_NOT_FOUND;
+        g_config.command_args = argv + optind + 1;
+        g_config.command_arg_count = 1;
+    } else if (optind < argc && strcmp(argv[optind], "footprint") == 0) {
+        g_config.command = COMMAND_FOOTPRINT;
+        g_config.command_args = argv + optind + 1;
+        g_config.command_arg_count = argc - optind - 1;
+    } else if (optind < argc) {
+        if (strcmp(argv[optind], "search") != 0) {
+            fprintf(stderr, "%sUnknown command: %s%s\n", FG_RED, argv[optind], RESET);
+            return 0;
+        }
+        if (optind + 1 >= argc) {
+            fprintf(stderr, "%sSearch needs a query%s\n", FG_RED, RESET);
+            return 0;
+        }
+        g_config.command = COMMAND_SEARCH;
+        g_config.command_args = argv + optind + 1;
+        g_config.command_arg_count = argc - optind - 1;
+    }
+    
+    if (g_config.time_budget > 0 && (g_config.dry_run ||
+        (g_config.command != COMMAND_INSTALL && g_config.command != COMMAND_UPGRADE))) {
+        fprintf(stderr, "%s--time-budget only applies to installs and upgrade%s\n", FG_RED, RESET);
+        return 0;
+    }
+    if (g_config.json_output && g_config.command != COMMAND_FOOTPRINT) {
+        fprintf(stderr, "%s--json only applies to the footprint command%s\n", FG_RED, RESET);
+        return 0;
+    }
+    if (g_config.dry_run && g_config.command == COMMAND_INSTALL) {
+        g_config.command = COMMAND_PLAN;
+    } else if (g_config.dry_run && g_config.command != COMMAND_PLAN && g_config.command != COMMAND_REMOVE &&
+               g_config.command != COMMAND_PRUNE) {
+        fprintf(stderr, "%s--dry-run only applies to installs, remove and prune%s\n", FG_RED, RESET);
+        return 0;
+    }
+    return 1;
+}
+
 /* Main Program Entry */
-int main(void) {
+int main(int argc, char** argv) {
+    int parsed = parse_arguments(argc, argv);
+    if (parsed <= 0) {
+        return parsed == 0 ? 1 : 0;
+    }
+    if (g_config.command == COMMAND_SEARCH) {
+        return run_search_command();
+    }
+    if (g_config.plan_output && g_config.command != COMMAND_PLAN) {
+        fprintf(stderr, "%s--output only applies to the plan command%s\n", FG_RED, RESET);
+        return 1;
+    }
+    if (g_config.command == COMMAND_PLAN) {
+        return run_plan_command();
+    }
+    if (g_config.command == COMMAND_APPLY) {
+        return run_apply_command();
+    }
+    if (g_config.command == COMMAND_VERCMP) {
+        return run_vercmp_command();
+    }
+    if (g_config.command == COMMAND_REMOVE) {
+        return run_remove_command();
+    }
+    if (g_config.command == COMMAND_FOOTPRINT) {
+        return run_footprint_command();
+    }
+    if (g_config.command == COMMAND_USAGE) {
+        return run_usage_command();
+    }
+    if (g_config.command == COMMAND_PRUNE) {
+        return run_prune_command();
+    }
+    if (g_config.command == COMMAND_INDEX) {
+        return run_command_index_command();
+    }
+    if (g_config.command == COMMAND_NOT_FOUND) {
+        return run_command_not_found();
+    }
+    if (g_config.command == COMMAND_SERVE) {
+        return run_serve_command();
+    }
+    
+    // A budgeted run picks up the checkpoint an earlier window left, as long
+    // as that window was working on the same selection
+    if (g_config.time_budget > 0 && !g_config.resume && access(JOURNAL_FILE, F_OK) == 0) {
+        if (journal_matches_selection(detect_system_type())) {
+            g_config.resume = 1;
+        } else {
+            fprintf(stderr, "%sThe leftover journal is for a different selection; starting over "
+                    "(use --resume to finish it instead)%s\n", FG_YELLOW, RESET);
+        }
+    }
+    
+    // Nightly runs on an unchanged host end here, before any sync or lock
+    time_t unchanged_since;
+    SystemType sys_type = detect_system_type();
+    if (!g_config.force_sync && !g_config.resume && sys_type != SYSTEM_UNKNOWN &&
+        run_is_unchanged(sys_type, &unchanged_since)) {
+        char since[32];
+        strftime(since, sizeof(since), "%Y-%m-%d %H:%M", localtime(&unchanged_since));
+        printf("%s%s Nothing to do: nothing changed since the run completed %s%s\n",
+               FG_GREEN, SYMBOL_SUCCESS, since, RESET);
+        return 0;
+    }
+    g_report.start_time = time(NULL);
+    
     // Initialize terminal
     if (enable_raw_mode() == -1) {
         fprintf(stderr, "Failed to initialize terminal\n");
@@ -702,6 +10425,9 @@ int main(void) {
         return 1;
     }
 
+    // Probe the host once and size concurrency from it
+    size_concurrency();
+
     // Check system requirements
     if (!check_system_requirements()) {
         print_modern_box("SYSTEM REQUIREMENTS NOT MET", FG_RED, SYMBOL_ERROR);
@@ -730,13 +10456,25 @@ int main(void) {
         return 1;
     }
 
-    // Generate tool list and install packages
-    if (!generate_tool_list()) {
-        log_message("Failed to generate tool list", "error");
-        return 1;
+    // Resume an interrupted run, or generate the tool list and install packages
+    Catalog* resumed = NULL;
+    if (g_config.resume && journal_load(detect_system_type(), &resumed)) {
+        char resume_msg[MAX_LINE_LENGTH];
+        snprintf(resume_msg, sizeof(resume_msg),
+                "Resuming interrupted run with %u planned packages", resumed->planned);
+        log_message(resume_msg, "info");
+    } else {
+        if (access(JOURNAL_FILE, F_OK) == 0 && !g_config.resume) {
+            log_message("Discarding journal of an interrupted run (use --resume to continue it)", "info");
+        }
+        if (!generate_tool_list()) {
+            log_message("Failed to generate tool list", "error");
+            return 1;
+        }
     }
 
-    install_tools();
+    install_tools(resumed);
+    print_run_report();
 
     // Cleanup and exit
     log_message("Cleaning up...", "info");
@@ -0,0 +1,15 @@
+# Forensics: disk, memory and file analysis
+
+# BlackArch
+include group blackarch-forensic
+include regex ^(volatility|sleuthkit|autopsy)
+
+# Kali metapackage
+include glob kali-tools-forensics
+
+exclude glob *-git
+
+pin binwalk
+
+# Usable before the rest of the selection arrives
+tier 0 regex ^(binwalk|volatility3?|sleuthkit)$
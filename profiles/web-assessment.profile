@@ -0,0 +1,20 @@
+# Web application assessment: proxies, scanners and fuzzers for HTTP targets
+
+# BlackArch
+include group blackarch-webapp
+include group blackarch-proxy
+include group blackarch-fuzzer
+
+# Kali metapackage
+include glob kali-tools-web
+
+# Development snapshots duplicate the packaged releases
+exclude glob *-git
+
+max-size 512 MiB
+
+pin nmap
+pin sqlmap
+
+# Usable before the rest of the selection arrives
+tier 0 regex ^(nmap|sqlmap|burpsuite|ffuf)$
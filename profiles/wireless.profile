@@ -0,0 +1,18 @@
+# Wireless: 802.11, Bluetooth and software defined radio
+
+# BlackArch
+include group blackarch-wireless
+include group blackarch-bluetooth
+include group blackarch-radio
+
+# Kali metapackages
+include glob kali-tools-802-11
+include glob kali-tools-bluetooth
+include glob kali-tools-rfid
+include glob kali-tools-sdr
+
+exclude glob *-git
+
+max-size 512 MiB
+
+pin aircrack-ng